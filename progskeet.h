@@ -45,11 +45,27 @@ extern "C" {
 
 #define PROGSKEET_VERSION "0.0.1"
 
+/* Invalid arguments */
+#define PROGSKEET_ERR_ARGS          -1
+/* No such device, chip or address */
+#define PROGSKEET_ERR_NOT_FOUND     -2
+/* Out of memory */
+#define PROGSKEET_ERR_ALLOC         -3
+/* USB or file IO failed */
+#define PROGSKEET_ERR_IO            -4
+/* Read back data did not match */
+#define PROGSKEET_ERR_VERIFY        -5
+/* Returned when progskeet_cancel stopped the operation */
+#define PROGSKEET_ERR_CANCELLED     -6
+/* Returned when the deadline set with progskeet_set_deadline passed */
+#define PROGSKEET_ERR_DEADLINE      -7
+
 /*
  * CAUTION: ANYTHING IS POSSIBLE WITH ... THE HANDLE!
  */
 
 struct progskeet_handle;
+struct progskeet_context;
 
 struct progskeet_config
 {
@@ -64,6 +80,336 @@ struct progskeet_config
     int abort_on_error;
 };
 
+/* Digests that can be computed while dumping */
+#define PROGSKEET_HASH_NONE         0x00
+#define PROGSKEET_HASH_CRC32C       (1 << 0)
+#define PROGSKEET_HASH_SHA256       (1 << 1)
+
+struct progskeet_digest
+{
+    /* PROGSKEET_HASH_* flags of the valid digests */
+    int flags;
+
+    uint32_t crc32c;
+    uint8_t sha256[32];
+};
+
+/* Why a sync stopped short */
+enum progskeet_sync_error
+{
+    progskeet_sync_error_none = 0,
+    /* progskeet_cancel was called, the sync returns PROGSKEET_ERR_CANCELLED */
+    progskeet_sync_error_cancelled,
+    /* The deadline passed, the sync returns PROGSKEET_ERR_DEADLINE */
+    progskeet_sync_error_deadline,
+    /* The endpoint stalled again after its retries, the sync returns -4 */
+    progskeet_sync_error_stall,
+    /* The device went away, every later sync returns -4 */
+    progskeet_sync_error_disconnect,
+    /* Any other USB failure, the sync returns -4 */
+    progskeet_sync_error_io,
+};
+
+/* Progress of the sync in flight, or of the last one */
+struct progskeet_sync_status
+{
+    enum progskeet_sync_error error;
+
+    /* Bytes of the command stream the device took */
+    size_t tx_done;
+    size_t tx_total;
+
+    /* Readback bytes that arrived */
+    size_t rx_done;
+    size_t rx_total;
+
+    /* Transfers resubmitted after a timeout or a cleared stall */
+    uint32_t retries;
+};
+
+/* Passed to the progress callback, rates are in bytes per second */
+struct progskeet_progress
+{
+    uint64_t done;
+    uint64_t total;
+
+    /* Since the last report and since the operation started */
+    uint64_t rate;
+    uint64_t avg_rate;
+
+    /* Time left at the average rate, -1 while there is no rate yet */
+    int64_t eta_ms;
+};
+
+typedef void (*progskeet_progress_cb)(struct progskeet_handle* handle, const struct progskeet_progress* progress, void* user_data);
+
+struct progskeet_cache_stats
+{
+    /* Reads served completely from the cache */
+    uint64_t hits;
+    /* Reads that had to fetch at least one line */
+    uint64_t misses;
+
+    uint64_t prefetches;
+    uint64_t invalidations;
+
+    /* Every hit is a read that needed no USB round trip */
+    uint64_t saved_round_trips;
+};
+
+#define PROGSKEET_NOR_MAX_REGIONS 4
+
+struct progskeet_nor_region
+{
+    uint32_t blocks;
+    /* Bytes */
+    uint32_t block_size;
+};
+
+/* Geometry and timing of a NOR flash, filled in from its CFI table */
+struct progskeet_nor_info
+{
+    /* GPIO mask of RY/BY#, set by the caller, kept by the CFI functions */
+    uint16_t ready_gpio;
+
+    /* Bytes per bus address, 1 or 2 */
+    int bus_width;
+
+    uint16_t cmd_set;
+    uint16_t interface;
+
+    /* Bytes */
+    uint32_t size;
+    uint32_t write_buffer;
+
+    /* Worst case times from CFI */
+    uint32_t word_program_us;
+    uint32_t buffer_program_us;
+    uint32_t block_erase_ms;
+    uint32_t chip_erase_ms;
+
+    int nregions;
+    struct progskeet_nor_region regions[PROGSKEET_NOR_MAX_REGIONS];
+};
+
+/* Erase blocks progskeet_nor_probe reads the protection of */
+#define PROGSKEET_NOR_MAX_BLOCKS 4096
+
+struct progskeet_nor_id
+{
+    uint16_t manufacturer;
+
+    /* Device ID words, AMD parts with a 0x7E device code have two more */
+    uint16_t device[3];
+};
+
+/* A NOR flash as found by progskeet_nor_probe */
+struct progskeet_nor_chip
+{
+    struct progskeet_nor_id id;
+
+    /* ready_gpio is set by the caller and kept */
+    struct progskeet_nor_info nor;
+
+    /* Raw CFI table, cfi[i] being the low byte of query word i */
+    uint8_t cfi[64];
+
+    /* Erase blocks with a known protection status and how many of them are protected or locked */
+    uint32_t nblocks;
+    uint32_t nprotected;
+
+    /* Bit n % 8 of byte n / 8 is set if block n is protected or locked */
+    uint8_t protect[PROGSKEET_NOR_MAX_BLOCKS / 8];
+};
+
+/* Geometry and timing of an ONFI NAND flash */
+struct progskeet_nand_info
+{
+    /* GPIO masks set by the caller, CE# and WP# are active low, wp_gpio may be 0 */
+    uint16_t cle_gpio;
+    uint16_t ale_gpio;
+    uint16_t ce_gpio;
+    uint16_t rb_gpio;
+    uint16_t wp_gpio;
+
+    /* Everything below is filled in from the parameter page */
+    char manufacturer[13];
+    char model[21];
+
+    /* Bytes per data cycle, 1 or 2 */
+    int bus_width;
+
+    /* Bytes */
+    uint32_t page_size;
+    uint32_t spare_size;
+
+    uint32_t pages_per_block;
+    uint32_t blocks_per_lun;
+    uint32_t luns;
+
+    uint8_t row_cycles;
+    uint8_t col_cycles;
+
+    /* Supports the 0x31/0x3F cache read commands */
+    int cache_read;
+
+    /* Worst case times */
+    uint32_t read_us;
+    uint32_t program_us;
+    uint32_t erase_us;
+};
+
+/* A SPI NOR flash bit-banged on the GPIOs */
+struct progskeet_spi_info
+{
+    /* GPIO masks set by the caller, CS# is active low */
+    uint16_t cs_gpio;
+    uint16_t sck_gpio;
+    uint16_t mosi_gpio;
+    uint16_t miso_gpio;
+
+    /* Filled in by progskeet_spi_read_id */
+    uint8_t jedec_id[3];
+
+    /* Bytes */
+    uint32_t size;
+    uint32_t page_size;
+    uint32_t sector_size;
+
+    /* 4 selects the 4 byte address opcodes */
+    int addr_bytes;
+
+    /* Use FAST_READ instead of READ */
+    int fast_read;
+
+    /* Typical times, defaults are used for 0, program_us adapts to the chip */
+    uint32_t program_us;
+    uint32_t erase_us;
+};
+
+#define PROGSKEET_ECC_HAMMING       1
+#define PROGSKEET_ECC_BCH           2
+
+/* Where the ECC of a page lives, every step_size bytes of data have their own ECC in the spare area */
+struct progskeet_ecc_layout
+{
+    /* PROGSKEET_ECC_* */
+    int type;
+
+    /* Correctable bits per step for BCH, up to 16 */
+    int strength;
+
+    /* Data bytes per step, 256 or 512 for Hamming */
+    uint32_t step_size;
+
+    /* Offset of the first ECC in the spare area and the distance between them, 0 for packed */
+    uint32_t ecc_offset;
+    uint32_t ecc_stride;
+};
+
+struct progskeet_ecc_stats
+{
+    /* Bitflips corrected in the page */
+    uint32_t corrected;
+    /* Most bitflips corrected in one step */
+    uint32_t max_step;
+    /* Steps with more bitflips than the ECC corrects */
+    uint32_t failed;
+};
+
+struct progskeet_ecc;
+
+/* One die or chip and its job for progskeet_nor_run_dies */
+struct progskeet_nor_die
+{
+    /* Geometry, ready_gpio has to be this die's own RY/BY# if set */
+    struct progskeet_nor_info nor;
+
+    /* Address translation selecting this die, addr_mask 0 for none */
+    uint32_t addr_mask;
+    uint32_t addr_add;
+
+    /* GPIO mask of an active low chip enable, 0 for none */
+    uint16_t cs_gpio;
+
+    /* Bus addresses to erase, erase_len 0 for none */
+    uint32_t erase_addr;
+    uint32_t erase_len;
+
+    /* Image to program at program_addr, program_len bytes */
+    uint32_t program_addr;
+    const char* program_buf;
+    size_t program_len;
+
+    int verify;
+
+    /* Filled in by progskeet_nor_run_dies, 0 on success */
+    int result;
+};
+
+enum progskeet_job_op {
+    progskeet_job_erase = 0,
+    progskeet_job_program,
+    progskeet_job_verify,
+    progskeet_job_dump,
+};
+
+/* One step for progskeet_nor_run_jobs */
+struct progskeet_job
+{
+    enum progskeet_job_op op;
+
+    /* Bus address and length in bytes, erases cover every block they touch */
+    uint32_t addr;
+    size_t len;
+
+    /* Image for program and verify, destination for dump */
+    char* buf;
+
+    /* Index of a job that has to succeed first, -1 for none. Jobs touching
+       the same words keep their list order without it */
+    int after;
+
+    /* Filled in by progskeet_nor_run_jobs, 0 on success. Jobs whose
+       dependency failed are not run and get its result */
+    int result;
+
+    /* Microseconds from the first command of the job until its results were back */
+    uint32_t elapsed_us;
+};
+
+/* Faults of a line found by progskeet_diagnose */
+#define PROGSKEET_LINE_OK           0x00
+#define PROGSKEET_LINE_STUCK_LOW    (1 << 0)
+#define PROGSKEET_LINE_STUCK_HIGH   (1 << 1)
+/* Did not keep the level it was driven to, without being stuck or shorted */
+#define PROGSKEET_LINE_OPEN         (1 << 2)
+#define PROGSKEET_LINE_SHORT        (1 << 3)
+
+/* Address lines progskeet_diagnose can walk, the ones the device counter drives */
+#define PROGSKEET_DIAG_ADDR_LINES   23
+
+struct progskeet_line
+{
+    /* PROGSKEET_LINE_* flags */
+    uint8_t faults;
+
+    /* Lines of the same group this one is shorted to, bit n for line n */
+    uint32_t shorted_to;
+};
+
+struct progskeet_diag
+{
+    struct progskeet_line data[16];
+    struct progskeet_line addr[PROGSKEET_DIAG_ADDR_LINES];
+    struct progskeet_line gpio[16];
+
+    /* Lines with any fault, bit n for line n */
+    uint32_t data_faults;
+    uint32_t addr_faults;
+    uint32_t gpio_faults;
+};
+
 /*
  * LOGGING FUNCTIONS
  */
@@ -98,13 +444,328 @@ int DLL_API progskeet_close(struct progskeet_handle* handle);
 
 int DLL_API progskeet_reset(struct progskeet_handle* handle);
 
-/* Cancels any running operation */
+/* Gets the USB serial number, or the port path for devices that have none */
+int DLL_API progskeet_get_serial(struct progskeet_handle* handle, char* buf, size_t len);
+
+/*
+ * Cancels any running operation, safe to call from any thread. Transfers
+ * in flight are aborted and the operation returns PROGSKEET_ERR_CANCELLED.
+ * It stays cancelled until progskeet_clear_cancel or progskeet_reset.
+ */
 int DLL_API progskeet_cancel(struct progskeet_handle* handle);
 
+/* Lets operations run again after progskeet_cancel, safe to call from any thread */
+int DLL_API progskeet_clear_cancel(struct progskeet_handle* handle);
+
+/*
+ * Operations still running timeout_ms from now stop and return
+ * PROGSKEET_ERR_DEADLINE, 0 removes the deadline. Without one, transfers wait on a busy device for
+ * as long as it takes, like a chip erase needs.
+ */
+int DLL_API progskeet_set_deadline(struct progskeet_handle* handle, uint32_t timeout_ms);
+
+/* Copies out the status of the sync in flight or the last one, safe to call from any thread */
+int DLL_API progskeet_get_sync_status(struct progskeet_handle* handle, struct progskeet_sync_status* status);
+
+/*
+ * Reports the progress of long operations, file and flash reads and
+ * programs, at most once per interval_ms plus once at their start and end.
+ * Progress within a sync follows its transfers as they complete, no syncs
+ * are added for it. NULL turns it off.
+ */
+int DLL_API progskeet_set_progress_cb(struct progskeet_handle* handle, progskeet_progress_cb cb,
+                                      const uint32_t interval_ms, void* user_data);
+
+/*
+ * CONTEXT FUNCTIONS
+ *
+ * A context has its own libusb context, log target and default
+ * configuration. Handles opened on it sync and run their events on it, so
+ * threads that each own a context never contend with each other. The
+ * functions without a context use a default one set up by progskeet_init.
+ */
+
+int DLL_API progskeet_context_create(struct progskeet_context** ctx);
+
+/* Closes every handle still open on the context */
+int DLL_API progskeet_context_destroy(struct progskeet_context* ctx);
+
+int DLL_API progskeet_context_open(struct progskeet_context* ctx, struct progskeet_handle** handle);
+
+int DLL_API progskeet_context_open_specific(struct progskeet_context* ctx, struct progskeet_handle** handle, uint8_t bus, uint8_t addr);
+
+/* Used by handles without a target of their own, before the global target */
+int DLL_API progskeet_context_set_log_target(struct progskeet_context* ctx, progskeet_log_target target);
+
+/* Applied by progskeet_reset to handles of this context */
+int DLL_API progskeet_context_set_default_config(struct progskeet_context* ctx, const struct progskeet_config* config);
+
+/*
+ * EVENT LOOP FUNCTIONS
+ *
+ * For callers that run their own poll, select or epoll loop: submit syncs
+ * with progskeet_sync_submit, watch the descriptors from
+ * progskeet_get_pollfds and call progskeet_handle_events with a timeout of
+ * 0 whenever one is ready or the timeout ran out. The sync callbacks run
+ * from there.
+ */
+
+typedef void (*progskeet_sync_cb)(struct progskeet_handle* handle, int result, void* user_data);
+
+/*
+ * Starts sending the queued commands and receiving their readbacks without
+ * waiting for them. cb gets the result that progskeet_sync would have
+ * returned, from progskeet_handle_events once everything is done or right
+ * away if there is nothing to transfer. The handle must not queue anything
+ * else until then.
+ */
+int DLL_API progskeet_sync_submit(struct progskeet_handle* handle, progskeet_sync_cb cb, void* user_data);
+
+typedef void (*progskeet_rx_cb)(struct progskeet_handle* handle, void* user_data);
+
+/*
+ * Calls cb as soon as every readback queued so far has arrived, while the
+ * rest of the sync is still in flight. Placed after each read or
+ * progskeet_get_gpio of a long batch, it lets the caller work on the first
+ * results before the last ones are in. Callbacks run in queue order from
+ * the event loop, or from progskeet_sync, and are skipped for readbacks
+ * that never arrive because the sync failed.
+ */
+int DLL_API progskeet_rx_notify(struct progskeet_handle* handle, progskeet_rx_cb cb, void* user_data);
+
+/* Runs the callbacks of finished transfers, waits up to timeout_ms for one */
+int DLL_API progskeet_handle_events(const uint32_t timeout_ms);
+
+int DLL_API progskeet_context_handle_events(struct progskeet_context* ctx, const uint32_t timeout_ms);
+
+struct progskeet_pollfd
+{
+    int fd;
+
+    /* POLLIN and POLLOUT flags to watch for */
+    short events;
+};
+
+/*
+ * Fills in up to max descriptors to watch and returns how many there are,
+ * which can be more than max. timeout_ms is the longest the loop may wait
+ * before it has to call progskeet_handle_events, -1 if there is no limit.
+ * Not available on Windows.
+ */
+int DLL_API progskeet_get_pollfds(struct progskeet_pollfd* fds, const int max, int* timeout_ms);
+
+int DLL_API progskeet_context_get_pollfds(struct progskeet_context* ctx, struct progskeet_pollfd* fds, const int max, int* timeout_ms);
+
+typedef void (*progskeet_pollfd_added_cb)(int fd, short events, void* user_data);
+typedef void (*progskeet_pollfd_removed_cb)(int fd, void* user_data);
+
+/* Tells about descriptors coming and going, so an epoll set can follow them */
+int DLL_API progskeet_set_pollfd_notifiers(progskeet_pollfd_added_cb added, progskeet_pollfd_removed_cb removed, void* user_data);
+
+int DLL_API progskeet_context_set_pollfd_notifiers(struct progskeet_context* ctx, progskeet_pollfd_added_cb added,
+                                                   progskeet_pollfd_removed_cb removed, void* user_data);
+
+/*
+ * NOR FLASH FUNCTIONS
+ */
+
+/* Reads the CFI table at the current bus width */
+int DLL_API progskeet_nor_cfi_query(struct progskeet_handle* handle, struct progskeet_nor_info* nor);
+
+/* Parses a raw CFI table, cfi[i] being the low byte of query word i */
+int DLL_API progskeet_nor_cfi_parse(const uint8_t* cfi, const size_t len, const int bus_width, struct progskeet_nor_info* nor);
+
+/*
+ * Reads the IDs, the CFI table and the block protection at the current bus
+ * width. The last chip probed on the handle, or on the station if cache_dir
+ * is given, is taken to be the same one again, so a chip seen before needs
+ * a single sync. CFI tables are kept in cache_dir by chip ID, NULL for none.
+ */
+int DLL_API progskeet_nor_probe(struct progskeet_handle* handle, const char* cache_dir, struct progskeet_nor_chip* chip);
+
+/* Gets what the last progskeet_nor_probe found without touching the bus, -2 if nothing was probed */
+int DLL_API progskeet_nor_probed(struct progskeet_handle* handle, struct progskeet_nor_chip* chip);
+
+/* Finds the erase block containing addr, start and len are bus addresses */
+int DLL_API progskeet_nor_block_at(const struct progskeet_nor_info* nor, const uint32_t addr, uint32_t* start, uint32_t* len);
+
+/* Erases every block overlapping len bus addresses at addr */
+int DLL_API progskeet_nor_erase(struct progskeet_handle* handle, const struct progskeet_nor_info* nor,
+                                const uint32_t addr, const uint32_t len);
+
+int DLL_API progskeet_nor_erase_chip(struct progskeet_handle* handle, const struct progskeet_nor_info* nor);
+
+/* Programs using the write buffer if the chip has one, erased words are skipped */
+int DLL_API progskeet_nor_program(struct progskeet_handle* handle, const struct progskeet_nor_info* nor,
+                                  const uint32_t addr, const char* buf, const size_t len);
+
+/*
+ * Runs the erase, program and verify jobs of several dies at once, one
+ * die programs or verifies while the others erase. Returns the first
+ * error, every die has its own result.
+ */
+int DLL_API progskeet_nor_run_dies(struct progskeet_handle* handle, struct progskeet_nor_die* dies, const int count);
+
+/*
+ * Runs a list of jobs on one chip. The jobs are reordered to keep the
+ * address moving forward and queued back to back, a sync only happens
+ * when the TX buffer is full, a verify has to be compared before a job
+ * after it may run or nothing else is ready.
+ */
+int DLL_API progskeet_nor_run_jobs(struct progskeet_handle* handle, const struct progskeet_nor_info* nor,
+                                   struct progskeet_job* jobs, const int count);
+
+/*
+ * MANIFEST FUNCTIONS
+ */
+
+/*
+ * Decides which blocks of the image at addr differ from the flash, dirty
+ * gets one byte per block_size bytes of image. If a manifest from an
+ * earlier program of this board and chip exists, only samples blocks it
+ * claims to match are read back to confirm it, otherwise or if a sample
+ * does not match, every block is read back. Returns the number of dirty
+ * blocks.
+ */
+int DLL_API progskeet_manifest_plan(struct progskeet_handle* handle, const char* dir, const char* chip_id,
+                                    const uint32_t addr, const char* image, const size_t len,
+                                    const size_t block_size, const unsigned int samples, uint8_t* dirty);
+
+/* Records the image at addr as the flash contents, call it after a successful program */
+int DLL_API progskeet_manifest_update(struct progskeet_handle* handle, const char* dir, const char* chip_id,
+                                      const uint32_t addr, const char* image, const size_t len,
+                                      const size_t block_size);
+
+/*
+ * Makes every successful progskeet_nor_program record what it wrote in the
+ * manifest in dir. The blocks it covers are updated in the manifest that is
+ * there, a partly covered block is marked as changed. Without a manifest
+ * or with another block_size, one of just the programmed range is written.
+ * block_size has to be a multiple of the bus width.
+ */
+int DLL_API progskeet_manifest_enable(struct progskeet_handle* handle, const char* dir, const char* chip_id,
+                                      const size_t block_size);
+
+int DLL_API progskeet_manifest_disable(struct progskeet_handle* handle);
+
+/*
+ * NAND FLASH FUNCTIONS
+ *
+ * Pages are numbered across all LUNs, page buffers hold the data and then
+ * the spare area of each page.
+ */
+
+/* Reads the ONFI parameter page at the current bus width, the GPIO masks have to be set */
+int DLL_API progskeet_nand_onfi_query(struct progskeet_handle* handle, struct progskeet_nand_info* nand);
+
+/* Parses one 256 byte copy of the parameter page, fails if its CRC does not match */
+int DLL_API progskeet_nand_onfi_parse(const uint8_t* param, const size_t len, struct progskeet_nand_info* nand);
+
+/* Reads count pages, using cache reads when the chip has them */
+int DLL_API progskeet_nand_read(struct progskeet_handle* handle, const struct progskeet_nand_info* nand,
+                                const uint32_t page, const uint32_t count, char* buf);
+
+/* Programs count pages, all-0xFF pages are skipped */
+int DLL_API progskeet_nand_program(struct progskeet_handle* handle, const struct progskeet_nand_info* nand,
+                                   const uint32_t page, const uint32_t count, const char* buf);
+
+int DLL_API progskeet_nand_erase(struct progskeet_handle* handle, const struct progskeet_nand_info* nand,
+                                 const uint32_t block, const uint32_t count);
+
+/*
+ * Reads count pages and corrects them on worker threads while the next
+ * pages are transferred. stats gets one entry per page, returns -5 if any
+ * page could not be corrected.
+ */
+int DLL_API progskeet_nand_read_ecc(struct progskeet_handle* handle, const struct progskeet_nand_info* nand,
+                                    const struct progskeet_ecc* ecc, const uint32_t page, const uint32_t count,
+                                    char* buf, struct progskeet_ecc_stats* stats);
+
+/*
+ * SPI FLASH FUNCTIONS
+ */
+
+/* Reads the JEDEC ID and derives size and addressing from it, page and sector size default to 256 and 4096 */
+int DLL_API progskeet_spi_read_id(struct progskeet_handle* handle, struct progskeet_spi_info* spi);
+
+int DLL_API progskeet_spi_read_status(struct progskeet_handle* handle, const struct progskeet_spi_info* spi, uint8_t* status);
+
+int DLL_API progskeet_spi_read(struct progskeet_handle* handle, const struct progskeet_spi_info* spi,
+                               const uint32_t addr, char* buf, const size_t len);
+
+/* Programs page by page, all-0xFF pages are skipped */
+int DLL_API progskeet_spi_program(struct progskeet_handle* handle, struct progskeet_spi_info* spi,
+                                  const uint32_t addr, const char* buf, const size_t len);
+
+/* Erases every sector overlapping len bytes at addr */
+int DLL_API progskeet_spi_erase(struct progskeet_handle* handle, const struct progskeet_spi_info* spi,
+                                const uint32_t addr, const uint32_t len);
+
+/*
+ * GPIO SAMPLER FUNCTIONS
+ *
+ * Samples are GET_GPIO commands spaced out with NOPs on the device, so
+ * they are as even as the NOP clock of 48 per microsecond while the link
+ * keeps up with 2 bytes per sample. A sync carries up to 512K samples, the
+ * gap between two syncs is only known from the host clock. Intervals above
+ * about 690 ms can't be encoded and return -1.
+ */
+
+/* Sample period in picoseconds that interval_ns is rounded to, at least one command slot */
+uint64_t DLL_API progskeet_gpio_sample_period_ps(const uint32_t interval_ns);
+
+/* Takes count samples of all GPIOs, one every interval_ns */
+int DLL_API progskeet_gpio_sample(struct progskeet_handle* handle, uint16_t* samples, const size_t count, const uint32_t interval_ns);
+
+/* Captures count samples into a VCD file with a wire per bit of mask, written while the samples arrive */
+int DLL_API progskeet_gpio_capture_vcd(struct progskeet_handle* handle, const char* path, const uint16_t mask,
+                                       const uint32_t interval_ns, const uint64_t count);
+
+/*
+ * DIAGNOSTIC FUNCTIONS
+ *
+ * Walks a one and a zero over every line, each line driven against all
+ * the others. Data lines are written and read back on the bus, GPIOs are
+ * precharged to the opposite level and read while only the line under
+ * test drives. Address lines are told apart by the word that comes back
+ * from each address, so that test needs a writable memory on the bus.
+ * Seen through a memory a stuck address line shows as stuck both ways,
+ * the level it is stuck at cannot be told.
+ * The whole test is one batch finished by a single sync.
+ */
+
+/*
+ * Tests the data lines, the GPIOs in gpio_mask and the lowest addr_lines
+ * address lines, 0 skips the address test. Writes to the target at the
+ * bus addresses it walks. Returns 0 once diag is filled in, faults or not.
+ */
+int DLL_API progskeet_diagnose(struct progskeet_handle* handle, const uint16_t gpio_mask, const uint8_t addr_lines,
+                               struct progskeet_diag* diag);
+
+/*
+ * ECC FUNCTIONS
+ */
+
+/* Precomputes the tables for a layout */
+int DLL_API progskeet_ecc_create(struct progskeet_ecc** ecc, const struct progskeet_ecc_layout* layout);
+
+void DLL_API progskeet_ecc_destroy(struct progskeet_ecc* ecc);
+
+/* ECC bytes per step */
+int DLL_API progskeet_ecc_bytes(const struct progskeet_ecc* ecc);
+
+/* Fills in the ECC bytes in the spare area of a page */
+int DLL_API progskeet_ecc_encode_page(const struct progskeet_ecc* ecc, char* page, const uint32_t page_size, const uint32_t spare_size);
+
+/* Corrects a page in place, ECC bytes included, returns -5 if a step could not be corrected */
+int DLL_API progskeet_ecc_correct_page(const struct progskeet_ecc* ecc, char* page, const uint32_t page_size, const uint32_t spare_size,
+                                       struct progskeet_ecc_stats* stats);
+
 /*
  * UTILITY FUNCTIONS
  */
 
+/* Data lines and GPIOs that failed progskeet_diagnose, data line n in bit n and GPIO n in bit n + 16 */
 int DLL_API progskeet_testshorts(struct progskeet_handle* handle, uint32_t* result);
 
 #ifdef __cplusplus
@@ -0,0 +1,568 @@
+/*
+ * libprogskeet - ProgSkeet library
+ * Copyright (C) 2012 Axel Gembe <axel@gembe.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * ProgSkeet C++ interface, needs C++20
+ *
+ * Everything is inline and forwards to the C functions, results are the
+ * same negative codes. Spans point straight at the caller's memory, reads
+ * are filled in by the next sync like with the C API.
+ */
+
+#ifndef _PROGSKEET_HPP
+#define _PROGSKEET_HPP
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <utility>
+
+#include "progskeet.h"
+#include "progskeet_private.h"
+
+namespace progskeet {
+
+enum class bus_width : int {
+    x8 = 1,
+    x16 = 2,
+};
+
+template <bus_width W>
+struct bus_traits;
+
+template <>
+struct bus_traits<bus_width::x8>
+{
+    using word_type = uint8_t;
+    static constexpr uint8_t config = PROGSKEET_CFG_NONE;
+};
+
+template <>
+struct bus_traits<bus_width::x16>
+{
+    using word_type = uint16_t;
+    static constexpr uint8_t config = PROGSKEET_CFG_16BIT;
+};
+
+/* One piece of a vectored transfer, the address is in bus words */
+struct read_segment
+{
+    uint32_t addr;
+    std::span<std::byte> data;
+};
+
+struct write_segment
+{
+    uint32_t addr;
+    std::span<const std::byte> data;
+};
+
+/*
+ * Short commands written into TX space reserved once up front, each call
+ * is a few stores without checks. No call takes more than max_call_bytes,
+ * so reserving for count calls covers any mix of them. With bank lines or
+ * a cache on the handle the calls go through the C functions instead.
+ * The first error is kept and every call after it does nothing, finish
+ * returns it and gives back the space that was not used. Nothing else may
+ * be queued on the handle meanwhile.
+ */
+template <bus_width W>
+class command_sequence
+{
+public:
+    using word_type = typename bus_traits<W>::word_type;
+
+    /* A SET_ADDR and a single WRITE_CYCLE, for cmd or a write after a stale address */
+    static constexpr size_t max_call_bytes = 4 + 3 + sizeof(word_type);
+
+    command_sequence(progskeet_handle* handle, size_t calls) noexcept : handle_(handle)
+    {
+        if (handle_->bank_bits != 0 || handle_->cache)
+            return;
+
+        if ((p_ = progskeet_tx_reserve(handle_, calls * max_call_bytes)) == nullptr) {
+            res_ = -1;
+            return;
+        }
+
+        direct_ = true;
+    }
+
+    command_sequence(const command_sequence&) = delete;
+    command_sequence& operator=(const command_sequence&) = delete;
+
+    ~command_sequence()
+    {
+        finish();
+    }
+
+    int finish() noexcept
+    {
+        if (direct_) {
+            handle_->txlen = static_cast<size_t>(p_ - handle_->txbuf);
+            direct_ = false;
+            p_ = nullptr;
+        }
+
+        return res_;
+    }
+
+    /* Like progskeet_nop, 0 queues nothing */
+    void nop(uint8_t count) noexcept
+    {
+        if (res_ < 0 || count == 0)
+            return;
+
+        if (!direct_)
+            return keep(progskeet_nop(handle_, count));
+
+        p_[0] = PROGSKEET_CMD_NOP;
+        p_[1] = static_cast<char>(count);
+        p_ += 2;
+    }
+
+    void wait_gpio(uint16_t mask, uint16_t value) noexcept
+    {
+        if (res_ < 0)
+            return;
+
+        if (!direct_)
+            return keep(progskeet_wait_gpio(handle_, mask, value));
+
+        if (!mask)
+            return;
+
+        put16(PROGSKEET_CMD_WAIT_GPIO, value);
+        p_[0] = static_cast<char>(mask & 0xFF);
+        p_[1] = static_cast<char>(mask >> 8);
+        p_ += 2;
+    }
+
+    void set_gpio(uint16_t gpio) noexcept
+    {
+        if (res_ < 0)
+            return;
+
+        if (!direct_)
+            return keep(progskeet_set_gpio(handle_, gpio));
+
+        put16(PROGSKEET_CMD_SET_GPIO, gpio);
+        handle_->cur_gpio = gpio;
+    }
+
+    void assert_gpio(uint16_t gpio) noexcept { set_gpio(handle_->cur_gpio | gpio); }
+
+    void deassert_gpio(uint16_t gpio) noexcept { set_gpio(handle_->cur_gpio & ~gpio); }
+
+    void set_gpio_dir(uint16_t dir) noexcept
+    {
+        if (res_ < 0)
+            return;
+
+        if (!direct_)
+            return keep(progskeet_set_gpio_dir(handle_, dir));
+
+        put16(PROGSKEET_CMD_SET_GPIO_DIR, dir);
+        handle_->cur_gpio_dir = dir;
+    }
+
+    /* Goes through the address mask and add like progskeet_set_addr */
+    void set_addr(uint32_t addr, bool auto_incr) noexcept
+    {
+        uint32_t maddr;
+
+        if (res_ < 0)
+            return;
+
+        if (!direct_)
+            return keep(progskeet_set_addr(handle_, addr, auto_incr ? 1 : 0));
+
+        maddr = (addr & handle_->addr_mask) | handle_->addr_add | (auto_incr ? PROGSKEET_ADDR_AUTO_INC : 0);
+
+        p_[0] = PROGSKEET_CMD_SET_ADDR;
+        p_[1] = static_cast<char>(maddr & 0xFF);
+        p_[2] = static_cast<char>((maddr >> 8) & 0xFF);
+        p_[3] = static_cast<char>((maddr >> 16) & 0xFF);
+        p_ += 4;
+
+        handle_->cur_addr = addr;
+        handle_->cur_addr_inc = auto_incr ? 1 : 0;
+        handle_->addr_stale = 0;
+    }
+
+    /* One write cycle at the current address */
+    void write(word_type data) noexcept
+    {
+        if (res_ < 0)
+            return;
+
+        if (!direct_)
+            return keep(progskeet_set_data(handle_, data));
+
+        if (handle_->addr_stale)
+            set_addr(handle_->cur_addr, handle_->cur_addr_inc != 0);
+
+        put16(PROGSKEET_CMD_WRITE_CYCLE, 1);
+        p_[0] = static_cast<char>(data & 0xFF);
+        if constexpr (sizeof(word_type) == 2)
+            p_[1] = static_cast<char>(data >> 8);
+        p_ += sizeof(word_type);
+
+        if (handle_->cur_addr_inc)
+            handle_->cur_addr++;
+    }
+
+    /* A command cycle, like the ones of flash unlock sequences */
+    void cmd(uint32_t addr, word_type data) noexcept
+    {
+        set_addr(addr, false);
+        write(data);
+    }
+
+private:
+    void keep(int res) noexcept
+    {
+        if (res < 0 && res_ == 0)
+            res_ = res;
+    }
+
+    void put16(char cmd, uint16_t value) noexcept
+    {
+        p_[0] = cmd;
+        p_[1] = static_cast<char>(value & 0xFF);
+        p_[2] = static_cast<char>(value >> 8);
+        p_ += 3;
+    }
+
+    progskeet_handle* handle_;
+    char* p_ = nullptr;
+    bool direct_ = false;
+    int res_ = 0;
+};
+
+/*
+ * Encodes commands straight into the TX buffer of a handle whose bus is
+ * set to W, see device::set_bus_width. Cycles take the direct path while
+ * the device counter is current and no bank lines or cache are involved,
+ * anything else goes through the C functions that deal with them.
+ */
+template <bus_width W>
+class command_builder
+{
+public:
+    using traits = bus_traits<W>;
+    using word_type = typename traits::word_type;
+
+    /* Words go out little endian, spans are sent as they are */
+    static_assert(sizeof(word_type) == 1 || std::endian::native == std::endian::little, "16 bit word spans need a little endian host");
+
+    explicit command_builder(progskeet_handle* handle) noexcept : handle_(handle) {}
+
+    /* Like progskeet_nop, 0 queues nothing */
+    int nop(uint8_t count) noexcept
+    {
+        char* p;
+
+        if (count == 0)
+            return 0;
+
+        if ((p = progskeet_tx_reserve(handle_, 2)) == nullptr)
+            return -1;
+
+        p[0] = PROGSKEET_CMD_NOP;
+        p[1] = static_cast<char>(count);
+
+        return 0;
+    }
+
+    int wait_gpio(uint16_t mask, uint16_t value) noexcept
+    {
+        char* p;
+
+        if ((p = progskeet_tx_reserve(handle_, 5)) == nullptr)
+            return -1;
+
+        p[0] = PROGSKEET_CMD_WAIT_GPIO;
+        p[1] = static_cast<char>(value & 0xFF);
+        p[2] = static_cast<char>(value >> 8);
+        p[3] = static_cast<char>(mask & 0xFF);
+        p[4] = static_cast<char>(mask >> 8);
+
+        return 0;
+    }
+
+    /* Goes through the address translation and bank lines */
+    int set_addr(uint32_t addr, bool auto_incr) noexcept
+    {
+        return progskeet_set_addr(handle_, addr, auto_incr ? 1 : 0);
+    }
+
+    /* Reserves room for up to calls short commands, see command_sequence */
+    command_sequence<W> sequence(size_t calls) noexcept
+    {
+        return command_sequence<W>(handle_, calls);
+    }
+
+    int write(word_type data) noexcept
+    {
+        return write(std::span<const word_type>(&data, 1));
+    }
+
+    int write(std::span<const word_type> words) noexcept
+    {
+        size_t done, chunk;
+        char* p;
+
+        if (!direct(true))
+            return progskeet_write(handle_, reinterpret_cast<const char*>(words.data()), words.size_bytes());
+
+        /* All of it or nothing, a partial write would leave the stream and the address apart */
+        if ((p = progskeet_tx_reserve(handle_, cycles_bytes(words.size()) + words.size_bytes())) == nullptr)
+            return -1;
+
+        for (done = 0; done < words.size(); done += chunk) {
+            chunk = words.size() - done < 0xFFFF ? words.size() - done : 0xFFFF;
+
+            p[0] = PROGSKEET_CMD_WRITE_CYCLE;
+            p[1] = static_cast<char>(chunk & 0xFF);
+            p[2] = static_cast<char>(chunk >> 8);
+            std::memcpy(p + 3, words.data() + done, chunk * sizeof(word_type));
+            p += 3 + chunk * sizeof(word_type);
+        }
+
+        advance(words.size());
+
+        return 0;
+    }
+
+    /* Filled in by the next sync */
+    int read(std::span<word_type> words) noexcept
+    {
+        size_t done, chunk;
+        char* p;
+        int res;
+
+        if (!direct(false))
+            return progskeet_read_uncached(handle_, reinterpret_cast<char*>(words.data()), words.size_bytes());
+
+        if ((p = progskeet_tx_reserve(handle_, cycles_bytes(words.size()))) == nullptr)
+            return -1;
+
+        for (done = 0; done < words.size(); done += chunk) {
+            chunk = words.size() - done < 0xFFFF ? words.size() - done : 0xFFFF;
+
+            p[0] = PROGSKEET_CMD_READ_CYCLE;
+            p[1] = static_cast<char>(chunk & 0xFF);
+            p[2] = static_cast<char>(chunk >> 8);
+            p += 3;
+        }
+
+        /* Takes the read cycles back out when their readback can't be queued */
+        if ((res = progskeet_enqueue_rx_buf(handle_, words.data(), words.size_bytes())) < 0) {
+            handle_->txlen -= cycles_bytes(words.size());
+            return res;
+        }
+
+        advance(words.size());
+
+        return 0;
+    }
+
+private:
+    /* Command bytes of the cycles for words, one command per 0xFFFF words */
+    static size_t cycles_bytes(size_t words) noexcept
+    {
+        return 3 * ((words + 0xFFFE) / 0xFFFF);
+    }
+
+    bool direct(bool writes) const noexcept
+    {
+        return !handle_->addr_stale && handle_->bank_bits == 0 && (!writes || !handle_->cache);
+    }
+
+    void advance(size_t words) noexcept
+    {
+        if (handle_->cur_addr_inc)
+            handle_->cur_addr += static_cast<uint32_t>(words);
+    }
+
+    progskeet_handle* handle_;
+};
+
+/* Owns a handle and closes it when it goes away */
+class device
+{
+public:
+    device() noexcept = default;
+
+    explicit device(progskeet_handle* handle) noexcept : handle_(handle) {}
+
+    device(device&& other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+
+    device& operator=(device&& other) noexcept
+    {
+        if (this != &other)
+            reset(std::exchange(other.handle_, nullptr));
+
+        return *this;
+    }
+
+    device(const device&) = delete;
+    device& operator=(const device&) = delete;
+
+    ~device()
+    {
+        reset();
+    }
+
+    static int open(device& dev) noexcept
+    {
+        progskeet_handle* handle = nullptr;
+        int res;
+
+        if ((res = progskeet_open(&handle)) < 0)
+            return res;
+
+        dev.reset(handle);
+
+        return 0;
+    }
+
+    static int open(device& dev, uint8_t bus, uint8_t addr) noexcept
+    {
+        progskeet_handle* handle = nullptr;
+        int res;
+
+        if ((res = progskeet_open_specific(&handle, bus, addr)) < 0)
+            return res;
+
+        dev.reset(handle);
+
+        return 0;
+    }
+
+    progskeet_handle* get() const noexcept { return handle_; }
+
+    progskeet_handle* release() noexcept { return std::exchange(handle_, nullptr); }
+
+    void reset(progskeet_handle* handle = nullptr) noexcept
+    {
+        if (handle_)
+            progskeet_close(handle_);
+
+        handle_ = handle;
+    }
+
+    explicit operator bool() const noexcept { return handle_ != nullptr; }
+
+    int sync() noexcept { return progskeet_sync(handle_); }
+
+    int cancel() noexcept { return progskeet_cancel(handle_); }
+
+    int clear_cancel() noexcept { return progskeet_clear_cancel(handle_); }
+
+    int set_deadline(uint32_t timeout_ms) noexcept { return progskeet_set_deadline(handle_, timeout_ms); }
+
+    int sync_status(progskeet_sync_status& status) const noexcept { return progskeet_get_sync_status(handle_, &status); }
+
+    size_t tx_free() const noexcept { return progskeet_tx_free(handle_); }
+
+    template <bus_width W>
+    int set_bus_width() noexcept
+    {
+        return progskeet_config_set_byte(handle_, (handle_->cur_config & ~PROGSKEET_CFG_16BIT) | bus_traits<W>::config);
+    }
+
+    /* The bus has to be set to W already */
+    template <bus_width W>
+    command_builder<W> commands() noexcept { return command_builder<W>(handle_); }
+
+    int set_addr(uint32_t addr, bool auto_incr = true) noexcept { return progskeet_set_addr(handle_, addr, auto_incr ? 1 : 0); }
+
+    int get_gpio(uint16_t& gpio) noexcept { return progskeet_get_gpio(handle_, &gpio); }
+
+    int set_gpio(uint16_t gpio) noexcept { return progskeet_set_gpio(handle_, gpio); }
+
+    int set_gpio_dir(uint16_t dir) noexcept { return progskeet_set_gpio_dir(handle_, dir); }
+
+    int wait_gpio(uint16_t mask, uint16_t value) noexcept { return progskeet_wait_gpio(handle_, mask, value); }
+
+    int read(std::span<std::byte> buf) noexcept
+    {
+        return progskeet_read(handle_, reinterpret_cast<char*>(buf.data()), buf.size());
+    }
+
+    int write(std::span<const std::byte> buf) noexcept
+    {
+        return progskeet_write(handle_, reinterpret_cast<const char*>(buf.data()), buf.size());
+    }
+
+    int read(uint32_t addr, std::span<std::byte> buf) noexcept
+    {
+        int res;
+
+        if ((res = set_addr(addr)) < 0)
+            return res;
+
+        return read(buf);
+    }
+
+    int write(uint32_t addr, std::span<const std::byte> buf) noexcept
+    {
+        int res;
+
+        if ((res = set_addr(addr)) < 0)
+            return res;
+
+        return write(buf);
+    }
+
+    /* Queues every segment back to back, they share the next sync */
+    int read(std::span<const read_segment> segments) noexcept
+    {
+        int res;
+
+        for (const read_segment& seg : segments) {
+            if ((res = read(seg.addr, seg.data)) < 0)
+                return res;
+        }
+
+        return 0;
+    }
+
+    int write(std::span<const write_segment> segments) noexcept
+    {
+        int res;
+
+        for (const write_segment& seg : segments) {
+            if ((res = write(seg.addr, seg.data)) < 0)
+                return res;
+        }
+
+        return 0;
+    }
+
+private:
+    progskeet_handle* handle_ = nullptr;
+};
+
+} /* namespace progskeet */
+
+#endif /* _PROGSKEET_HPP */
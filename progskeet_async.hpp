@@ -0,0 +1,376 @@
+/*
+ * libprogskeet - ProgSkeet library
+ * Copyright (C) 2012 Axel Gembe <axel@gembe.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * ProgSkeet C++ coroutine interface, needs C++20
+ *
+ * Awaiting a sync submits it with progskeet_sync_submit and suspends the
+ * coroutine, the event loop resumes it from the transfer callback. Any
+ * number of devices can be driven from the one thread that runs the loop,
+ * every coroutine and callback runs on that thread.
+ */
+
+#ifndef _PROGSKEET_ASYNC_HPP
+#define _PROGSKEET_ASYNC_HPP
+
+#include <coroutine>
+#include <exception>
+#include <vector>
+
+#include "progskeet.hpp"
+
+namespace progskeet {
+
+class sync_awaiter
+{
+public:
+    /* A negative error makes the await return it without syncing */
+    explicit sync_awaiter(progskeet_handle* handle, int error = 0) noexcept : handle_(handle), result_(error) {}
+
+    bool await_ready() const noexcept { return result_ < 0; }
+
+    bool await_suspend(std::coroutine_handle<> cont) noexcept
+    {
+        cont_ = cont;
+
+        if ((result_ = progskeet_sync_submit(handle_, &sync_awaiter::done, this)) < 0)
+            return false;
+
+        /* Nothing to transfer, the callback already ran */
+        if (state_ == completed)
+            return false;
+
+        state_ = suspended;
+
+        return true;
+    }
+
+    int await_resume() const noexcept { return result_; }
+
+private:
+    enum state {
+        submitting,
+        suspended,
+        completed,
+    };
+
+    static void done(progskeet_handle*, int result, void* user_data)
+    {
+        sync_awaiter* self = static_cast<sync_awaiter*>(user_data);
+        const bool resume = self->state_ == suspended;
+
+        self->result_ = result;
+        self->state_ = completed;
+
+        if (resume)
+            self->cont_.resume();
+    }
+
+    progskeet_handle* handle_;
+    std::coroutine_handle<> cont_;
+    state state_ = submitting;
+    int result_;
+};
+
+/* A lazily started coroutine returning a result code, awaitable from another one */
+class task
+{
+public:
+    struct promise_type
+    {
+        int result = 0;
+        std::coroutine_handle<> continuation;
+
+        task get_return_object() noexcept { return task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        auto final_suspend() noexcept
+        {
+            struct final_awaiter
+            {
+                bool await_ready() noexcept { return false; }
+
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept
+                {
+                    if (h.promise().continuation)
+                        return h.promise().continuation;
+
+                    return std::noop_coroutine();
+                }
+
+                void await_resume() noexcept {}
+            };
+
+            return final_awaiter{};
+        }
+
+        void return_value(int res) noexcept { result = res; }
+
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+
+    task(task&& other) noexcept : coro_(std::exchange(other.coro_, nullptr)) {}
+
+    task& operator=(task&& other) noexcept
+    {
+        if (this != &other) {
+            if (coro_)
+                coro_.destroy();
+
+            coro_ = std::exchange(other.coro_, nullptr);
+        }
+
+        return *this;
+    }
+
+    task(const task&) = delete;
+    task& operator=(const task&) = delete;
+
+    ~task()
+    {
+        if (coro_)
+            coro_.destroy();
+    }
+
+    /* Runs the coroutine up to its first suspension */
+    void start() noexcept
+    {
+        if (coro_ && !coro_.done())
+            coro_.resume();
+    }
+
+    bool done() const noexcept { return !coro_ || coro_.done(); }
+
+    int result() const noexcept { return coro_ ? coro_.promise().result : -1; }
+
+    bool await_ready() const noexcept { return done(); }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont) noexcept
+    {
+        coro_.promise().continuation = cont;
+
+        return coro_;
+    }
+
+    int await_resume() const noexcept { return result(); }
+
+private:
+    explicit task(std::coroutine_handle<promise_type> coro) noexcept : coro_(coro) {}
+
+    std::coroutine_handle<promise_type> coro_;
+};
+
+/* Coroutine side of a device, the device has to outlive everything awaited on it */
+class async_device
+{
+public:
+    explicit async_device(device& dev) noexcept : handle_(dev.get()) {}
+
+    explicit async_device(progskeet_handle* handle) noexcept : handle_(handle) {}
+
+    progskeet_handle* get() const noexcept { return handle_; }
+
+    /* Sends whatever is queued and receives its readbacks */
+    sync_awaiter sync() noexcept { return sync_awaiter(handle_); }
+
+    /*
+     * Reads len bytes at addr, buf is filled in when the await returns. The
+     * sector cache is bypassed, filling it would sync and block the loop.
+     */
+    sync_awaiter read(uint32_t addr, std::span<std::byte> buf) noexcept
+    {
+        int res;
+
+        if ((res = progskeet_set_addr(handle_, addr, 1)) < 0 ||
+            (res = progskeet_read_uncached(handle_, reinterpret_cast<char*>(buf.data()), buf.size())) < 0)
+            return sync_awaiter(handle_, res);
+
+        return sync_awaiter(handle_);
+    }
+
+    /*
+     * Reads len bytes at addr window by window and hands each one to
+     * sink(std::span<const std::byte>), which stops the dump by returning a
+     * negative value. The next window is already in flight while sink runs.
+     */
+    template <typename Sink>
+    task dump(uint32_t addr, size_t len, Sink sink, size_t window = 256 * 1024)
+    {
+        const size_t width = (handle_->cur_config & PROGSKEET_CFG_16BIT) ? 2 : 1;
+        std::vector<std::byte> bufs[2];
+        size_t next = 0, chunk = 0, ready;
+        bool submitted;
+        int cur;
+        int res, wres;
+
+        window -= window % width;
+        if (window == 0)
+            co_return -1;
+
+        bufs[0].resize(window);
+        bufs[1].resize(window);
+
+        if ((res = queue_window(addr, len, window, width, bufs[0], next, chunk)) < 0)
+            co_return res;
+
+        if ((res = co_await sync_awaiter(handle_)) < 0)
+            co_return res;
+
+        for (cur = 0; ; cur ^= 1) {
+            ready = chunk;
+            submitted = false;
+            wres = 0;
+
+            /* The next window goes out before the sink looks at this one */
+            if (next < len) {
+                if ((res = queue_window(addr, len, window, width, bufs[cur ^ 1], next, chunk)) < 0)
+                    co_return res;
+
+                window_pending_ = true;
+
+                if ((res = progskeet_sync_submit(handle_, &async_device::window_done, this)) < 0) {
+                    window_pending_ = false;
+                    co_return res;
+                }
+
+                submitted = true;
+            }
+
+            res = sink(std::span<const std::byte>(bufs[cur].data(), ready));
+
+            /* The window in flight still lands in this frame */
+            if (submitted)
+                wres = co_await window_awaiter{this};
+
+            if (res < 0)
+                co_return res;
+
+            if (wres < 0)
+                co_return wres;
+
+            if (!submitted)
+                break;
+        }
+
+        co_return 0;
+    }
+
+private:
+    int queue_window(uint32_t addr, size_t len, size_t window, size_t width,
+                     std::vector<std::byte>& buf, size_t& next, size_t& chunk) noexcept
+    {
+        int res;
+
+        chunk = len - next < window ? len - next : window;
+
+        if ((res = progskeet_set_addr(handle_, addr + static_cast<uint32_t>(next / width), 1)) < 0)
+            return res;
+
+        if ((res = progskeet_read_uncached(handle_, reinterpret_cast<char*>(buf.data()), chunk)) < 0)
+            return res;
+
+        next += chunk;
+
+        return 0;
+    }
+
+    /* Waits for the window submitted before the sink ran */
+    struct window_awaiter
+    {
+        async_device* dev;
+
+        bool await_ready() const noexcept { return !dev->window_pending_; }
+
+        void await_suspend(std::coroutine_handle<> cont) noexcept { dev->window_cont_ = cont; }
+
+        int await_resume() const noexcept { return dev->window_result_; }
+    };
+
+    static void window_done(progskeet_handle*, int result, void* user_data)
+    {
+        async_device* self = static_cast<async_device*>(user_data);
+        std::coroutine_handle<> cont = std::exchange(self->window_cont_, nullptr);
+
+        self->window_result_ = result;
+        self->window_pending_ = false;
+
+        if (cont)
+            cont.resume();
+    }
+
+    progskeet_handle* handle_;
+
+    bool window_pending_ = false;
+    int window_result_ = 0;
+    std::coroutine_handle<> window_cont_;
+};
+
+/*
+ * Drives the transfers of every device of one context on the calling
+ * thread, the default context unless one is given. Devices opened with
+ * progskeet_context_open need a loop on their own context.
+ */
+class event_loop
+{
+public:
+    explicit event_loop(uint32_t poll_ms = 100, progskeet_context* ctx = nullptr) noexcept : ctx_(ctx), poll_ms_(poll_ms) {}
+
+    /* Starts the tasks and handles events until all of them are done */
+    int run(std::span<task> tasks) noexcept
+    {
+        bool pending;
+        int res;
+
+        for (task& t : tasks)
+            t.start();
+
+        for (;;) {
+            pending = false;
+            for (task& t : tasks)
+                pending |= !t.done();
+
+            if (!pending)
+                break;
+
+            res = ctx_ ? progskeet_context_handle_events(ctx_, poll_ms_) : progskeet_handle_events(poll_ms_);
+            if (res < 0)
+                return res;
+        }
+
+        return 0;
+    }
+
+    int run(task& t) noexcept
+    {
+        int res;
+
+        if ((res = run(std::span<task>(&t, 1))) < 0)
+            return res;
+
+        return t.result();
+    }
+
+private:
+    progskeet_context* ctx_;
+    uint32_t poll_ms_;
+};
+
+} /* namespace progskeet */
+
+#endif /* _PROGSKEET_ASYNC_HPP */
@@ -0,0 +1,469 @@
+/*
+ * libprogskeet - ProgSkeet library
+ * Copyright (C) 2012 Axel Gembe <axel@gembe.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * ProgSkeet read-through sector cache
+ *
+ * Lines are keyed by the bus address after addr_mask/addr_add have been
+ * applied, so the K8Q virtual chip enable selects different lines.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "progskeet.h"
+#include "progskeet_private.h"
+
+/* Reads larger than this many lines bypass the cache */
+#define PROGSKEET_CACHE_MAX_READ_LINES 4
+
+#define PROGSKEET_CACHE_NONE (-1)
+
+struct progskeet_cache_line
+{
+    uint32_t tag;
+    int valid;
+
+    /* LRU list, head is the most recently used line */
+    int prev;
+    int next;
+
+    /* Hash bucket chain */
+    int chain;
+};
+
+struct progskeet_cache
+{
+    size_t line_size;
+    size_t nlines;
+    int flags;
+
+    struct progskeet_cache_line* lines;
+    char* data;
+
+    int* buckets;
+    size_t nbuckets;
+
+    int lru_head;
+    int lru_tail;
+
+    /* Last line a read touched, for sequential detection */
+    uint32_t last_tag;
+    int last_valid;
+
+    struct progskeet_cache_stats stats;
+};
+
+static size_t progskeet_cache_word_size(struct progskeet_handle* handle)
+{
+    return (handle->cur_config & PROGSKEET_CFG_16BIT) ? 2 : 1;
+}
+
+static uint32_t progskeet_cache_map_addr(struct progskeet_handle* handle, const uint32_t addr)
+{
+    return (addr & handle->addr_mask) | handle->addr_add;
+}
+
+static void progskeet_cache_lru_unlink(struct progskeet_cache* cache, int idx)
+{
+    struct progskeet_cache_line* line = &cache->lines[idx];
+
+    if (line->prev != PROGSKEET_CACHE_NONE)
+        cache->lines[line->prev].next = line->next;
+    else
+        cache->lru_head = line->next;
+
+    if (line->next != PROGSKEET_CACHE_NONE)
+        cache->lines[line->next].prev = line->prev;
+    else
+        cache->lru_tail = line->prev;
+}
+
+static void progskeet_cache_lru_push(struct progskeet_cache* cache, int idx)
+{
+    struct progskeet_cache_line* line = &cache->lines[idx];
+
+    line->prev = PROGSKEET_CACHE_NONE;
+    line->next = cache->lru_head;
+
+    if (cache->lru_head != PROGSKEET_CACHE_NONE)
+        cache->lines[cache->lru_head].prev = idx;
+    else
+        cache->lru_tail = idx;
+
+    cache->lru_head = idx;
+}
+
+static int progskeet_cache_find(struct progskeet_cache* cache, const uint32_t tag)
+{
+    int idx;
+
+    for (idx = cache->buckets[tag & (cache->nbuckets - 1)]; idx != PROGSKEET_CACHE_NONE; idx = cache->lines[idx].chain) {
+        if (cache->lines[idx].valid && cache->lines[idx].tag == tag)
+            return idx;
+    }
+
+    return PROGSKEET_CACHE_NONE;
+}
+
+static void progskeet_cache_unhash(struct progskeet_cache* cache, int idx)
+{
+    int* link;
+
+    link = &cache->buckets[cache->lines[idx].tag & (cache->nbuckets - 1)];
+    while (*link != PROGSKEET_CACHE_NONE) {
+        if (*link == idx) {
+            *link = cache->lines[idx].chain;
+            break;
+        }
+
+        link = &cache->lines[*link].chain;
+    }
+
+    cache->lines[idx].valid = 0;
+}
+
+static void progskeet_cache_drop(struct progskeet_cache* cache, int idx)
+{
+    progskeet_cache_unhash(cache, idx);
+
+    /* Invalid lines are reused first */
+    progskeet_cache_lru_unlink(cache, idx);
+
+    cache->lines[idx].prev = cache->lru_tail;
+    cache->lines[idx].next = PROGSKEET_CACHE_NONE;
+
+    if (cache->lru_tail != PROGSKEET_CACHE_NONE)
+        cache->lines[cache->lru_tail].next = idx;
+    else
+        cache->lru_head = idx;
+
+    cache->lru_tail = idx;
+}
+
+/* Takes the least recently used line and assigns it to tag, it is not valid until filled */
+static int progskeet_cache_claim(struct progskeet_cache* cache, const uint32_t tag)
+{
+    int idx = cache->lru_tail;
+
+    if (cache->lines[idx].valid)
+        progskeet_cache_unhash(cache, idx);
+
+    progskeet_cache_lru_unlink(cache, idx);
+    progskeet_cache_lru_push(cache, idx);
+
+    cache->lines[idx].tag = tag;
+
+    return idx;
+}
+
+static void progskeet_cache_insert(struct progskeet_cache* cache, int idx)
+{
+    struct progskeet_cache_line* line = &cache->lines[idx];
+    int* bucket = &cache->buckets[line->tag & (cache->nbuckets - 1)];
+
+    line->valid = 1;
+    line->chain = *bucket;
+    *bucket = idx;
+}
+
+static char* progskeet_cache_line_data(struct progskeet_cache* cache, int idx)
+{
+    return cache->data + (size_t)idx * cache->line_size;
+}
+
+int progskeet_cache_enable(struct progskeet_handle* handle, const size_t line_size, const size_t lines, const int flags)
+{
+    struct progskeet_cache* cache;
+    size_t i;
+
+    if (!handle || line_size < 2 || (line_size & (line_size - 1)) || lines < 1)
+        return -1;
+
+    progskeet_cache_disable(handle);
+
+    cache = (struct progskeet_cache*)malloc(sizeof(struct progskeet_cache));
+    if (!cache)
+        return -2;
+
+    memset(cache, 0, sizeof(struct progskeet_cache));
+
+    cache->line_size = line_size;
+    cache->nlines = lines;
+    cache->flags = flags;
+
+    cache->nbuckets = 1;
+    while (cache->nbuckets < lines * 2)
+        cache->nbuckets <<= 1;
+
+    cache->lines = (struct progskeet_cache_line*)malloc(lines * sizeof(struct progskeet_cache_line));
+    cache->buckets = (int*)malloc(cache->nbuckets * sizeof(int));
+    cache->data = (char*)malloc(lines * line_size);
+
+    if (!cache->lines || !cache->buckets || !cache->data) {
+        free(cache->lines);
+        free(cache->buckets);
+        free(cache->data);
+        free(cache);
+        return -2;
+    }
+
+    for (i = 0; i < cache->nbuckets; i++)
+        cache->buckets[i] = PROGSKEET_CACHE_NONE;
+
+    cache->lru_head = PROGSKEET_CACHE_NONE;
+    cache->lru_tail = PROGSKEET_CACHE_NONE;
+
+    for (i = 0; i < lines; i++) {
+        cache->lines[i].valid = 0;
+        cache->lines[i].chain = PROGSKEET_CACHE_NONE;
+        progskeet_cache_lru_push(cache, (int)i);
+    }
+
+    handle->cache = cache;
+
+    return 0;
+}
+
+int progskeet_cache_disable(struct progskeet_handle* handle)
+{
+    if (!handle)
+        return -1;
+
+    if (!handle->cache)
+        return 0;
+
+    free(handle->cache->lines);
+    free(handle->cache->buckets);
+    free(handle->cache->data);
+    free(handle->cache);
+
+    handle->cache = NULL;
+
+    return 0;
+}
+
+int progskeet_cache_invalidate(struct progskeet_handle* handle, const uint32_t addr, const size_t len)
+{
+    struct progskeet_cache* cache;
+    uint32_t line_words;
+    uint32_t tag, first, last;
+    int idx;
+
+    if (!handle)
+        return -1;
+
+    if (!(cache = handle->cache) || len < 1)
+        return 0;
+
+    line_words = (uint32_t)(cache->line_size / progskeet_cache_word_size(handle));
+
+    first = progskeet_cache_map_addr(handle, addr) / line_words;
+    last = progskeet_cache_map_addr(handle, addr + (uint32_t)len - 1) / line_words;
+
+    /* Large ranges are cheaper to flush completely */
+    if (last - first >= cache->nlines)
+        return progskeet_cache_invalidate_all(handle);
+
+    for (tag = first; tag <= last; tag++) {
+        if ((idx = progskeet_cache_find(cache, tag)) != PROGSKEET_CACHE_NONE) {
+            progskeet_cache_drop(cache, idx);
+            cache->stats.invalidations++;
+        }
+    }
+
+    return 0;
+}
+
+int progskeet_cache_invalidate_all(struct progskeet_handle* handle)
+{
+    struct progskeet_cache* cache;
+    size_t i;
+
+    if (!handle)
+        return -1;
+
+    if (!(cache = handle->cache))
+        return 0;
+
+    for (i = 0; i < cache->nlines; i++) {
+        if (cache->lines[i].valid)
+            cache->stats.invalidations++;
+
+        cache->lines[i].valid = 0;
+        cache->lines[i].chain = PROGSKEET_CACHE_NONE;
+    }
+
+    for (i = 0; i < cache->nbuckets; i++)
+        cache->buckets[i] = PROGSKEET_CACHE_NONE;
+
+    cache->last_valid = 0;
+
+    return 0;
+}
+
+int progskeet_cache_get_stats(struct progskeet_handle* handle, struct progskeet_cache_stats* stats)
+{
+    if (!handle || !stats)
+        return -1;
+
+    if (!handle->cache) {
+        memset(stats, 0, sizeof(struct progskeet_cache_stats));
+        return 0;
+    }
+
+    *stats = handle->cache->stats;
+
+    return 0;
+}
+
+/* Queues the read of a whole line, the logical address is derived from addr which maps into it */
+static int progskeet_cache_fetch(struct progskeet_handle* handle, const uint32_t addr, const uint32_t tag, int* fetched, int* nfetched)
+{
+    struct progskeet_cache* cache = handle->cache;
+    uint32_t line_words;
+    uint32_t line_addr;
+    int idx;
+    int res;
+
+    line_words = (uint32_t)(cache->line_size / progskeet_cache_word_size(handle));
+    line_addr = addr - (progskeet_cache_map_addr(handle, addr) - tag * line_words);
+
+    idx = progskeet_cache_claim(cache, tag);
+
+    if ((res = progskeet_set_addr(handle, line_addr, 1)) < 0)
+        return res;
+
+    if ((res = progskeet_read_uncached(handle, progskeet_cache_line_data(cache, idx), cache->line_size)) < 0)
+        return res;
+
+    fetched[(*nfetched)++] = idx;
+
+    return 0;
+}
+
+int progskeet_cache_read(struct progskeet_handle* handle, char* buf, const size_t len)
+{
+    struct progskeet_cache* cache = handle->cache;
+    int fetched[PROGSKEET_CACHE_MAX_READ_LINES + 1];
+    int nfetched = 0;
+    size_t word_size;
+    size_t len_words;
+    uint32_t line_words;
+    uint32_t addr, maddr;
+    uint32_t tag, first, last;
+    size_t i, off, n;
+    int saved_inc;
+    int idx;
+    int res;
+
+    saved_inc = handle->cur_addr_inc;
+
+    word_size = progskeet_cache_word_size(handle);
+    len_words = len / word_size;
+    line_words = (uint32_t)(cache->line_size / word_size);
+
+    if (len_words < 1 || (len % word_size) != 0)
+        return 1;
+
+    addr = handle->cur_addr;
+
+    first = progskeet_cache_map_addr(handle, addr) / line_words;
+    last = saved_inc ? progskeet_cache_map_addr(handle, addr + (uint32_t)len_words - 1) / line_words : first;
+
+    if (last - first >= PROGSKEET_CACHE_MAX_READ_LINES || last - first >= cache->nlines)
+        return 1;
+
+    /* Keep the lines that are already there from being reused for the misses */
+    for (tag = first; tag <= last; tag++) {
+        if ((idx = progskeet_cache_find(cache, tag)) != PROGSKEET_CACHE_NONE) {
+            progskeet_cache_lru_unlink(cache, idx);
+            progskeet_cache_lru_push(cache, idx);
+        }
+    }
+
+    /* Queue every missing line and optionally the one after, then do a single sync */
+    for (tag = first; tag <= last; tag++) {
+        if (progskeet_cache_find(cache, tag) == PROGSKEET_CACHE_NONE) {
+            if ((res = progskeet_cache_fetch(handle, addr + (tag - first) * line_words, tag, fetched, &nfetched)) < 0)
+                return res;
+        }
+    }
+
+    if (nfetched > 0) {
+        cache->stats.misses++;
+
+        if ((cache->flags & PROGSKEET_CACHE_PREFETCH) && cache->last_valid && cache->last_tag + 1 == first &&
+            cache->nlines > (size_t)(last - first + 1) &&
+            progskeet_cache_find(cache, last + 1) == PROGSKEET_CACHE_NONE) {
+            if ((res = progskeet_cache_fetch(handle, addr + (last + 1 - first) * line_words, last + 1, fetched, &nfetched)) < 0)
+                return res;
+
+            cache->stats.prefetches++;
+        }
+
+        res = progskeet_sync(handle);
+
+        for (i = 0; i < (size_t)nfetched; i++) {
+            if (res < 0)
+                progskeet_cache_drop(cache, fetched[i]);
+            else
+                progskeet_cache_insert(cache, fetched[i]);
+        }
+
+        if (res < 0)
+            return res;
+    } else {
+        cache->stats.hits++;
+        cache->stats.saved_round_trips++;
+    }
+
+    /* Copy out, without auto increment every word comes from the same address */
+    off = 0;
+    while (off < len_words) {
+        maddr = progskeet_cache_map_addr(handle, saved_inc ? addr + (uint32_t)off : addr);
+        tag = maddr / line_words;
+
+        idx = progskeet_cache_find(cache, tag);
+
+        /* Only a lost fetch can get here, let the device handle it */
+        if (idx == PROGSKEET_CACHE_NONE)
+            return 1;
+
+        progskeet_cache_lru_unlink(cache, idx);
+        progskeet_cache_lru_push(cache, idx);
+
+        i = maddr - tag * line_words;
+        n = saved_inc ? line_words - i : 1;
+        if (n > len_words - off)
+            n = len_words - off;
+
+        memcpy(buf + off * word_size, progskeet_cache_line_data(cache, idx) + i * word_size, n * word_size);
+        off += n;
+    }
+
+    cache->last_tag = last;
+    cache->last_valid = 1;
+
+    /* The fetches moved the device counter, put the logical one back */
+    handle->cur_addr = saved_inc ? addr + (uint32_t)len_words : addr;
+    handle->cur_addr_inc = saved_inc;
+    handle->addr_stale = 1;
+
+    return 0;
+}
@@ -30,6 +30,11 @@
 #include <libusb.h>
 #endif /* !WIN32 */
 
+#ifndef WIN32
+#include <pthread.h>
+#endif /* !WIN32 */
+
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -38,6 +43,7 @@
 
 /* usblib helpers */
 #define USB_HANDLE(x) ((struct libusb_device_handle*)x->hdev)
+#define USB_CONTEXT(x) ((struct libusb_context*)(x)->usb)
 
 /* USB defines */
 #define PROGSKEET_USB_VID 0x1988
@@ -52,19 +58,126 @@
 
 #define PROGSKEET_USB_TIMEOUT 1000 /* 1 second timeout for USB transfers */
 
+/* Timeouts without progress double the next one up to this many times */
+#define PROGSKEET_USB_TIMEOUT_BACKOFF 3
+
+/* A stalled endpoint is cleared and retried this often before the sync fails */
+#define PROGSKEET_USB_STALL_RETRIES 3
+
+/* The cancel flag is set from other threads */
+#if defined(_MSC_VER)
+#define PROGSKEET_LOAD_ACQUIRE(p) (*(volatile int*)(p))
+#define PROGSKEET_STORE_RELEASE(p, v) (*(volatile int*)(p) = (v))
+#else /* !_MSC_VER */
+#define PROGSKEET_LOAD_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define PROGSKEET_STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif /* _MSC_VER */
+
 /* Other defines */
 #define PROGSKEET_TXBUF_LEN (1024 * 1024)
 
+/* Readbacks up to this size reuse the staging buffer */
+#define PROGSKEET_RXBUF_LEN (1024 * 1024)
+
+/*
+ * OUT transfers kept in flight. The next pieces of the TX stream wait on
+ * the bus instead of behind the event loop, so the short slices between
+ * references cost no turnaround of their own.
+ */
+#define PROGSKEET_USB_OUT_DEPTH 4
+
+/* Packet size for when the IN endpoint does not report one */
+#define PROGSKEET_USB_PACKET 512
+
 static int g_inited = 0;
 
+/* Used by the functions without a context, its libusb context is the default one */
+static struct progskeet_context g_default_ctx;
+
 struct progskeet_rxloc
 {
     char* addr;
     size_t len;
 
+    /* Called once this readback and all before it are in */
+    progskeet_rx_cb cb;
+    void* user_data;
+
     struct progskeet_rxloc* next;
 };
 
+struct progskeet_txref
+{
+    /* Bytes of txbuf that go out before it */
+    size_t at;
+
+    const char* buf;
+    size_t len;
+};
+
+struct progskeet_xfer
+{
+    struct libusb_transfer* out[PROGSKEET_USB_OUT_DEPTH];
+    struct libusb_transfer* in;
+
+    /* Next piece of the TX stream, txbuf slices alternate with the references */
+    size_t out_piece;
+
+    /* Transfers in flight and the OUT one submitted last, only that one may be resumed in place */
+    int out_busy[PROGSKEET_USB_OUT_DEPTH];
+    int in_busy;
+    struct libusb_transfer* out_last;
+
+    /* Staging buffer for the readbacks, kept from one sync to the next */
+    char* rxbuf;
+    size_t rxcap;
+
+    /* First readback not copied out yet and where it starts in rxbuf */
+    struct progskeet_rxloc* rx_next;
+    size_t rx_next_at;
+
+    /* wMaxPacketSize of the IN endpoint, IN pieces end on packet boundaries or a short packet would overflow them */
+    size_t in_packet;
+
+    /* Set when the buffer is usbfs device memory rather than heap */
+    int rxbuf_dev;
+    int txbuf_dev;
+
+    /* Transfers still in flight */
+    int pending;
+    int result;
+
+    /* Timeouts without progress and stalls in a row, per direction */
+    int out_timeouts;
+    int in_timeouts;
+    int out_stalls;
+    int in_stalls;
+
+    /* Set once the device is gone, nothing is submitted after that */
+    int gone;
+
+    struct progskeet_sync_status status;
+
+#ifndef WIN32
+    /*
+     * Guards status and the in flight flags, progskeet_get_sync_status and
+     * progskeet_cancel use them from other threads. Transfers are filled and
+     * submitted under it so a cancel never sees one half set up.
+     */
+    pthread_mutex_t status_lock;
+#endif /* !WIN32 */
+
+    /* Set while a sync is in flight */
+    progskeet_sync_cb cb;
+    void* user_data;
+};
+
+struct progskeet_sync_wait
+{
+    int result;
+    int completed;
+};
+
 static int progskeet_free_rxlist(struct progskeet_rxloc* list)
 {
     struct progskeet_rxloc* next;
@@ -78,9 +191,96 @@ static int progskeet_free_rxlist(struct progskeet_rxloc* list)
     return 0;
 }
 
+static void progskeet_context_lock(struct progskeet_context* ctx)
+{
+#ifndef WIN32
+    pthread_mutex_lock((pthread_mutex_t*)ctx->lock);
+#endif /* !WIN32 */
+}
+
+static void progskeet_context_unlock(struct progskeet_context* ctx)
+{
+#ifndef WIN32
+    pthread_mutex_unlock((pthread_mutex_t*)ctx->lock);
+#endif /* !WIN32 */
+}
+
+static void progskeet_xfer_status_lock(struct progskeet_xfer* xfer)
+{
+#ifndef WIN32
+    pthread_mutex_lock(&xfer->status_lock);
+#endif /* !WIN32 */
+}
+
+static void progskeet_xfer_status_unlock(struct progskeet_xfer* xfer)
+{
+#ifndef WIN32
+    pthread_mutex_unlock(&xfer->status_lock);
+#endif /* !WIN32 */
+}
+
+static int* progskeet_xfer_busy(struct progskeet_xfer* xfer, struct libusb_transfer* transfer)
+{
+    int i;
+
+    for (i = 0; i < PROGSKEET_USB_OUT_DEPTH; i++) {
+        if (xfer->out[i] == transfer)
+            return &xfer->out_busy[i];
+    }
+
+    return &xfer->in_busy;
+}
+
+/* Never-submitted transfers have no device handle yet, older libusb releases do not check for that */
+static void progskeet_xfer_cancel_all(struct progskeet_xfer* xfer)
+{
+    int i;
+
+    progskeet_xfer_status_lock(xfer);
+    for (i = 0; i < PROGSKEET_USB_OUT_DEPTH; i++) {
+        if (xfer->out_busy[i])
+            libusb_cancel_transfer(xfer->out[i]);
+    }
+
+    if (xfer->in_busy)
+        libusb_cancel_transfer(xfer->in);
+    progskeet_xfer_status_unlock(xfer);
+}
+
+static int progskeet_context_init(struct progskeet_context* ctx)
+{
+    memset(ctx, 0, sizeof(struct progskeet_context));
+
+    ctx->def_config.delay = 10;
+    ctx->def_config.is16bit = 1;
+
+#ifndef WIN32
+    if ((ctx->lock = malloc(sizeof(pthread_mutex_t))) == NULL)
+        return -3;
+
+    pthread_mutex_init((pthread_mutex_t*)ctx->lock, NULL);
+#endif /* !WIN32 */
+
+    return 0;
+}
+
+static void progskeet_context_fini(struct progskeet_context* ctx)
+{
+    while (ctx->handles)
+        progskeet_close(ctx->handles);
+
+#ifndef WIN32
+    pthread_mutex_destroy((pthread_mutex_t*)ctx->lock);
+    free(ctx->lock);
+#endif /* !WIN32 */
+}
+
 int progskeet_init()
 {
     if (g_inited == 0) {
+        if (progskeet_context_init(&g_default_ctx) < 0)
+            return -3;
+
         libusb_init(NULL);
         libusb_set_debug(NULL, 3);
 
@@ -90,9 +290,115 @@ int progskeet_init()
     return 0;
 }
 
-static int progskeet_alloc(struct progskeet_handle** handle, struct libusb_device* dev)
+int progskeet_context_create(struct progskeet_context** ctx)
+{
+    struct libusb_context* usb;
+
+    if (!ctx)
+        return -1;
+
+    if ((*ctx = (struct progskeet_context*)malloc(sizeof(struct progskeet_context))) == NULL)
+        return -3;
+
+    if (progskeet_context_init(*ctx) < 0) {
+        free(*ctx);
+        return -3;
+    }
+
+    if (libusb_init(&usb) < 0) {
+        progskeet_context_fini(*ctx);
+        free(*ctx);
+        return -4;
+    }
+
+    libusb_set_debug(usb, 3);
+
+    (*ctx)->usb = usb;
+
+    return 0;
+}
+
+int progskeet_context_destroy(struct progskeet_context* ctx)
+{
+    if (!ctx || ctx == &g_default_ctx)
+        return -1;
+
+    progskeet_context_fini(ctx);
+
+    libusb_exit(USB_CONTEXT(ctx));
+
+    free(ctx);
+
+    return 0;
+}
+
+int progskeet_context_set_log_target(struct progskeet_context* ctx, progskeet_log_target target)
+{
+    if (!ctx)
+        return -1;
+
+    ctx->log_target = target;
+
+    return 0;
+}
+
+int progskeet_context_set_default_config(struct progskeet_context* ctx, const struct progskeet_config* config)
+{
+    if (!ctx || !config)
+        return -1;
+
+    ctx->def_config = *config;
+
+    return 0;
+}
+
+/*
+ * Transfer buffers come from usbfs device memory where libusb and the kernel
+ * support it, the kernel then hands them to the controller without copying
+ * them in and out of user pages. Anything else gets heap memory.
+ */
+static char* progskeet_dma_alloc(struct libusb_device_handle* hdev, size_t len, int* dev)
+{
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+    char* buf;
+
+    if ((buf = (char*)libusb_dev_mem_alloc(hdev, len)) != NULL) {
+        *dev = 1;
+        return buf;
+    }
+#else
+    (void)hdev;
+#endif
+
+    *dev = 0;
+
+    return (char*)malloc(len);
+}
+
+static void progskeet_dma_free(struct libusb_device_handle* hdev, char* buf, size_t len, int dev)
+{
+    if (!buf)
+        return;
+
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+    if (dev) {
+        libusb_dev_mem_free(hdev, (unsigned char*)buf, len);
+        return;
+    }
+#else
+    (void)hdev;
+    (void)len;
+    (void)dev;
+#endif
+
+    free(buf);
+}
+
+static int progskeet_alloc(struct progskeet_context* ctx, struct progskeet_handle** handle, struct libusb_device* dev)
 {
     struct libusb_device_handle* hdev;
+    int packet;
+    int i;
 
     if (!handle || !dev)
         return -1;
@@ -104,15 +410,38 @@ static int progskeet_alloc(struct progskeet_handle** handle, struct libusb_devic
     memset(*handle, 0, sizeof(struct progskeet_handle));
 
     (*handle)->hdev = hdev;
+    (*handle)->ctx = ctx;
 
-    (*handle)->txbuf = (char*)malloc(PROGSKEET_TXBUF_LEN);
+    (*handle)->xfer = (struct progskeet_xfer*)calloc(1, sizeof(struct progskeet_xfer));
+#ifndef WIN32
+    pthread_mutex_init(&(*handle)->xfer->status_lock, NULL);
+#endif /* !WIN32 */
+    for (i = 0; i < PROGSKEET_USB_OUT_DEPTH; i++)
+        (*handle)->xfer->out[i] = libusb_alloc_transfer(0);
+    (*handle)->xfer->in = libusb_alloc_transfer(0);
+
+    packet = libusb_get_max_packet_size(dev, PROGSKEET_USB_EP_IN);
+    (*handle)->xfer->in_packet = packet > 0 ? (size_t)packet : PROGSKEET_USB_PACKET;
+
+    (*handle)->txbuf = progskeet_dma_alloc(hdev, PROGSKEET_TXBUF_LEN, &(*handle)->xfer->txbuf_dev);
+    (*handle)->xfer->rxbuf = progskeet_dma_alloc(hdev, PROGSKEET_RXBUF_LEN, &(*handle)->xfer->rxbuf_dev);
+    if ((*handle)->xfer->rxbuf)
+        (*handle)->xfer->rxcap = PROGSKEET_RXBUF_LEN;
+
+    if ((*handle)->xfer->txbuf_dev)
+        progskeet_log_context(ctx, progskeet_log_level_verbose, "Using usbfs device memory for transfers\n");
+
+    progskeet_context_lock(ctx);
+    (*handle)->ctx_next = ctx->handles;
+    ctx->handles = *handle;
+    progskeet_context_unlock(ctx);
 
     progskeet_reset(*handle);
 
     return 0;
 }
 
-static int progskeet_open_int(struct progskeet_handle** handle, uint8_t bus, uint8_t addr)
+static int progskeet_open_int(struct progskeet_context* ctx, struct progskeet_handle** handle, uint8_t bus, uint8_t addr)
 {
     ssize_t numdevs;
     ssize_t i;
@@ -123,7 +452,7 @@ static int progskeet_open_int(struct progskeet_handle** handle, uint8_t bus, uin
     uint8_t caddr;
     int found = 0;
 
-    if (g_inited == 0) {
+    if (ctx == &g_default_ctx && g_inited == 0) {
         progskeet_log_global(progskeet_log_level_error, "Library is not initialized, call progskeet_init\n");
         return -1;
     }
@@ -133,9 +462,9 @@ static int progskeet_open_int(struct progskeet_handle** handle, uint8_t bus, uin
 
     *handle = NULL;
 
-    progskeet_log_global(progskeet_log_level_info, "Enumerating USB devices\n");
+    progskeet_log_context(ctx, progskeet_log_level_info, "Enumerating USB devices\n");
 
-    if ((numdevs = libusb_get_device_list(NULL, &devs)) < 0)
+    if ((numdevs = libusb_get_device_list(USB_CONTEXT(ctx), &devs)) < 0)
         return -3;
 
     for (i = 0; i < numdevs; i++) {
@@ -145,20 +474,20 @@ static int progskeet_open_int(struct progskeet_handle** handle, uint8_t bus, uin
         cbus = libusb_get_bus_number(devs[i]);
         caddr = libusb_get_device_address(devs[i]);
 
-        progskeet_log_global(progskeet_log_level_verbose, "Bus %03d Device %03d: ID %04x:%04x\n",
+        progskeet_log_context(ctx, progskeet_log_level_verbose, "Bus %03d Device %03d: ID %04x:%04x\n",
                              cbus, caddr, descr.idVendor, descr.idProduct);
 
         if (descr.idVendor == PROGSKEET_USB_VID && descr.idProduct == PROGSKEET_USB_PID) {
             if ((bus != 0xFF && cbus != bus) || (addr != 0xFF && caddr != addr))
                 continue;
 
-            progskeet_log_global(progskeet_log_level_info, "Trying to open device on bus %d address %d\n", cbus, caddr);
+            progskeet_log_context(ctx, progskeet_log_level_info, "Trying to open device on bus %d address %d\n", cbus, caddr);
 
             found++;
 
             /* Easy now, Skeeter */
-            if (progskeet_alloc(handle, devs[i]) == 0) {
-                progskeet_log_global(progskeet_log_level_info, "Successfully opened device on bus %d address %d\n", cbus, caddr);
+            if (progskeet_alloc(ctx, handle, devs[i]) == 0) {
+                progskeet_log_context(ctx, progskeet_log_level_info, "Successfully opened device on bus %d address %d\n", cbus, caddr);
                 break;
             }
         }
@@ -168,9 +497,9 @@ static int progskeet_open_int(struct progskeet_handle** handle, uint8_t bus, uin
 
     if (!*handle) {
         if (found == 0) {
-            progskeet_log_global(progskeet_log_level_error, "No matching device found\n");
+            progskeet_log_context(ctx, progskeet_log_level_error, "No matching device found\n");
         } else {
-            progskeet_log_global(progskeet_log_level_error, "Found %d devices but none could be opened\n", found);
+            progskeet_log_context(ctx, progskeet_log_level_error, "Found %d devices but none could be opened\n", found);
         }
 
         return -4;
@@ -181,34 +510,111 @@ static int progskeet_open_int(struct progskeet_handle** handle, uint8_t bus, uin
 
 int progskeet_open(struct progskeet_handle** handle)
 {
-    return progskeet_open_int(handle, 0xFF, 0xFF);
+    return progskeet_open_int(&g_default_ctx, handle, 0xFF, 0xFF);
 }
 
 int progskeet_open_specific(struct progskeet_handle** handle, uint8_t bus, uint8_t addr)
 {
-    return progskeet_open_int(handle, bus, addr);
+    return progskeet_open_int(&g_default_ctx, handle, bus, addr);
+}
+
+int progskeet_context_open(struct progskeet_context* ctx, struct progskeet_handle** handle)
+{
+    if (!ctx)
+        return -1;
+
+    return progskeet_open_int(ctx, handle, 0xFF, 0xFF);
+}
+
+int progskeet_context_open_specific(struct progskeet_context* ctx, struct progskeet_handle** handle, uint8_t bus, uint8_t addr)
+{
+    if (!ctx)
+        return -1;
+
+    return progskeet_open_int(ctx, handle, bus, addr);
 }
 
 int progskeet_close(struct progskeet_handle* handle)
 {
+    struct progskeet_handle** link;
+    int i;
+
     if (!handle)
         return -1;
 
+    progskeet_context_lock(handle->ctx);
+    for (link = &handle->ctx->handles; *link; link = &(*link)->ctx_next) {
+        if (*link == handle) {
+            *link = handle->ctx_next;
+            break;
+        }
+    }
+    progskeet_context_unlock(handle->ctx);
+
     progskeet_log(handle, progskeet_log_level_info, "Closing device\n");
 
     libusb_release_interface(USB_HANDLE(handle), PROGSKEET_USB_INT);
 
+    /* Device memory goes back before the usbfs handle is closed */
+    progskeet_dma_free(USB_HANDLE(handle), handle->txbuf, PROGSKEET_TXBUF_LEN, handle->xfer->txbuf_dev);
+    progskeet_dma_free(USB_HANDLE(handle), handle->xfer->rxbuf, handle->xfer->rxcap, handle->xfer->rxbuf_dev);
+
     libusb_close(USB_HANDLE(handle));
 
-    free(handle->txbuf);
+    free(handle->txrefs);
+
+    for (i = 0; i < PROGSKEET_USB_OUT_DEPTH; i++)
+        libusb_free_transfer(handle->xfer->out[i]);
+    libusb_free_transfer(handle->xfer->in);
+#ifndef WIN32
+    pthread_mutex_destroy(&handle->xfer->status_lock);
+#endif /* !WIN32 */
+    free(handle->xfer);
 
     progskeet_free_rxlist(handle->rxlist);
 
+    progskeet_cache_disable(handle);
+    progskeet_manifest_disable(handle);
+
+    free(handle->nor_chip);
+
     free(handle);
 
     return 0;
 }
 
+int progskeet_get_serial(struct progskeet_handle* handle, char* buf, size_t len)
+{
+    struct libusb_device* dev;
+    struct libusb_device_descriptor descr;
+    uint8_t ports[8];
+    int nports;
+    size_t pos;
+    int i;
+
+    if (!handle || !buf || len < 1)
+        return -1;
+
+    dev = libusb_get_device(USB_HANDLE(handle));
+
+    if (libusb_get_device_descriptor(dev, &descr) < 0)
+        return -2;
+
+    if (descr.iSerialNumber != 0 &&
+        libusb_get_string_descriptor_ascii(USB_HANDLE(handle), descr.iSerialNumber, (unsigned char*)buf, (int)len) > 0)
+        return 0;
+
+    /* No serial number, the physical port is the next best stable identity */
+    if ((nports = libusb_get_port_numbers(dev, ports, sizeof(ports))) < 0)
+        return -3;
+
+    pos = (size_t)snprintf(buf, len, "usb-%d", libusb_get_bus_number(dev));
+    for (i = 0; i < nports && pos < len; i++)
+        pos += (size_t)snprintf(buf + pos, len - pos, "%c%d", i == 0 ? '-' : '.', ports[i]);
+
+    return 0;
+}
+
 int progskeet_reset(struct progskeet_handle* handle)
 {
     int res;
@@ -243,114 +649,650 @@ int progskeet_reset(struct progskeet_handle* handle)
 
     /* Handle reset */
     handle->txlen = 0;
+    handle->txref_count = 0;
 
     progskeet_free_rxlist(handle->rxlist);
     handle->rxlist = NULL;
     handle->rxlen = 0;
 
-    handle->cancel = 0;
+    PROGSKEET_STORE_RELEASE(&handle->cancel, 0);
+    handle->deadline_us = 0;
+
+    handle->bank_bits = 0;
 
     progskeet_set_addr(handle, 0, 0);
     progskeet_set_gpio(handle, 0);
     progskeet_set_gpio_dir(handle, 0);
 
     /* Set the default configuration */
-    handle->def_config.delay = 10;
-    handle->def_config.is16bit = 1;
-    progskeet_config_set(handle, 0, PROGSKEET_CFG_NONE, PROGSKEET_CFG_NONE);
+    handle->def_config = handle->ctx->def_config;
+    if ((res = progskeet_config_set(handle, NULL, PROGSKEET_CFG_NONE, PROGSKEET_CFG_NONE)) < 0)
+        return res;
 
     handle->addr_mask = ~0;
     handle->addr_add = 0;
 
-    progskeet_sync(handle);
+    progskeet_cache_invalidate_all(handle);
 
-    return 0;
+    return progskeet_sync(handle);
 }
 
-static int progskeet_rx(struct progskeet_handle* handle)
+/* Copies out the readbacks within the first arrived bytes and runs their callbacks, in queue order */
+static void progskeet_xfer_deliver(struct progskeet_handle* handle, const size_t arrived)
 {
-    int count, res, i;
-    size_t offset;
-    struct progskeet_rxloc* rxnext;
-    char *buf;
+    struct progskeet_xfer* xfer = handle->xfer;
+    struct progskeet_rxloc* rxloc;
 
-    if (!handle)
-        return -1;
+    while ((rxloc = xfer->rx_next) != NULL && xfer->rx_next_at + rxloc->len <= arrived) {
+        if (rxloc->len > 0)
+            memcpy(rxloc->addr, xfer->rxbuf + xfer->rx_next_at, rxloc->len);
 
-    if (handle->rxlen < 1)
-        return 0;
+        xfer->rx_next_at += rxloc->len;
+        xfer->rx_next = rxloc->next;
 
-    buf = malloc(handle->rxlen);
+        if (rxloc->cb)
+            rxloc->cb(handle, rxloc->user_data);
+    }
+}
 
-    offset = 0;
-    while (offset < handle->rxlen && !handle->cancel) {
-        if ((res = libusb_bulk_transfer(USB_HANDLE(handle), PROGSKEET_USB_EP_IN,
-                                        buf + offset, handle->rxlen, &count,
-                                        PROGSKEET_USB_TIMEOUT)) < 0) {
-            continue;
-        }
+/*
+ * Where the IN piece starting at from ends. Without callbacks that is the
+ * end of the readbacks, otherwise the first packet boundary after the next
+ * readback with a callback, so it runs as soon as its bytes are in.
+ */
+static size_t progskeet_xfer_in_end(struct progskeet_handle* handle, const size_t from)
+{
+    struct progskeet_xfer* xfer = handle->xfer;
+    struct progskeet_rxloc* rxloc;
+    size_t end = xfer->rx_next_at;
+
+    for (rxloc = xfer->rx_next; rxloc; rxloc = rxloc->next) {
+        end += rxloc->len;
 
-        handle->rxlen -= count;
-        offset += count;
+        /* The piece starts at from, so it is its length that has to be whole packets */
+        if (rxloc->cb && end > from) {
+            end = from + (end - from + xfer->in_packet - 1) / xfer->in_packet * xfer->in_packet;
+            break;
+        }
     }
 
-    offset = 0;
-    while (handle->rxlist) {
-        memcpy(handle->rxlist->addr, buf + offset, handle->rxlist->len);
+    return end < handle->rxlen ? end : handle->rxlen;
+}
 
-        offset += handle->rxlist->len;
+/* Finishes the sync once both directions are done */
+static void progskeet_xfer_finish(struct progskeet_handle* handle)
+{
+    struct progskeet_xfer* xfer = handle->xfer;
+    progskeet_sync_cb cb;
 
-        rxnext = handle->rxlist->next;
-        free(handle->rxlist);
-        handle->rxlist = rxnext;
-    }
+    /* Readbacks of a failed sync are left alone, their callbacks are not run */
+    if (xfer->result == 0)
+        progskeet_xfer_deliver(handle, xfer->status.rx_done);
+
+    if (xfer->result == 0)
+        handle->progress.done += handle->progress.in_sync;
+    handle->progress.in_sync = 0;
 
     progskeet_free_rxlist(handle->rxlist);
+    handle->rxlist = NULL;
+    xfer->rx_next = NULL;
+
+    /* Oversized staging buffers are not kept around */
+    if (xfer->rxcap > PROGSKEET_RXBUF_LEN) {
+        progskeet_dma_free(USB_HANDLE(handle), xfer->rxbuf, xfer->rxcap, xfer->rxbuf_dev);
+        xfer->rxbuf = NULL;
+        xfer->rxcap = 0;
+    }
+
+    handle->rxlen = 0;
+    handle->txlen = 0;
+    handle->txref_count = 0;
+
+    cb = xfer->cb;
+    xfer->cb = NULL;
+
+    cb(handle, xfer->result, xfer->user_data);
+}
+
+/* Finds the first non empty piece of the TX stream from piece on, returns 0 if there is none */
+static int progskeet_xfer_piece_at(struct progskeet_handle* handle, size_t* piece, char** buf, size_t* len)
+{
+    size_t start, end;
+    size_t k;
+
+    while (*piece < 2 * handle->txref_count + 1) {
+        k = *piece / 2;
+
+        if ((*piece)++ % 2 == 0) {
+            start = k == 0 ? 0 : handle->txrefs[k - 1].at;
+            end = k < handle->txref_count ? handle->txrefs[k].at : handle->txlen;
+
+            *buf = handle->txbuf + start;
+            *len = end - start;
+        } else {
+            *buf = (char*)handle->txrefs[k].buf;
+            *len = handle->txrefs[k].len;
+        }
+
+        if (*len > 0)
+            return 1;
+    }
 
     return 0;
 }
 
-static int progskeet_tx(struct progskeet_handle* handle)
+/* Takes the next piece of the TX stream, returns 0 when all went out */
+static int progskeet_xfer_out_piece(struct progskeet_handle* handle, char** buf, size_t* len)
+{
+    return progskeet_xfer_piece_at(handle, &handle->xfer->out_piece, buf, len);
+}
+
+/* Reports where the operation is, part of the sync in flight counts by the share of its bytes moved so far */
+static void progskeet_progress_report(struct progskeet_handle* handle, const int force)
 {
-    int count, ret;
-    size_t sent;
+    struct progskeet_progress_state* p = &handle->progress;
+    struct progskeet_sync_status* st = &handle->xfer->status;
+    struct progskeet_progress info;
+    uint64_t traffic;
+    uint64_t now;
 
-    if (!handle)
-        return -1;
+    now = progskeet_time_us();
+    if (!force && now - p->last_us < p->interval_us)
+        return;
+
+    info.done = p->done;
+
+    traffic = st->tx_total + st->rx_total;
+    if (p->in_sync && traffic)
+        info.done += (uint64_t)((double)p->in_sync * (double)(st->tx_done + st->rx_done) / (double)traffic);
+
+    if (info.done > p->total)
+        info.done = p->total;
+
+    info.total = p->total;
+    info.rate = now > p->last_us ? (info.done - p->last_done) * 1000000 / (now - p->last_us) : 0;
+    info.avg_rate = now > p->start_us ? info.done * 1000000 / (now - p->start_us) : 0;
+    info.eta_ms = info.avg_rate ? (int64_t)((info.total - info.done) * 1000 / info.avg_rate) : -1;
 
-    if (handle->txlen < 1)
+    p->last_us = now;
+    p->last_done = info.done;
+
+    p->cb(handle, &info, p->user_data);
+}
+
+/* Milliseconds until the deadline, at least 1 as 0 would mean no timeout at all, 0 without a deadline */
+static uint64_t progskeet_xfer_deadline_ms(struct progskeet_handle* handle)
+{
+    uint64_t now;
+
+    if (!handle->deadline_us)
         return 0;
 
-    ret = 0;
-
-    /* TODO: Handle timeout */
-    sent = 0;
-    while ((handle->txlen - sent) > 0 && !handle->cancel) {
-        if (libusb_bulk_transfer(USB_HANDLE(handle),
-                                 PROGSKEET_USB_EP_OUT,
-                                 handle->txbuf + sent,
-                                 handle->txlen - sent,
-                                 &count,
-                                 PROGSKEET_USB_TIMEOUT) < 0) {
+    now = progskeet_time_us();
+
+    return now < handle->deadline_us ? (handle->deadline_us - now) / 1000 + 1 : 1;
+}
+
+/* Timeout for the next try of a transfer, backed off while the device makes no progress */
+static unsigned int progskeet_xfer_timeout(struct progskeet_handle* handle, int timeouts)
+{
+    uint64_t timeout;
+    uint64_t deadline;
+
+    timeout = (uint64_t)PROGSKEET_USB_TIMEOUT << (timeouts < PROGSKEET_USB_TIMEOUT_BACKOFF ? timeouts : PROGSKEET_USB_TIMEOUT_BACKOFF);
+
+    /* Never wait past the deadline */
+    deadline = progskeet_xfer_deadline_ms(handle);
+    if (deadline && deadline < timeout)
+        timeout = deadline;
+
+    return (unsigned int)timeout;
+}
+
+/*
+ * Timeout for the OUT piece about to be submitted. A transfer that times
+ * out is resumed where it stopped, which is only in order if nothing was
+ * queued behind it. Pieces that will have more behind them only time out
+ * at the deadline, when the sync fails anyway.
+ */
+static unsigned int progskeet_xfer_out_timeout(struct progskeet_handle* handle)
+{
+    size_t piece = handle->xfer->out_piece;
+    size_t len;
+    char* buf;
+
+    if (!progskeet_xfer_piece_at(handle, &piece, &buf, &len))
+        return progskeet_xfer_timeout(handle, handle->xfer->out_timeouts);
+
+    return (unsigned int)progskeet_xfer_deadline_ms(handle);
+}
+
+/* Records the first failure of a sync and aborts the other direction */
+static void progskeet_xfer_fail(struct progskeet_handle* handle, enum progskeet_sync_error error, int result)
+{
+    struct progskeet_xfer* xfer = handle->xfer;
+
+    if (xfer->result < 0)
+        return;
+
+    xfer->result = result;
+
+    progskeet_xfer_status_lock(xfer);
+    xfer->status.error = error;
+    progskeet_xfer_status_unlock(xfer);
+
+    switch (error) {
+    case progskeet_sync_error_cancelled:
+        progskeet_log(handle, progskeet_log_level_info, "Sync cancelled\n");
+        break;
+    case progskeet_sync_error_deadline:
+        progskeet_log(handle, progskeet_log_level_error, "Deadline passed with %u of %u bytes sent and %u of %u received\n",
+                      (unsigned int)xfer->status.tx_done, (unsigned int)xfer->status.tx_total,
+                      (unsigned int)xfer->status.rx_done, (unsigned int)xfer->status.rx_total);
+        break;
+    case progskeet_sync_error_stall:
+        progskeet_log(handle, progskeet_log_level_error, "USB endpoint stalled %d times\n", PROGSKEET_USB_STALL_RETRIES + 1);
+        break;
+    case progskeet_sync_error_disconnect:
+        progskeet_log(handle, progskeet_log_level_error, "Device disconnected\n");
+        break;
+    default:
+        break;
+    }
+
+    progskeet_xfer_cancel_all(xfer);
+}
+
+static void LIBUSB_CALL progskeet_xfer_cb(struct libusb_transfer* transfer);
+
+static int progskeet_xfer_submit(struct progskeet_handle* handle, struct libusb_transfer* transfer,
+                                 const unsigned char endpoint, char* buf, const size_t len, const unsigned int timeout)
+{
+    struct progskeet_xfer* xfer = handle->xfer;
+    int res;
+
+    progskeet_xfer_status_lock(xfer);
+    libusb_fill_bulk_transfer(transfer, USB_HANDLE(handle), endpoint, (unsigned char*)buf, (int)len,
+                              progskeet_xfer_cb, handle, timeout);
+
+    if ((res = libusb_submit_transfer(transfer)) == 0)
+        *progskeet_xfer_busy(xfer, transfer) = 1;
+    progskeet_xfer_status_unlock(xfer);
+
+    if (res < 0)
+        return PROGSKEET_ERR_IO;
+
+    xfer->pending++;
+
+    return 0;
+}
+
+/* Queues the next pieces of the TX stream on every OUT transfer not in flight */
+static void progskeet_xfer_out_fill(struct progskeet_handle* handle)
+{
+    struct progskeet_xfer* xfer = handle->xfer;
+    unsigned int timeout;
+    size_t len;
+    char* buf;
+    int res;
+    int i;
+
+    for (i = 0; i < PROGSKEET_USB_OUT_DEPTH && xfer->result == 0; i++) {
+        if (xfer->out_busy[i])
             continue;
+
+        if (!progskeet_xfer_out_piece(handle, &buf, &len))
+            break;
+
+        timeout = progskeet_xfer_out_timeout(handle);
+
+        if (progskeet_xfer_submit(handle, xfer->out[i], PROGSKEET_USB_EP_OUT, buf, len, timeout) < 0) {
+            progskeet_xfer_fail(handle, progskeet_sync_error_io, PROGSKEET_ERR_IO);
+            break;
         }
 
-        sent += count;
+        xfer->out_last = xfer->out[i];
     }
 
-    handle->txlen = 0;
+    /* These may have no timeout, one submitted right after a cancel must not wait for the device */
+    if (xfer->result == 0 && (res = progskeet_check_cancel(handle)) < 0)
+        progskeet_xfer_fail(handle, res == PROGSKEET_ERR_CANCELLED ? progskeet_sync_error_cancelled : progskeet_sync_error_deadline, res);
+}
+
+static int progskeet_xfer_out_count(struct progskeet_xfer* xfer)
+{
+    int count = 0;
+    int i;
+
+    for (i = 0; i < PROGSKEET_USB_OUT_DEPTH; i++)
+        count += xfer->out_busy[i];
+
+    return count;
+}
+
+static void LIBUSB_CALL progskeet_xfer_cb(struct libusb_transfer* transfer)
+{
+    struct progskeet_handle* handle = (struct progskeet_handle*)transfer->user_data;
+    struct progskeet_xfer* xfer = handle->xfer;
+    const int out = transfer != xfer->in;
+    int* timeouts = out ? &xfer->out_timeouts : &xfer->in_timeouts;
+    int* stalls = out ? &xfer->out_stalls : &xfer->in_stalls;
+    int resubmitted = 0;
+    int res;
+
+    /* Done with it from here on, a cancel must leave its fields alone */
+    progskeet_xfer_status_lock(xfer);
+    *progskeet_xfer_busy(xfer, transfer) = 0;
+
+    transfer->buffer += transfer->actual_length;
+    transfer->length -= transfer->actual_length;
+
+    if (out)
+        xfer->status.tx_done += transfer->actual_length;
+    else
+        xfer->status.rx_done += transfer->actual_length;
+
+    if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT)
+        xfer->status.retries++;
+    progskeet_xfer_status_unlock(xfer);
+
+    if (transfer->actual_length > 0) {
+        *timeouts = 0;
+
+        if (handle->progress.cb && handle->progress.depth > 0)
+            progskeet_progress_report(handle, 0);
+    }
+
+    switch (transfer->status) {
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        /* Only means the device is busy, carry on where it stopped, that can be the next piece */
+        if (transfer->actual_length == 0)
+            (*timeouts)++;
+
+        /* fall through */
+    case LIBUSB_TRANSFER_COMPLETED:
+        /* A finished OUT transfer is refilled below, the IN transfer moves on to the next piece of the readbacks */
+        if (!out && transfer->length == 0 && xfer->status.rx_done < handle->rxlen) {
+            transfer->buffer = (unsigned char*)xfer->rxbuf + xfer->status.rx_done;
+            transfer->length = (int)(progskeet_xfer_in_end(handle, xfer->status.rx_done) - xfer->status.rx_done);
+        }
+        break;
+    case LIBUSB_TRANSFER_STALL:
+        /*
+         * Clearing the halt is a plain ioctl, it does not need the event loop.
+         * With more OUT transfers queued the endpoint would run them before
+         * the retry, so those stalls fail the sync.
+         */
+        if ((*stalls)++ < PROGSKEET_USB_STALL_RETRIES && (!out || progskeet_xfer_out_count(xfer) == 0) &&
+            libusb_clear_halt(USB_HANDLE(handle), transfer->endpoint) == 0) {
+            progskeet_xfer_status_lock(xfer);
+            xfer->status.retries++;
+            progskeet_xfer_status_unlock(xfer);
+            break;
+        }
+
+        progskeet_xfer_fail(handle, progskeet_sync_error_stall, PROGSKEET_ERR_IO);
+        break;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        xfer->gone = 1;
+        progskeet_xfer_fail(handle, progskeet_sync_error_disconnect, PROGSKEET_ERR_IO);
+        break;
+    case LIBUSB_TRANSFER_CANCELLED:
+        /* Either progskeet_cancel or the other direction failed first */
+        progskeet_xfer_fail(handle, progskeet_sync_error_cancelled, PROGSKEET_ERR_CANCELLED);
+        break;
+    default:
+        progskeet_log(handle, progskeet_log_level_error, "USB transfer failed with status %d\n", transfer->status);
+        progskeet_xfer_fail(handle, progskeet_sync_error_io, PROGSKEET_ERR_IO);
+        break;
+    }
+
+    if (transfer->length > 0 && xfer->result == 0 && (res = progskeet_check_cancel(handle)) < 0)
+        progskeet_xfer_fail(handle, res == PROGSKEET_ERR_CANCELLED ? progskeet_sync_error_cancelled : progskeet_sync_error_deadline, res);
+
+    /* Resuming it would send the rest after what was queued behind it */
+    if (out && transfer->length > 0 && xfer->result == 0 && transfer != xfer->out_last) {
+        progskeet_log(handle, progskeet_log_level_error, "OUT transfer stopped with more queued behind it\n");
+        progskeet_xfer_fail(handle, progskeet_sync_error_io, PROGSKEET_ERR_IO);
+    }
+
+    if (transfer->length > 0 && xfer->result == 0) {
+        progskeet_xfer_status_lock(xfer);
+        transfer->timeout = progskeet_xfer_timeout(handle, *timeouts);
+
+        if ((res = libusb_submit_transfer(transfer)) == 0)
+            *progskeet_xfer_busy(xfer, transfer) = 1;
+        progskeet_xfer_status_unlock(xfer);
+
+        if (res == 0) {
+            resubmitted = 1;
+        } else {
+            if (res == LIBUSB_ERROR_NO_DEVICE)
+                xfer->gone = 1;
+
+            progskeet_xfer_fail(handle, res == LIBUSB_ERROR_NO_DEVICE ? progskeet_sync_error_disconnect : progskeet_sync_error_io, PROGSKEET_ERR_IO);
+        }
+    }
+
+    if (out && !resubmitted && xfer->result == 0)
+        progskeet_xfer_out_fill(handle);
+
+    /* The next piece is already on its way while the callbacks of this one run */
+    if (!out && xfer->result == 0)
+        progskeet_xfer_deliver(handle, xfer->status.rx_done);
+
+    if (resubmitted)
+        return;
+
+    if (--xfer->pending == 0)
+        progskeet_xfer_finish(handle);
+}
+
+int progskeet_sync_submit(struct progskeet_handle* handle, progskeet_sync_cb cb, void* user_data)
+{
+    struct progskeet_xfer* xfer;
+    size_t i;
+    int res;
+
+    if (!handle || !cb || !handle->xfer || handle->xfer->cb)
+        return PROGSKEET_ERR_ARGS;
+
+    xfer = handle->xfer;
+    xfer->cb = cb;
+    xfer->user_data = user_data;
+    xfer->result = 0;
+
+    xfer->out_timeouts = xfer->in_timeouts = 0;
+    xfer->out_stalls = xfer->in_stalls = 0;
+
+    /* The payload queued so far moves with this sync */
+    handle->progress.in_sync = handle->progress.queued;
+    handle->progress.queued = 0;
+
+    progskeet_xfer_status_lock(xfer);
+    memset(&xfer->status, 0, sizeof(xfer->status));
+
+    xfer->status.tx_total = handle->txlen;
+    xfer->status.rx_total = handle->rxlen;
+    for (i = 0; i < handle->txref_count; i++)
+        xfer->status.tx_total += handle->txrefs[i].len;
+
+    /* A cancelled or late sync drops what was queued without sending it */
+    if ((res = progskeet_check_cancel(handle)) < 0) {
+        xfer->result = res;
+        xfer->status.error = res == PROGSKEET_ERR_CANCELLED ? progskeet_sync_error_cancelled : progskeet_sync_error_deadline;
+    } else if (xfer->gone) {
+        xfer->result = PROGSKEET_ERR_IO;
+        xfer->status.error = progskeet_sync_error_disconnect;
+    }
+    progskeet_xfer_status_unlock(xfer);
+
+    /* Large readbacks get a staging buffer of their own for this sync */
+    if (handle->rxlen > xfer->rxcap) {
+        progskeet_dma_free(USB_HANDLE(handle), xfer->rxbuf, xfer->rxcap, xfer->rxbuf_dev);
+        xfer->rxcap = handle->rxlen > PROGSKEET_RXBUF_LEN ? handle->rxlen : PROGSKEET_RXBUF_LEN;
+
+        if ((xfer->rxbuf = progskeet_dma_alloc(USB_HANDLE(handle), xfer->rxcap, &xfer->rxbuf_dev)) == NULL) {
+            xfer->rxcap = 0;
+            xfer->result = PROGSKEET_ERR_ALLOC;
+        }
+    }
+
+    /* Both directions run at once, the device answers while it still receives */
+    xfer->out_piece = 0;
+    xfer->out_last = NULL;
+
+    if (xfer->result == 0)
+        progskeet_xfer_out_fill(handle);
+
+    xfer->rx_next = handle->rxlist;
+    xfer->rx_next_at = 0;
+
+    if (xfer->result == 0 && handle->rxlen > 0 &&
+        progskeet_xfer_submit(handle, xfer->in, PROGSKEET_USB_EP_IN, xfer->rxbuf, progskeet_xfer_in_end(handle, 0),
+                              progskeet_xfer_timeout(handle, 0)) < 0)
+        progskeet_xfer_fail(handle, progskeet_sync_error_io, PROGSKEET_ERR_IO);
+
+    /* Callbacks queued before any readback have nothing to wait for */
+    if (xfer->result == 0 && xfer->pending > 0)
+        progskeet_xfer_deliver(handle, 0);
+
+    if (xfer->pending == 0)
+        progskeet_xfer_finish(handle);
 
     return 0;
 }
 
+static void progskeet_sync_done(struct progskeet_handle* handle, int result, void* user_data)
+{
+    struct progskeet_sync_wait* wait = (struct progskeet_sync_wait*)user_data;
+
+    (void)handle;
+
+    wait->result = result;
+    wait->completed = 1;
+}
+
 int progskeet_sync(struct progskeet_handle* handle)
 {
+    struct progskeet_sync_wait wait;
     int res;
 
-    if ((res = progskeet_tx(handle)) < 0)
+    wait.result = 0;
+    wait.completed = 0;
+
+    if ((res = progskeet_sync_submit(handle, progskeet_sync_done, &wait)) < 0)
         return res;
 
-    return progskeet_rx(handle);
+    while (!wait.completed)
+        libusb_handle_events_completed(USB_CONTEXT(handle->ctx), &wait.completed);
+
+    return wait.result;
+}
+
+int progskeet_context_handle_events(struct progskeet_context* ctx, const uint32_t timeout_ms)
+{
+    struct timeval tv;
+
+    if (!ctx)
+        return PROGSKEET_ERR_ARGS;
+
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+    if (libusb_handle_events_timeout_completed(USB_CONTEXT(ctx), &tv, NULL) < 0)
+        return PROGSKEET_ERR_IO;
+
+    return 0;
+}
+
+int progskeet_handle_events(const uint32_t timeout_ms)
+{
+    return progskeet_context_handle_events(&g_default_ctx, timeout_ms);
+}
+
+int progskeet_context_get_pollfds(struct progskeet_context* ctx, struct progskeet_pollfd* fds, const int max, int* timeout_ms)
+{
+    const struct libusb_pollfd** usbfds;
+    struct timeval tv;
+    int res;
+    int i;
+
+    if (!ctx || (!fds && max > 0) || !timeout_ms)
+        return -1;
+
+    if ((usbfds = libusb_get_pollfds(USB_CONTEXT(ctx))) == NULL)
+        return -2;
+
+    for (i = 0; usbfds[i]; i++) {
+        if (i < max) {
+            fds[i].fd = usbfds[i]->fd;
+            fds[i].events = usbfds[i]->events;
+        }
+    }
+
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000104
+    libusb_free_pollfds(usbfds);
+#else
+    free((void*)usbfds);
+#endif
+
+    /* Timeouts show up on a descriptor where the platform allows it */
+    *timeout_ms = -1;
+
+    if (!libusb_pollfds_handle_timeouts(USB_CONTEXT(ctx))) {
+        if ((res = libusb_get_next_timeout(USB_CONTEXT(ctx), &tv)) < 0)
+            return -4;
+
+        if (res == 1)
+            *timeout_ms = (int)(tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000);
+    }
+
+    return i;
+}
+
+int progskeet_get_pollfds(struct progskeet_pollfd* fds, const int max, int* timeout_ms)
+{
+    return progskeet_context_get_pollfds(&g_default_ctx, fds, max, timeout_ms);
+}
+
+static void LIBUSB_CALL progskeet_pollfd_added(int fd, short events, void* user_data)
+{
+    struct progskeet_context* ctx = (struct progskeet_context*)user_data;
+
+    if (ctx->pollfd_added)
+        ctx->pollfd_added(fd, events, ctx->pollfd_user_data);
+}
+
+static void LIBUSB_CALL progskeet_pollfd_removed(int fd, void* user_data)
+{
+    struct progskeet_context* ctx = (struct progskeet_context*)user_data;
+
+    if (ctx->pollfd_removed)
+        ctx->pollfd_removed(fd, ctx->pollfd_user_data);
+}
+
+int progskeet_context_set_pollfd_notifiers(struct progskeet_context* ctx, progskeet_pollfd_added_cb added,
+                                           progskeet_pollfd_removed_cb removed, void* user_data)
+{
+    if (!ctx || (ctx == &g_default_ctx && g_inited == 0))
+        return -1;
+
+    ctx->pollfd_added = added;
+    ctx->pollfd_removed = removed;
+    ctx->pollfd_user_data = user_data;
+
+    if (added || removed)
+        libusb_set_pollfd_notifiers(USB_CONTEXT(ctx), progskeet_pollfd_added, progskeet_pollfd_removed, ctx);
+    else
+        libusb_set_pollfd_notifiers(USB_CONTEXT(ctx), NULL, NULL, NULL);
+
+    return 0;
+}
+
+int progskeet_set_pollfd_notifiers(progskeet_pollfd_added_cb added, progskeet_pollfd_removed_cb removed, void* user_data)
+{
+    return progskeet_context_set_pollfd_notifiers(&g_default_ctx, added, removed, user_data);
 }
 
 int progskeet_cancel(struct progskeet_handle* handle)
@@ -358,11 +1300,67 @@ int progskeet_cancel(struct progskeet_handle* handle)
     if (!handle)
         return -1;
 
-    handle->cancel = 1;
+    PROGSKEET_STORE_RELEASE(&handle->cancel, 1);
+
+    /*
+     * Aborts the transfers in flight, their callbacks see the flag. One
+     * resubmitted just before the store runs until its timeout at most, new
+     * OUT pieces check the flag again once they are submitted.
+     */
+    if (handle->xfer)
+        progskeet_xfer_cancel_all(handle->xfer);
+
+    return 0;
+}
+
+int progskeet_clear_cancel(struct progskeet_handle* handle)
+{
+    if (!handle)
+        return -1;
+
+    PROGSKEET_STORE_RELEASE(&handle->cancel, 0);
+
+    return 0;
+}
+
+int progskeet_check_cancel(struct progskeet_handle* handle)
+{
+    if (PROGSKEET_LOAD_ACQUIRE(&handle->cancel))
+        return PROGSKEET_ERR_CANCELLED;
+
+    if (handle->deadline_us && progskeet_time_us() >= handle->deadline_us)
+        return PROGSKEET_ERR_DEADLINE;
+
+    return 0;
+}
+
+int progskeet_set_deadline(struct progskeet_handle* handle, uint32_t timeout_ms)
+{
+    if (!handle)
+        return -1;
+
+    handle->deadline_us = timeout_ms ? progskeet_time_us() + (uint64_t)timeout_ms * 1000 : 0;
+
+    return 0;
+}
+
+int progskeet_get_sync_status(struct progskeet_handle* handle, struct progskeet_sync_status* status)
+{
+    if (!handle || !status || !handle->xfer)
+        return -1;
+
+    progskeet_xfer_status_lock(handle->xfer);
+    *status = handle->xfer->status;
+    progskeet_xfer_status_unlock(handle->xfer);
 
     return 0;
 }
 
+size_t progskeet_tx_free(struct progskeet_handle* handle)
+{
+    return PROGSKEET_TXBUF_LEN - handle->txlen;
+}
+
 int progskeet_enqueue_tx(struct progskeet_handle* handle, char data)
 {
     if (handle->txlen + 1 > PROGSKEET_TXBUF_LEN)
@@ -384,6 +1382,45 @@ int progskeet_enqueue_tx_buf(struct progskeet_handle* handle, const char* buf, c
     return 0;
 }
 
+int progskeet_enqueue_tx_ref(struct progskeet_handle* handle, const char* buf, const size_t len)
+{
+    struct progskeet_txref* refs;
+    size_t cap;
+
+    if (len < PROGSKEET_TXREF_MIN)
+        return progskeet_enqueue_tx_buf(handle, buf, len);
+
+    if (handle->txref_count == handle->txref_cap) {
+        cap = handle->txref_cap ? handle->txref_cap * 2 : 16;
+
+        if ((refs = (struct progskeet_txref*)realloc(handle->txrefs, cap * sizeof(struct progskeet_txref))) == NULL)
+            return -3;
+
+        handle->txrefs = refs;
+        handle->txref_cap = cap;
+    }
+
+    handle->txrefs[handle->txref_count].at = handle->txlen;
+    handle->txrefs[handle->txref_count].buf = buf;
+    handle->txrefs[handle->txref_count].len = len;
+    handle->txref_count++;
+
+    return 0;
+}
+
+char* progskeet_tx_reserve(struct progskeet_handle* handle, const size_t len)
+{
+    char* buf;
+
+    if (handle->txlen + len > PROGSKEET_TXBUF_LEN)
+        return NULL;
+
+    buf = handle->txbuf + handle->txlen;
+    handle->txlen += len;
+
+    return buf;
+}
+
 int progskeet_enqueue_rx_buf(struct progskeet_handle* handle, void* addr, size_t len)
 {
     struct progskeet_rxloc* rxloc;
@@ -392,8 +1429,10 @@ int progskeet_enqueue_rx_buf(struct progskeet_handle* handle, void* addr, size_t
     rxloc = (struct progskeet_rxloc*)malloc(sizeof(struct progskeet_rxloc));
 
     rxloc->next = NULL;
-    rxloc->addr = addr;
+    rxloc->addr = (char*)addr;
     rxloc->len = len;
+    rxloc->cb = NULL;
+    rxloc->user_data = NULL;
 
     handle->rxlen += len;
 
@@ -409,3 +1448,70 @@ int progskeet_enqueue_rx_buf(struct progskeet_handle* handle, void* addr, size_t
 
     return 0;
 }
+
+int progskeet_rx_notify(struct progskeet_handle* handle, progskeet_rx_cb cb, void* user_data)
+{
+    struct progskeet_rxloc* rxloc;
+    int res;
+
+    if (!handle || !cb)
+        return -1;
+
+    /* An empty readback that only carries the callback */
+    if ((res = progskeet_enqueue_rx_buf(handle, NULL, 0)) < 0)
+        return res;
+
+    for (rxloc = handle->rxlist; rxloc->next; rxloc = rxloc->next)
+        ;
+
+    rxloc->cb = cb;
+    rxloc->user_data = user_data;
+
+    return 0;
+}
+
+int progskeet_set_progress_cb(struct progskeet_handle* handle, progskeet_progress_cb cb,
+                              const uint32_t interval_ms, void* user_data)
+{
+    if (!handle)
+        return -1;
+
+    handle->progress.cb = cb;
+    handle->progress.user_data = user_data;
+    handle->progress.interval_us = (uint64_t)interval_ms * 1000;
+
+    return 0;
+}
+
+void progskeet_progress_begin(struct progskeet_handle* handle, const uint64_t total)
+{
+    struct progskeet_progress_state* p = &handle->progress;
+
+    if (p->depth++ > 0)
+        return;
+
+    p->total = total;
+    p->done = p->in_sync = p->queued = 0;
+    p->start_us = p->last_us = progskeet_time_us();
+    p->last_done = 0;
+
+    if (p->cb)
+        progskeet_progress_report(handle, 1);
+}
+
+void progskeet_progress_add(struct progskeet_handle* handle, const uint64_t bytes)
+{
+    if (handle->progress.depth == 1)
+        handle->progress.queued += bytes;
+}
+
+void progskeet_progress_end(struct progskeet_handle* handle)
+{
+    struct progskeet_progress_state* p = &handle->progress;
+
+    if (p->depth == 0 || --p->depth > 0)
+        return;
+
+    if (p->cb)
+        progskeet_progress_report(handle, 1);
+}
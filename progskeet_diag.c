@@ -0,0 +1,360 @@
+/*
+ * libprogskeet - ProgSkeet library
+ * Copyright (C) 2012 Axel Gembe <axel@gembe.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * ProgSkeet board diagnostic functions
+ *
+ * The test is encoded straight into one command buffer and its readbacks
+ * land in one array, in stream order. Addresses go out unmapped and the
+ * GPIOs are driven raw, the test is about the lines and not about what the
+ * handle makes of them. The handle state is put back at the end of the
+ * batch.
+ */
+
+#include <string.h>
+
+#include "progskeet.h"
+#include "progskeet_private.h"
+
+/* NOPs for a line to settle after it was driven or let go, 1us */
+#define DIAG_SETTLE_NOPS 48
+
+/* Commands of the whole test in the worst case */
+#define DIAG_CMD_MAX 2048
+
+/* Readbacks of the whole test in the worst case */
+#define DIAG_READBACK_MAX (2 * 16 + 2 * 16 + 2 * (PROGSKEET_DIAG_ADDR_LINES + 1))
+
+/* Words written to the address test locations, distinct for each location and pass */
+#define DIAG_ADDR_PATTERN_HIGH 0xA5A5
+#define DIAG_ADDR_PATTERN_LOW  0x5A5A
+
+static char* progskeet_diag_cmd16(char* p, const char cmd, const uint16_t value)
+{
+    *p++ = cmd;
+    *p++ = (value >> 0) & 0xFF;
+    *p++ = (value >> 8) & 0xFF;
+
+    return p;
+}
+
+static char* progskeet_diag_set_addr(char* p, const uint32_t addr)
+{
+    /* No auto increment, every cycle of the test stays where it was sent */
+    *p++ = PROGSKEET_CMD_SET_ADDR;
+    *p++ = (addr >>  0) & 0xFF;
+    *p++ = (addr >>  8) & 0xFF;
+    *p++ = (addr >> 16) & 0x7F;
+
+    return p;
+}
+
+static char* progskeet_diag_write(char* p, const uint16_t data)
+{
+    p = progskeet_diag_cmd16(p, PROGSKEET_CMD_WRITE_CYCLE, 1);
+    *p++ = (data >> 0) & 0xFF;
+    *p++ = (data >> 8) & 0xFF;
+
+    return p;
+}
+
+static char* progskeet_diag_settle(char* p)
+{
+    *p++ = PROGSKEET_CMD_NOP;
+    *p++ = DIAG_SETTLE_NOPS;
+
+    return p;
+}
+
+/* Line i driven to level, the other lines of mask to the opposite one */
+static uint16_t progskeet_diag_walk(const uint16_t mask, const int i, const int level)
+{
+    return (level ? (1 << i) : ~(1 << i)) & mask;
+}
+
+static int progskeet_diag_bit(const uint16_t value, const int i)
+{
+    return (value >> i) & 1;
+}
+
+/*
+ * Data lines: all driven by the write, the bus holds the word for the read.
+ * high[i] and low[i] are read back after walking a one and a zero.
+ */
+static char* progskeet_diag_data_encode(char* p)
+{
+    int level, i;
+
+    p = progskeet_diag_set_addr(p, 0);
+
+    for (level = 1; level >= 0; level--) {
+        for (i = 0; i < 16; i++) {
+            p = progskeet_diag_write(p, progskeet_diag_walk(0xFFFF, i, level));
+            p = progskeet_diag_settle(p);
+            p = progskeet_diag_cmd16(p, PROGSKEET_CMD_READ_CYCLE, 1);
+        }
+    }
+
+    return p;
+}
+
+/* GPIOs: all of mask are precharged, then the line under test drives alone */
+static char* progskeet_diag_gpio_encode(struct progskeet_handle* handle, char* p, const uint16_t mask)
+{
+    const uint16_t other_dir = handle->cur_gpio_dir & ~mask;
+    const uint16_t other_gpio = handle->cur_gpio & ~mask;
+    int level, i;
+
+    for (level = 1; level >= 0; level--) {
+        for (i = 0; i < 16; i++) {
+            if ((mask & (1 << i)) == 0)
+                continue;
+
+            p = progskeet_diag_cmd16(p, PROGSKEET_CMD_SET_GPIO_DIR, other_dir | mask);
+            p = progskeet_diag_cmd16(p, PROGSKEET_CMD_SET_GPIO, other_gpio | progskeet_diag_walk(mask, i, level));
+            p = progskeet_diag_cmd16(p, PROGSKEET_CMD_SET_GPIO_DIR, other_dir | (1 << i));
+            p = progskeet_diag_settle(p);
+            *p++ = PROGSKEET_CMD_GET_GPIO;
+        }
+    }
+
+    return p;
+}
+
+/*
+ * Address lines: a word goes to the base address and one to each address
+ * with a single line flipped, then all of them are read back. A line that
+ * is stuck or shorted makes two of those addresses the same location.
+ */
+static char* progskeet_diag_addr_encode(char* p, const uint8_t lines)
+{
+    const uint32_t all = ((uint32_t)1 << lines) - 1;
+    uint32_t base;
+    uint16_t pattern;
+    int level, i;
+
+    for (level = 1; level >= 0; level--) {
+        base = level ? 0 : all;
+        pattern = level ? DIAG_ADDR_PATTERN_HIGH : DIAG_ADDR_PATTERN_LOW;
+
+        p = progskeet_diag_set_addr(p, base);
+        p = progskeet_diag_write(p, pattern);
+
+        for (i = 0; i < lines; i++) {
+            p = progskeet_diag_set_addr(p, base ^ ((uint32_t)1 << i));
+            p = progskeet_diag_write(p, pattern ^ (uint16_t)((i + 1) * 0x0101));
+        }
+
+        p = progskeet_diag_set_addr(p, base);
+        p = progskeet_diag_cmd16(p, PROGSKEET_CMD_READ_CYCLE, 1);
+
+        for (i = 0; i < lines; i++) {
+            p = progskeet_diag_set_addr(p, base ^ ((uint32_t)1 << i));
+            p = progskeet_diag_cmd16(p, PROGSKEET_CMD_READ_CYCLE, 1);
+        }
+    }
+
+    return p;
+}
+
+static void progskeet_diag_finish(struct progskeet_line* lines, const int count, uint32_t* faults)
+{
+    int i;
+
+    *faults = 0;
+
+    for (i = 0; i < count; i++) {
+        /* A short also looks stuck in the direction the other line wins */
+        if (lines[i].shorted_to)
+            lines[i].faults = PROGSKEET_LINE_SHORT;
+
+        if (lines[i].faults)
+            *faults |= (uint32_t)1 << i;
+    }
+}
+
+/* Lines that only ever read one level are stuck, two lines that always read alike are shorted */
+static void progskeet_diag_bits(struct progskeet_line* lines, const uint16_t mask,
+                                const uint16_t* high, const uint16_t* low, uint32_t* faults)
+{
+    uint16_t seen_high, seen_low, stuck;
+    int i, j;
+
+    stuck = 0;
+    for (j = 0; j < 16; j++) {
+        if ((mask & (1 << j)) == 0)
+            continue;
+
+        seen_high = seen_low = 0;
+        for (i = 0; i < 16; i++) {
+            if ((mask & (1 << i)) == 0)
+                continue;
+
+            seen_high |= progskeet_diag_bit(high[i], j) | progskeet_diag_bit(low[i], j);
+            seen_low |= !progskeet_diag_bit(high[i], j) || !progskeet_diag_bit(low[i], j);
+        }
+
+        if (!seen_high)
+            lines[j].faults |= PROGSKEET_LINE_STUCK_LOW;
+        else if (!seen_low)
+            lines[j].faults |= PROGSKEET_LINE_STUCK_HIGH;
+
+        if (lines[j].faults)
+            stuck |= 1 << j;
+    }
+
+    for (j = 0; j < 16; j++) {
+        if ((mask & (1 << j)) == 0 || (stuck & (1 << j)))
+            continue;
+
+        for (i = 0; i < 16; i++) {
+            if (i == j || (mask & (1 << i)) == 0 || (stuck & (1 << i)))
+                continue;
+
+            /* Driven against each other both ways, they still read alike */
+            if (progskeet_diag_bit(high[i], j) == progskeet_diag_bit(high[i], i) &&
+                progskeet_diag_bit(low[i], j) == progskeet_diag_bit(low[i], i)) {
+                lines[j].shorted_to |= (uint32_t)1 << i;
+                lines[i].shorted_to |= (uint32_t)1 << j;
+            }
+        }
+
+        for (i = 0; i < 16; i++) {
+            if ((mask & (1 << i)) == 0)
+                continue;
+
+            if (progskeet_diag_bit(high[i], j) != (i == j) || progskeet_diag_bit(low[i], j) != (i != j))
+                lines[j].faults |= PROGSKEET_LINE_OPEN;
+        }
+    }
+
+    progskeet_diag_finish(lines, 16, faults);
+}
+
+/*
+ * One pass of the address test, read[0] came from the base address and
+ * read[i + 1] from line i flipped. Words only compare to what was written
+ * if the data lines are good.
+ */
+static void progskeet_diag_addr_pass(struct progskeet_line* lines, const uint8_t count, const uint16_t* read,
+                                     const uint16_t pattern, const uint8_t stuck_fault, const int data_ok)
+{
+    int i, j;
+
+    for (i = 0; i < count; i++) {
+        /* Flipping the line did not leave the base location */
+        if (read[i + 1] == read[0]) {
+            lines[i].faults |= stuck_fault;
+            continue;
+        }
+
+        for (j = 0; j < count; j++) {
+            if (j != i && read[i + 1] == read[j + 1])
+                lines[i].shorted_to |= (uint32_t)1 << j;
+        }
+
+        if (data_ok && !lines[i].shorted_to && read[i + 1] != (uint16_t)(pattern ^ ((i + 1) * 0x0101)))
+            lines[i].faults |= PROGSKEET_LINE_OPEN;
+    }
+}
+
+int progskeet_diagnose(struct progskeet_handle* handle, const uint16_t gpio_mask, const uint8_t addr_lines,
+                       struct progskeet_diag* diag)
+{
+    uint16_t readback[DIAG_READBACK_MAX];
+    uint16_t high[16], low[16];
+    char cmdbuf[DIAG_CMD_MAX];
+    size_t count, pos;
+    char* p;
+    int i, res;
+
+    if (!handle || !diag || addr_lines > PROGSKEET_DIAG_ADDR_LINES)
+        return -1;
+
+    memset(diag, 0, sizeof(*diag));
+
+    p = cmdbuf;
+
+    *p++ = PROGSKEET_CMD_SET_CONFIG;
+    *p++ = handle->cur_config | PROGSKEET_CFG_16BIT;
+
+    p = progskeet_diag_data_encode(p);
+    p = progskeet_diag_gpio_encode(handle, p, gpio_mask);
+    p = progskeet_diag_addr_encode(p, addr_lines);
+
+    /* Back to what the handle believes, the address has to go out again */
+    p = progskeet_diag_cmd16(p, PROGSKEET_CMD_SET_GPIO_DIR, handle->cur_gpio_dir);
+    p = progskeet_diag_cmd16(p, PROGSKEET_CMD_SET_GPIO, handle->cur_gpio);
+
+    *p++ = PROGSKEET_CMD_SET_CONFIG;
+    *p++ = handle->cur_config;
+
+    /* Two passes of every data line, GPIO under test and address location */
+    count = 2 * 16 + (addr_lines ? 2 * ((size_t)addr_lines + 1) : 0);
+    for (i = 0; i < 16; i++) {
+        if (gpio_mask & (1 << i))
+            count += 2;
+    }
+
+    /* Whatever was queued goes first so the test finds room in the TX buffer */
+    if ((size_t)(p - cmdbuf) > progskeet_tx_free(handle) && (res = progskeet_sync(handle)) < 0)
+        return res;
+
+    if ((res = progskeet_enqueue_tx_buf(handle, cmdbuf, (size_t)(p - cmdbuf))) < 0 ||
+        (res = progskeet_enqueue_rx_buf(handle, readback, count * sizeof(uint16_t))) < 0)
+        return res;
+
+    handle->addr_stale = 1;
+
+    if (handle->cache)
+        progskeet_cache_invalidate_all(handle);
+
+    if ((res = progskeet_sync(handle)) < 0)
+        return res;
+
+    progskeet_diag_bits(diag->data, 0xFFFF, readback, readback + 16, &diag->data_faults);
+    pos = 32;
+
+    memset(high, 0, sizeof(high));
+    memset(low, 0, sizeof(low));
+
+    for (i = 0; i < 16; i++) {
+        if (gpio_mask & (1 << i))
+            high[i] = readback[pos++];
+    }
+
+    for (i = 0; i < 16; i++) {
+        if (gpio_mask & (1 << i))
+            low[i] = readback[pos++];
+    }
+
+    progskeet_diag_bits(diag->gpio, gpio_mask, high, low, &diag->gpio_faults);
+
+    if (addr_lines) {
+        progskeet_diag_addr_pass(diag->addr, addr_lines, readback + pos, DIAG_ADDR_PATTERN_HIGH,
+                                 PROGSKEET_LINE_STUCK_LOW, !diag->data_faults);
+        pos += (size_t)addr_lines + 1;
+
+        progskeet_diag_addr_pass(diag->addr, addr_lines, readback + pos, DIAG_ADDR_PATTERN_LOW,
+                                 PROGSKEET_LINE_STUCK_HIGH, !diag->data_faults);
+
+        progskeet_diag_finish(diag->addr, addr_lines, &diag->addr_faults);
+    }
+
+    return 0;
+}
@@ -0,0 +1,643 @@
+/*
+ * libprogskeet - ProgSkeet library
+ * Copyright (C) 2012 Axel Gembe <axel@gembe.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * ProgSkeet ECC functions
+ *
+ * The Hamming code is the 3 byte one of the Linux software ECC, so dumps
+ * of most SLC parts correct without further setup. BCH works over
+ * GF(2^13) with the same primitive polynomial and bit order as the Linux
+ * BCH library. The ECC of a step is recomputed with a byte wise LFSR
+ * table and only the remainder, at most 26 bytes, goes into the syndrome
+ * computation, so clean steps cost one table lookup per byte.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "progskeet.h"
+#include "progskeet_private.h"
+
+#define BCH_M                       13
+#define BCH_N                       ((1 << BCH_M) - 1)
+#define BCH_PRIM_POLY               0x201B
+#define BCH_MAX_T                   16
+#define BCH_MAX_ECC_BITS            (BCH_M * BCH_MAX_T)
+#define BCH_ECC_WORDS               ((BCH_MAX_ECC_BITS + 31) / 32)
+
+#define HAMMING_ECC_BYTES           3
+
+struct progskeet_ecc
+{
+    struct progskeet_ecc_layout layout;
+
+    int ecc_bytes;
+
+    /* BCH */
+    int t;
+    int ecc_bits;
+    uint16_t* a_pow;
+    uint16_t* a_log;
+
+    /* Remainder of v * x^ecc_bits for every byte v, left aligned */
+    uint32_t (*lfsr)[BCH_ECC_WORDS];
+};
+
+/*
+ * Hamming
+ */
+
+static int progskeet_ecc_parity8(uint8_t v)
+{
+    v ^= v >> 4;
+    v ^= v >> 2;
+    v ^= v >> 1;
+
+    return v & 1;
+}
+
+static void progskeet_ecc_hamming_calc(const uint8_t* buf, const uint32_t len, uint8_t* code)
+{
+    uint32_t odd_index = 0;
+    uint32_t odd_count = 0;
+    uint32_t rp[18];
+    uint64_t cols64 = 0;
+    uint64_t v;
+    uint8_t cols;
+    uint32_t i;
+    int k;
+
+    /* Bytes with odd parity decide the line parities */
+    for (i = 0; i < len; i += 8) {
+        memcpy(&v, buf + i, 8);
+        cols64 ^= v;
+
+        for (k = 0; k < 8; k++) {
+            if (progskeet_ecc_parity8(buf[i + k])) {
+                odd_index ^= i + k;
+                odd_count ^= 1;
+            }
+        }
+    }
+
+    cols64 ^= cols64 >> 32;
+    cols64 ^= cols64 >> 16;
+    cols64 ^= cols64 >> 8;
+    cols = (uint8_t)cols64;
+
+    /* rp(2k + 1) covers the bytes with address bit k set, rp(2k) the others */
+    for (k = 0; k < 9; k++) {
+        rp[2 * k + 1] = (odd_index >> k) & 1;
+        rp[2 * k] = rp[2 * k + 1] ^ odd_count;
+    }
+
+    code[0] = code[1] = 0;
+    for (k = 0; k < 8; k++) {
+        code[0] |= (uint8_t)(rp[k] << k);
+        code[1] |= (uint8_t)(rp[k + 8] << k);
+    }
+
+    code[2] = (uint8_t)((progskeet_ecc_parity8(cols & 0xF0) << 7) | (progskeet_ecc_parity8(cols & 0x0F) << 6) |
+                        (progskeet_ecc_parity8(cols & 0xCC) << 5) | (progskeet_ecc_parity8(cols & 0x33) << 4) |
+                        (progskeet_ecc_parity8(cols & 0xAA) << 3) | (progskeet_ecc_parity8(cols & 0x55) << 2));
+
+    if (len == 512)
+        code[2] |= (uint8_t)((rp[17] << 1) | rp[16]);
+
+    /* Stored inverted so an erased step has an erased ECC */
+    code[0] = ~code[0];
+    code[1] = ~code[1];
+    code[2] = ~code[2];
+
+    if (len != 512)
+        code[2] |= 0x03;
+}
+
+/* Collects the odd bits, the ones that are set for an address bit of 1 */
+static uint32_t progskeet_ecc_odd_bits(uint8_t v)
+{
+    return ((v >> 1) & 1) | ((v >> 2) & 2) | ((v >> 3) & 4) | ((v >> 4) & 8);
+}
+
+static int progskeet_ecc_popcount8(uint8_t v)
+{
+    int n = 0;
+
+    for (; v; v &= v - 1)
+        n++;
+
+    return n;
+}
+
+static int progskeet_ecc_hamming_correct(uint8_t* buf, const uint32_t len, uint8_t* code)
+{
+    uint8_t calc[HAMMING_ECC_BYTES];
+    uint8_t b0, b1, b2;
+    uint32_t byte_addr, bit_addr;
+
+    progskeet_ecc_hamming_calc(buf, len, calc);
+
+    b0 = code[0] ^ calc[0];
+    b1 = code[1] ^ calc[1];
+    b2 = code[2] ^ calc[2];
+
+    if ((b0 | b1 | b2) == 0)
+        return 0;
+
+    /* A single flipped data bit flips exactly one bit of every parity pair */
+    if (((b0 ^ (b0 >> 1)) & 0x55) == 0x55 && ((b1 ^ (b1 >> 1)) & 0x55) == 0x55 &&
+        ((len == 512 && ((b2 ^ (b2 >> 1)) & 0x55) == 0x55) ||
+         (len != 512 && ((b2 ^ (b2 >> 1)) & 0x54) == 0x54))) {
+        byte_addr = (progskeet_ecc_odd_bits(b1) << 4) | progskeet_ecc_odd_bits(b0);
+        if (len == 512)
+            byte_addr |= progskeet_ecc_odd_bits(b2 & 0x03) << 8;
+        bit_addr = progskeet_ecc_odd_bits(b2 >> 2);
+
+        buf[byte_addr] ^= (uint8_t)(1 << bit_addr);
+        return 1;
+    }
+
+    /* A flip in the ECC itself */
+    if (progskeet_ecc_popcount8(b0) + progskeet_ecc_popcount8(b1) + progskeet_ecc_popcount8(b2) == 1) {
+        memcpy(code, calc, HAMMING_ECC_BYTES);
+        return 1;
+    }
+
+    return -1;
+}
+
+/*
+ * BCH
+ */
+
+static uint16_t progskeet_ecc_gf_mul(const struct progskeet_ecc* ecc, const uint16_t a, const uint16_t b)
+{
+    if (!a || !b)
+        return 0;
+
+    return ecc->a_pow[(ecc->a_log[a] + ecc->a_log[b]) % BCH_N];
+}
+
+static uint16_t progskeet_ecc_gf_div(const struct progskeet_ecc* ecc, const uint16_t a, const uint16_t b)
+{
+    if (!a)
+        return 0;
+
+    return ecc->a_pow[(ecc->a_log[a] + BCH_N - ecc->a_log[b]) % BCH_N];
+}
+
+/* Builds the generator polynomial from the conjugacy classes of a^1 .. a^2t */
+static int progskeet_ecc_bch_generator(struct progskeet_ecc* ecc, uint8_t* g)
+{
+    uint16_t poly[BCH_MAX_ECC_BITS + 1];
+    uint8_t* root;
+    int deg = 0;
+    int i, j, k;
+
+    if ((root = (uint8_t*)calloc(BCH_N, 1)) == NULL)
+        return -1;
+
+    for (i = 1; i < 2 * ecc->t; i += 2) {
+        j = i;
+        do {
+            root[j] = 1;
+            j = (j * 2) % BCH_N;
+        } while (j != i);
+    }
+
+    memset(poly, 0, sizeof(poly));
+    poly[0] = 1;
+
+    for (i = 0; i < BCH_N; i++) {
+        if (!root[i])
+            continue;
+
+        if (deg >= BCH_MAX_ECC_BITS) {
+            free(root);
+            return -1;
+        }
+
+        /* poly *= (x + a^i) */
+        deg++;
+        for (k = deg; k > 0; k--)
+            poly[k] = poly[k - 1] ^ progskeet_ecc_gf_mul(ecc, poly[k], ecc->a_pow[i]);
+        poly[0] = progskeet_ecc_gf_mul(ecc, poly[0], ecc->a_pow[i]);
+    }
+
+    free(root);
+
+    for (i = 0; i <= deg; i++)
+        g[i] = (uint8_t)poly[i];
+
+    return deg;
+}
+
+static int progskeet_ecc_bch_init(struct progskeet_ecc* ecc)
+{
+    uint8_t g[BCH_MAX_ECC_BITS + 1];
+    uint32_t glow[BCH_ECC_WORDS];
+    uint32_t reg[BCH_ECC_WORDS];
+    uint32_t x = 1;
+    int feedback;
+    int i, v, bit, w;
+
+    ecc->a_pow = (uint16_t*)malloc((BCH_N + 1) * sizeof(uint16_t));
+    ecc->a_log = (uint16_t*)malloc((BCH_N + 1) * sizeof(uint16_t));
+    ecc->lfsr = (uint32_t (*)[BCH_ECC_WORDS])malloc(256 * sizeof(*ecc->lfsr));
+
+    if (!ecc->a_pow || !ecc->a_log || !ecc->lfsr)
+        return -1;
+
+    for (i = 0; i < BCH_N; i++) {
+        ecc->a_pow[i] = (uint16_t)x;
+        ecc->a_log[x] = (uint16_t)i;
+
+        x <<= 1;
+        if (x & (1 << BCH_M))
+            x ^= BCH_PRIM_POLY;
+    }
+
+    ecc->a_pow[BCH_N] = 1;
+    ecc->a_log[0] = 0;
+
+    if ((ecc->ecc_bits = progskeet_ecc_bch_generator(ecc, g)) < 8)
+        return -1;
+
+    ecc->ecc_bytes = (ecc->ecc_bits + 7) / 8;
+
+    /* g without its top term, coefficient of x^k at bit ecc_bits - 1 - k from the left */
+    memset(glow, 0, sizeof(glow));
+    for (i = 0; i < ecc->ecc_bits; i++) {
+        if (g[i])
+            glow[(ecc->ecc_bits - 1 - i) / 32] |= (uint32_t)1 << (31 - (ecc->ecc_bits - 1 - i) % 32);
+    }
+
+    for (v = 0; v < 256; v++) {
+        memset(reg, 0, sizeof(reg));
+
+        for (bit = 7; bit >= 0; bit--) {
+            feedback = (int)(reg[0] >> 31) ^ ((v >> bit) & 1);
+
+            for (w = 0; w < BCH_ECC_WORDS - 1; w++)
+                reg[w] = (reg[w] << 1) | (reg[w + 1] >> 31);
+            reg[BCH_ECC_WORDS - 1] <<= 1;
+
+            if (feedback) {
+                for (w = 0; w < BCH_ECC_WORDS; w++)
+                    reg[w] ^= glow[w];
+            }
+        }
+
+        memcpy(ecc->lfsr[v], reg, sizeof(reg));
+    }
+
+    return 0;
+}
+
+static void progskeet_ecc_bch_calc(const struct progskeet_ecc* ecc, const uint8_t* buf, const uint32_t len, uint8_t* code)
+{
+    uint32_t reg[BCH_ECC_WORDS];
+    const uint32_t* tab;
+    uint32_t i;
+    int w;
+
+    memset(reg, 0, sizeof(reg));
+
+    for (i = 0; i < len; i++) {
+        tab = ecc->lfsr[(reg[0] >> 24) ^ buf[i]];
+
+        for (w = 0; w < BCH_ECC_WORDS - 1; w++)
+            reg[w] = ((reg[w] << 8) | (reg[w + 1] >> 24)) ^ tab[w];
+        reg[BCH_ECC_WORDS - 1] = (reg[BCH_ECC_WORDS - 1] << 8) ^ tab[BCH_ECC_WORDS - 1];
+    }
+
+    for (i = 0; i < (uint32_t)ecc->ecc_bytes; i++)
+        code[i] = (uint8_t)(reg[i / 4] >> (24 - (i % 4) * 8));
+}
+
+/* Berlekamp-Massey, returns the degree of the error locator */
+static int progskeet_ecc_bch_locator(const struct progskeet_ecc* ecc, const uint16_t* s, uint16_t* lambda)
+{
+    uint16_t b[BCH_MAX_T * 2 + 1];
+    uint16_t tmp[BCH_MAX_T * 2 + 1];
+    uint16_t d, bd = 1, scale;
+    int len = 0, shift = 1;
+    int n, i;
+
+    memset(lambda, 0, sizeof(uint16_t) * (BCH_MAX_T * 2 + 1));
+    memset(b, 0, sizeof(b));
+    lambda[0] = b[0] = 1;
+
+    for (n = 0; n < 2 * ecc->t; n++) {
+        d = s[n + 1];
+        for (i = 1; i <= len; i++)
+            d ^= progskeet_ecc_gf_mul(ecc, lambda[i], s[n + 1 - i]);
+
+        if (d == 0) {
+            shift++;
+            continue;
+        }
+
+        scale = progskeet_ecc_gf_div(ecc, d, bd);
+        memcpy(tmp, lambda, sizeof(tmp));
+
+        for (i = 0; i + shift <= 2 * ecc->t; i++)
+            lambda[i + shift] ^= progskeet_ecc_gf_mul(ecc, scale, b[i]);
+
+        if (2 * len <= n) {
+            len = n + 1 - len;
+            memcpy(b, tmp, sizeof(b));
+            bd = d;
+            shift = 1;
+        } else {
+            shift++;
+        }
+    }
+
+    return len;
+}
+
+static void progskeet_ecc_flip(uint8_t* buf, const uint32_t len, uint8_t* code, const int ecc_bits, const int deg)
+{
+    int k;
+
+    /* Degrees below ecc_bits are the ECC, the first data byte holds the highest ones */
+    if (deg < ecc_bits) {
+        k = ecc_bits - 1 - deg;
+        code[k / 8] ^= (uint8_t)(0x80 >> (k % 8));
+        return;
+    }
+
+    k = deg - ecc_bits;
+    buf[len - 1 - k / 8] ^= (uint8_t)(1 << (k % 8));
+}
+
+static int progskeet_ecc_bch_correct(const struct progskeet_ecc* ecc, uint8_t* buf, const uint32_t len, uint8_t* code)
+{
+    uint16_t s[BCH_MAX_T * 2 + 1];
+    uint16_t lambda[BCH_MAX_T * 2 + 1];
+    int term[BCH_MAX_T + 1];
+    uint8_t calc[(BCH_MAX_ECC_BITS + 7) / 8];
+    uint8_t diff[(BCH_MAX_ECC_BITS + 7) / 8];
+    int errors[BCH_MAX_T];
+    int nerr = 0;
+    int any = 0;
+    int deg, degs, pos, n;
+    uint16_t sum;
+    int i, j;
+
+    progskeet_ecc_bch_calc(ecc, buf, len, calc);
+
+    for (i = 0; i < ecc->ecc_bytes; i++)
+        any |= diff[i] = calc[i] ^ code[i];
+
+    if (!any)
+        return 0;
+
+    /* Syndromes of the remainder, which are the syndromes of the error */
+    memset(s, 0, sizeof(s));
+    for (pos = 0; pos < ecc->ecc_bits; pos++) {
+        if (!(diff[pos / 8] & (0x80 >> (pos % 8))))
+            continue;
+
+        deg = ecc->ecc_bits - 1 - pos;
+        for (j = 1; j < 2 * ecc->t; j += 2)
+            s[j] ^= ecc->a_pow[(int)(((long)j * deg) % BCH_N)];
+    }
+
+    for (j = 2; j <= 2 * ecc->t; j += 2)
+        s[j] = progskeet_ecc_gf_mul(ecc, s[j / 2], s[j / 2]);
+
+    if ((n = progskeet_ecc_bch_locator(ecc, s, lambda)) > ecc->t)
+        return -1;
+
+    /* Chien search over the shortened code, term[i] is log(lambda[i] * a^(-i * deg)) */
+    for (i = 0; i <= n; i++)
+        term[i] = lambda[i] ? ecc->a_log[lambda[i]] : -1;
+
+    degs = (int)len * 8 + ecc->ecc_bits;
+    for (deg = 0; deg < degs && nerr < n; deg++) {
+        sum = 0;
+
+        for (i = 0; i <= n; i++) {
+            if (term[i] < 0)
+                continue;
+
+            sum ^= ecc->a_pow[term[i]];
+            term[i] = (term[i] + BCH_N - i) % BCH_N;
+        }
+
+        if (sum == 0)
+            errors[nerr++] = deg;
+    }
+
+    if (nerr != n)
+        return -1;
+
+    for (i = 0; i < nerr; i++)
+        progskeet_ecc_flip(buf, len, code, ecc->ecc_bits, errors[i]);
+
+    return nerr;
+}
+
+/*
+ * Pages
+ */
+
+int progskeet_ecc_create(struct progskeet_ecc** ecc, const struct progskeet_ecc_layout* layout)
+{
+    struct progskeet_ecc* e;
+
+    if (!ecc || !layout || layout->step_size == 0 || (layout->step_size % 8) != 0)
+        return -1;
+
+    if (layout->type == PROGSKEET_ECC_HAMMING && layout->step_size != 256 && layout->step_size != 512)
+        return -1;
+
+    if (layout->type == PROGSKEET_ECC_BCH && (layout->strength < 1 || layout->strength > BCH_MAX_T ||
+                                              layout->step_size * 8 + BCH_MAX_ECC_BITS > BCH_N))
+        return -1;
+
+    if ((e = (struct progskeet_ecc*)malloc(sizeof(struct progskeet_ecc))) == NULL)
+        return -2;
+
+    memset(e, 0, sizeof(struct progskeet_ecc));
+    e->layout = *layout;
+
+    switch (layout->type) {
+    case PROGSKEET_ECC_HAMMING:
+        e->ecc_bytes = HAMMING_ECC_BYTES;
+        break;
+
+    case PROGSKEET_ECC_BCH:
+        e->t = layout->strength;
+        if (progskeet_ecc_bch_init(e) < 0) {
+            progskeet_ecc_destroy(e);
+            return -2;
+        }
+        break;
+
+    default:
+        free(e);
+        return -1;
+    }
+
+    *ecc = e;
+
+    return 0;
+}
+
+void progskeet_ecc_destroy(struct progskeet_ecc* ecc)
+{
+    if (!ecc)
+        return;
+
+    free(ecc->a_pow);
+    free(ecc->a_log);
+    free(ecc->lfsr);
+    free(ecc);
+}
+
+int progskeet_ecc_bytes(const struct progskeet_ecc* ecc)
+{
+    return ecc ? ecc->ecc_bytes : -1;
+}
+
+static uint8_t* progskeet_ecc_code_at(const struct progskeet_ecc* ecc, char* page, const uint32_t page_size, const uint32_t step)
+{
+    uint32_t stride = ecc->layout.ecc_stride ? ecc->layout.ecc_stride : (uint32_t)ecc->ecc_bytes;
+
+    return (uint8_t*)page + page_size + ecc->layout.ecc_offset + step * stride;
+}
+
+static int progskeet_ecc_check_layout(const struct progskeet_ecc* ecc, const uint32_t page_size, const uint32_t spare_size)
+{
+    uint32_t steps = page_size / ecc->layout.step_size;
+    uint32_t stride = ecc->layout.ecc_stride ? ecc->layout.ecc_stride : (uint32_t)ecc->ecc_bytes;
+
+    return steps > 0 && page_size % ecc->layout.step_size == 0 &&
+           ecc->layout.ecc_offset + (steps - 1) * stride + ecc->ecc_bytes <= spare_size;
+}
+
+int progskeet_ecc_encode_page(const struct progskeet_ecc* ecc, char* page, const uint32_t page_size, const uint32_t spare_size)
+{
+    uint32_t step;
+    uint8_t* data;
+
+    if (!ecc || !page)
+        return -1;
+
+    if (!progskeet_ecc_check_layout(ecc, page_size, spare_size))
+        return -2;
+
+    for (step = 0; step < page_size / ecc->layout.step_size; step++) {
+        data = (uint8_t*)page + step * ecc->layout.step_size;
+
+        if (ecc->layout.type == PROGSKEET_ECC_HAMMING)
+            progskeet_ecc_hamming_calc(data, ecc->layout.step_size, progskeet_ecc_code_at(ecc, page, page_size, step));
+        else
+            progskeet_ecc_bch_calc(ecc, data, ecc->layout.step_size, progskeet_ecc_code_at(ecc, page, page_size, step));
+    }
+
+    return 0;
+}
+
+/* Zero bits in buf, stops counting once there are more than max */
+static int progskeet_ecc_zero_bits(const uint8_t* buf, const uint32_t len, const int max)
+{
+    uint32_t i;
+    int n = 0;
+
+    for (i = 0; i < len && n <= max; i++) {
+        if (buf[i] != 0xFF)
+            n += progskeet_ecc_popcount8((uint8_t)~buf[i]);
+    }
+
+    return n;
+}
+
+/*
+ * Restores a step that reads as erased apart from at most strength
+ * bitflips, like Linux nand_check_erased_ecc_chunk. Returns the bitflips,
+ * -1 if the step holds data.
+ */
+static int progskeet_ecc_erased_step(const struct progskeet_ecc* ecc, uint8_t* data, uint8_t* code, const int strength)
+{
+    int flips;
+
+    flips = progskeet_ecc_zero_bits(code, ecc->ecc_bytes, strength);
+    if (flips <= strength)
+        flips += progskeet_ecc_zero_bits(data, ecc->layout.step_size, strength - flips);
+
+    if (flips > strength)
+        return -1;
+
+    memset(data, 0xFF, ecc->layout.step_size);
+    memset(code, 0xFF, ecc->ecc_bytes);
+
+    return flips;
+}
+
+int progskeet_ecc_correct_page(const struct progskeet_ecc* ecc, char* page, const uint32_t page_size, const uint32_t spare_size,
+                               struct progskeet_ecc_stats* stats)
+{
+    uint32_t step;
+    uint8_t* data;
+    uint8_t* code;
+    int strength;
+    int flips;
+
+    if (!ecc || !page || !stats)
+        return -1;
+
+    memset(stats, 0, sizeof(struct progskeet_ecc_stats));
+
+    if (!progskeet_ecc_check_layout(ecc, page_size, spare_size))
+        return -2;
+
+    strength = ecc->layout.type == PROGSKEET_ECC_HAMMING ? 1 : ecc->t;
+
+    for (step = 0; step < page_size / ecc->layout.step_size; step++) {
+        data = (uint8_t*)page + step * ecc->layout.step_size;
+        code = progskeet_ecc_code_at(ecc, page, page_size, step);
+
+        /* Erased steps have no valid BCH code */
+        if (progskeet_ecc_zero_bits(code, ecc->ecc_bytes, 0) == 0 && progskeet_ecc_zero_bits(data, ecc->layout.step_size, 0) == 0)
+            continue;
+
+        if (ecc->layout.type == PROGSKEET_ECC_HAMMING)
+            flips = progskeet_ecc_hamming_correct(data, ecc->layout.step_size, code);
+        else
+            flips = progskeet_ecc_bch_correct(ecc, data, ecc->layout.step_size, code);
+
+        /* An erased step with a few bitflips does not decode either */
+        if (flips < 0)
+            flips = progskeet_ecc_erased_step(ecc, data, code, strength);
+
+        if (flips < 0) {
+            stats->failed++;
+            continue;
+        }
+
+        stats->corrected += flips;
+        if ((uint32_t)flips > stats->max_step)
+            stats->max_step = flips;
+    }
+
+    return stats->failed ? -5 : 0;
+}
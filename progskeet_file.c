@@ -0,0 +1,446 @@
+/*
+ * libprogskeet - ProgSkeet library
+ * Copyright (C) 2012 Axel Gembe <axel@gembe.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * ProgSkeet file backed transfer functions
+ *
+ * Images are streamed through a window that slides over the file, so only
+ * one window is ever mapped (or buffered) and the first window goes out
+ * as soon as it is mapped instead of after the whole file has been loaded.
+ */
+
+#ifndef WIN32
+#define _FILE_OFFSET_BITS 64
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#else /* WIN32 */
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <io.h>
+#include <stdlib.h>
+#endif /* !WIN32 */
+
+#include <errno.h>
+
+#include "progskeet.h"
+#include "progskeet_private.h"
+
+/* Amount of the file that is mapped and transferred per sync */
+#define PROGSKEET_FILE_WINDOW (256 * 1024)
+
+#ifndef WIN32
+
+static uint64_t progskeet_file_page_mask()
+{
+    return (uint64_t)sysconf(_SC_PAGESIZE) - 1;
+}
+
+/* Hints the kernel to start reading the next window while this one is sent */
+static void progskeet_file_readahead(int fd, const uint64_t offset, const uint64_t len)
+{
+#ifdef POSIX_FADV_WILLNEED
+    if (len > 0)
+        posix_fadvise(fd, (off_t)offset, (off_t)len, POSIX_FADV_WILLNEED);
+#endif /* POSIX_FADV_WILLNEED */
+}
+
+/*
+ * Maps a window of the file, the returned pointer points to the requested
+ * offset, base and maplen have to be passed to munmap.
+ */
+static char* progskeet_file_map(int fd, const uint64_t offset, const size_t len, int writable, void** base, size_t* maplen)
+{
+    uint64_t aligned;
+    void* map;
+
+    aligned = offset & ~progskeet_file_page_mask();
+    *maplen = (size_t)(offset - aligned) + len;
+
+    map = mmap(NULL, *maplen, writable ? (PROT_READ | PROT_WRITE) : PROT_READ,
+               MAP_SHARED, fd, (off_t)aligned);
+
+    if (map == MAP_FAILED)
+        return NULL;
+
+    madvise(map, *maplen, MADV_SEQUENTIAL);
+
+    *base = map;
+
+    return (char*)map + (offset - aligned);
+}
+
+static int progskeet_file_write_fd(struct progskeet_handle* handle, int fd, const uint64_t offset, const uint64_t len)
+{
+    struct stat st;
+    uint64_t done;
+    size_t chunk;
+    size_t maplen;
+    void* base;
+    char* win;
+    int res;
+
+    if (!handle || fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) < 0 || (uint64_t)st.st_size < offset + len) {
+        progskeet_log(handle, progskeet_log_level_error, "Source file is smaller than the requested range\n");
+        return -2;
+    }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, (off_t)offset, (off_t)len, POSIX_FADV_SEQUENTIAL);
+#endif /* POSIX_FADV_SEQUENTIAL */
+
+    res = 0;
+    done = 0;
+    while (done < len && (res = progskeet_check_cancel(handle)) == 0) {
+        chunk = (len - done) > PROGSKEET_FILE_WINDOW ? PROGSKEET_FILE_WINDOW : (size_t)(len - done);
+
+        if ((win = progskeet_file_map(fd, offset + done, chunk, 0, &base, &maplen)) == NULL) {
+            progskeet_log(handle, progskeet_log_level_error, "Failed to map source file\n");
+            return -3;
+        }
+
+        progskeet_file_readahead(fd, offset + done + chunk,
+                                 (len - done - chunk) > PROGSKEET_FILE_WINDOW ? PROGSKEET_FILE_WINDOW : (len - done - chunk));
+
+        /* The window stays mapped until the sync is done, it goes out in place */
+        progskeet_progress_add(handle, chunk);
+
+        res = progskeet_write_ref(handle, win, chunk);
+        if (res == 0)
+            res = progskeet_sync(handle);
+
+        munmap(base, maplen);
+
+        /* A cancel or deadline during the sync keeps its own code */
+        if (res < 0)
+            return res == PROGSKEET_ERR_CANCELLED || res == PROGSKEET_ERR_DEADLINE ? res : -4;
+
+        done += chunk;
+    }
+
+    return res;
+}
+
+struct progskeet_file_hash_job
+{
+    struct progskeet_digest_ctx* ctx;
+    const char* data;
+    size_t len;
+};
+
+static void progskeet_file_hash_work(void* arg)
+{
+    struct progskeet_file_hash_job* job = (struct progskeet_file_hash_job*)arg;
+
+    progskeet_digest_update(job->ctx, job->data, job->len);
+}
+
+static int progskeet_file_read_fd_hashed(struct progskeet_handle* handle, int fd, const uint64_t offset, const uint64_t len,
+                                        const int hash_flags, struct progskeet_digest* digest)
+{
+    struct progskeet_digest_ctx ctx;
+    struct progskeet_file_hash_job job;
+    struct progskeet_workers* workers = NULL;
+    struct stat st;
+    uint64_t done;
+    size_t chunk;
+    size_t maplen, prev_maplen = 0;
+    void* base;
+    void* prev_base = NULL;
+    char* win;
+    int res;
+
+    if (!handle || fd < 0 || (hash_flags && !digest))
+        return -1;
+
+    /* Preallocate the sink so the mapping never hits a hole or EOF */
+    if (fstat(fd, &st) < 0)
+        return -2;
+
+    if ((uint64_t)st.st_size < offset + len) {
+        res = posix_fallocate(fd, (off_t)offset, (off_t)len);
+        if (res == EINVAL || res == EOPNOTSUPP)
+            res = ftruncate(fd, (off_t)(offset + len));
+
+        if (res != 0) {
+            progskeet_log(handle, progskeet_log_level_error, "Failed to preallocate sink file\n");
+            return -2;
+        }
+    }
+
+    /*
+     * A single worker keeps the hash updates in order, the window it is
+     * hashing stays mapped until the next window has been transferred.
+     * Without the worker the windows are hashed inline.
+     */
+    if (hash_flags) {
+        progskeet_digest_init(&ctx, hash_flags);
+        workers = progskeet_workers_create(1);
+    }
+
+    res = 0;
+    done = 0;
+    while (done < len && (res = progskeet_check_cancel(handle)) == 0) {
+        chunk = (len - done) > PROGSKEET_FILE_WINDOW ? PROGSKEET_FILE_WINDOW : (size_t)(len - done);
+
+        if ((win = progskeet_file_map(fd, offset + done, chunk, 1, &base, &maplen)) == NULL) {
+            progskeet_log(handle, progskeet_log_level_error, "Failed to map sink file\n");
+            res = -3;
+            break;
+        }
+
+        progskeet_progress_add(handle, chunk);
+
+        /* RX data gets scattered straight into the page cache */
+        res = progskeet_read(handle, win, chunk);
+        if (res == 0)
+            res = progskeet_sync(handle);
+
+        if (prev_base) {
+            progskeet_workers_wait(workers);
+            munmap(prev_base, prev_maplen);
+            prev_base = NULL;
+        }
+
+        if (res < 0) {
+            munmap(base, maplen);
+            res = res == PROGSKEET_ERR_CANCELLED || res == PROGSKEET_ERR_DEADLINE ? res : -4;
+            break;
+        }
+
+        job.ctx = &ctx;
+        job.data = win;
+        job.len = chunk;
+
+        if (hash_flags && progskeet_workers_submit(workers, progskeet_file_hash_work, &job) == 0) {
+            prev_base = base;
+            prev_maplen = maplen;
+        } else {
+            if (hash_flags)
+                progskeet_file_hash_work(&job);
+
+            munmap(base, maplen);
+        }
+
+        done += chunk;
+    }
+
+    if (hash_flags) {
+        progskeet_workers_destroy(workers);
+
+        if (prev_base)
+            munmap(prev_base, prev_maplen);
+
+        if (res == 0)
+            progskeet_digest_final(&ctx, digest);
+    }
+
+    return res;
+}
+
+#else /* WIN32 */
+
+/* No mmap here, stream through a heap window of the same size instead */
+
+static int progskeet_file_write_fd(struct progskeet_handle* handle, int fd, const uint64_t offset, const uint64_t len)
+{
+    uint64_t done;
+    size_t chunk;
+    char* win;
+    int res;
+
+    if (!handle || fd < 0)
+        return -1;
+
+    if (_lseeki64(fd, (__int64)offset, SEEK_SET) < 0)
+        return -2;
+
+    if ((win = (char*)malloc(PROGSKEET_FILE_WINDOW)) == NULL)
+        return -3;
+
+    res = 0;
+    done = 0;
+    while (done < len && (res = progskeet_check_cancel(handle)) == 0) {
+        chunk = (len - done) > PROGSKEET_FILE_WINDOW ? PROGSKEET_FILE_WINDOW : (size_t)(len - done);
+
+        if (_read(fd, win, (unsigned int)chunk) != (int)chunk) {
+            res = -2;
+            break;
+        }
+
+        progskeet_progress_add(handle, chunk);
+
+        if ((res = progskeet_write_ref(handle, win, chunk)) < 0 || (res = progskeet_sync(handle)) < 0) {
+            res = res == PROGSKEET_ERR_CANCELLED || res == PROGSKEET_ERR_DEADLINE ? res : -4;
+            break;
+        }
+
+        done += chunk;
+    }
+
+    free(win);
+
+    return res;
+}
+
+static int progskeet_file_read_fd_hashed(struct progskeet_handle* handle, int fd, const uint64_t offset, const uint64_t len,
+                                        const int hash_flags, struct progskeet_digest* digest)
+{
+    struct progskeet_digest_ctx ctx;
+    uint64_t done;
+    size_t chunk;
+    char* win;
+    int res;
+
+    if (!handle || fd < 0 || (hash_flags && !digest))
+        return -1;
+
+    if (_lseeki64(fd, (__int64)offset, SEEK_SET) < 0)
+        return -2;
+
+    if ((win = (char*)malloc(PROGSKEET_FILE_WINDOW)) == NULL)
+        return -3;
+
+    progskeet_digest_init(&ctx, hash_flags);
+
+    res = 0;
+    done = 0;
+    while (done < len && (res = progskeet_check_cancel(handle)) == 0) {
+        chunk = (len - done) > PROGSKEET_FILE_WINDOW ? PROGSKEET_FILE_WINDOW : (size_t)(len - done);
+
+        progskeet_progress_add(handle, chunk);
+
+        if ((res = progskeet_read(handle, win, chunk)) < 0 || (res = progskeet_sync(handle)) < 0) {
+            res = res == PROGSKEET_ERR_CANCELLED || res == PROGSKEET_ERR_DEADLINE ? res : -4;
+            break;
+        }
+
+        if (hash_flags)
+            progskeet_digest_update(&ctx, win, chunk);
+
+        if (_write(fd, win, (unsigned int)chunk) != (int)chunk) {
+            res = -2;
+            break;
+        }
+
+        done += chunk;
+    }
+
+    free(win);
+
+    if (hash_flags && res == 0)
+        progskeet_digest_final(&ctx, digest);
+
+    return res;
+}
+
+#endif /* !WIN32 */
+
+int progskeet_write_fd(struct progskeet_handle* handle, int fd, const uint64_t offset, const uint64_t len)
+{
+    int res;
+
+    if (!handle)
+        return -1;
+
+    progskeet_progress_begin(handle, len);
+    res = progskeet_file_write_fd(handle, fd, offset, len);
+    progskeet_progress_end(handle);
+
+    return res;
+}
+
+int progskeet_read_fd_hashed(struct progskeet_handle* handle, int fd, const uint64_t offset, const uint64_t len,
+                             const int hash_flags, struct progskeet_digest* digest)
+{
+    int res;
+
+    if (!handle)
+        return -1;
+
+    progskeet_progress_begin(handle, len);
+    res = progskeet_file_read_fd_hashed(handle, fd, offset, len, hash_flags, digest);
+    progskeet_progress_end(handle);
+
+    return res;
+}
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif /* O_BINARY */
+
+int progskeet_read_fd(struct progskeet_handle* handle, int fd, const uint64_t offset, const uint64_t len)
+{
+    return progskeet_read_fd_hashed(handle, fd, offset, len, PROGSKEET_HASH_NONE, NULL);
+}
+
+int progskeet_write_file(struct progskeet_handle* handle, const char* path)
+{
+    struct stat st;
+    int fd;
+    int res;
+
+    if (!handle || !path)
+        return -1;
+
+    if ((fd = open(path, O_RDONLY | O_BINARY)) < 0) {
+        progskeet_log(handle, progskeet_log_level_error, "Failed to open %s\n", path);
+        return -2;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -2;
+    }
+
+    res = progskeet_write_fd(handle, fd, 0, (uint64_t)st.st_size);
+
+    close(fd);
+
+    return res;
+}
+
+int progskeet_read_file(struct progskeet_handle* handle, const char* path, const uint64_t len)
+{
+    return progskeet_read_file_hashed(handle, path, len, PROGSKEET_HASH_NONE, NULL);
+}
+
+int progskeet_read_file_hashed(struct progskeet_handle* handle, const char* path, const uint64_t len,
+                               const int hash_flags, struct progskeet_digest* digest)
+{
+    int fd;
+    int res;
+
+    if (!handle || !path)
+        return -1;
+
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0644)) < 0) {
+        progskeet_log(handle, progskeet_log_level_error, "Failed to open %s\n", path);
+        return -2;
+    }
+
+    res = progskeet_read_fd_hashed(handle, fd, 0, len, hash_flags, digest);
+
+    close(fd);
+
+    return res;
+}
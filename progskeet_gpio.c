@@ -0,0 +1,319 @@
+/*
+ * libprogskeet - ProgSkeet library
+ * Copyright (C) 2012 Axel Gembe <axel@gembe.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * ProgSkeet GPIO sampler functions
+ *
+ * A sample is a GET_GPIO followed by the NOPs up to the next one. That
+ * unit is encoded once into a block which goes out in place as often as a
+ * sync needs it, so sampling costs no encoding per sample. The VCD writer
+ * runs from readback callbacks and converts each block while the next one
+ * is still on the wire.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "progskeet.h"
+#include "progskeet_private.h"
+
+#define GPIO_NOPS_PER_US 48
+
+/* The GET_GPIO itself, taken as one NOP time */
+#define GPIO_SAMPLE_SLOT_NOPS 1
+
+/* Samples per sync, their readbacks fill the staging buffer */
+#define GPIO_SAMPLES_PER_SYNC (512 * 1024)
+
+/* Samples per block of the pattern, large enough to be sent in place */
+#define GPIO_SAMPLES_PER_BLOCK (32 * 1024)
+
+/* Bytes per block of the pattern, long intervals get fewer samples per block */
+#define GPIO_BLOCK_BYTES (256 * 1024)
+
+struct progskeet_gpio_pattern
+{
+    char* buf;
+
+    /* Bytes per sample */
+    size_t unit;
+
+    /* Samples per block */
+    size_t per_block;
+
+    /* NOP times per sample, the GET_GPIO included */
+    uint64_t slots;
+};
+
+struct progskeet_gpio_vcd
+{
+    FILE* fp;
+    uint16_t mask;
+    uint16_t last;
+    int started;
+
+    uint64_t slots;
+    size_t per_block;
+
+    /* Samples of the sync in flight, how many and how many are written */
+    const uint16_t* samples;
+    size_t count;
+    size_t written;
+
+    /* Time of the first sample of the sync in flight */
+    uint64_t start_ps;
+    uint64_t end_ps;
+};
+
+static uint64_t progskeet_gpio_nops(const uint32_t interval_ns)
+{
+    const uint64_t nops = ((uint64_t)interval_ns * GPIO_NOPS_PER_US + 500) / 1000;
+
+    return nops > GPIO_SAMPLE_SLOT_NOPS ? nops - GPIO_SAMPLE_SLOT_NOPS : 0;
+}
+
+static uint64_t progskeet_gpio_time_ps(const uint64_t slots, const uint64_t index)
+{
+    const uint64_t nops = index * slots;
+
+    /* Split so the scaling to picoseconds can't overflow on long captures */
+    return nops / GPIO_NOPS_PER_US * 1000000 + nops % GPIO_NOPS_PER_US * 1000000 / GPIO_NOPS_PER_US;
+}
+
+static int progskeet_gpio_pattern_create(struct progskeet_gpio_pattern* pattern, const uint32_t interval_ns)
+{
+    const uint64_t nops = progskeet_gpio_nops(interval_ns);
+    const uint64_t unit = 1 + 2 * ((nops + 0xFE) / 0xFF);
+    uint64_t remaining;
+    size_t pos;
+    size_t i;
+
+    pattern->buf = NULL;
+
+    /* A single sample has to fit a block */
+    if (unit > GPIO_BLOCK_BYTES)
+        return -1;
+
+    pattern->slots = nops + GPIO_SAMPLE_SLOT_NOPS;
+    pattern->unit = (size_t)unit;
+    pattern->per_block = GPIO_BLOCK_BYTES / pattern->unit < GPIO_SAMPLES_PER_BLOCK ? GPIO_BLOCK_BYTES / pattern->unit : GPIO_SAMPLES_PER_BLOCK;
+
+    if ((pattern->buf = (char*)malloc(pattern->unit * pattern->per_block)) == NULL)
+        return -3;
+
+    /* Same NOP split as progskeet_nop */
+    pos = 0;
+    for (i = 0; i < pattern->per_block; i++) {
+        pattern->buf[pos++] = PROGSKEET_CMD_GET_GPIO;
+
+        for (remaining = nops; remaining > 0; remaining -= remaining < 0xFF ? remaining : 0xFF) {
+            pattern->buf[pos++] = PROGSKEET_CMD_NOP;
+            pattern->buf[pos++] = (char)(remaining < 0xFF ? remaining : 0xFF);
+        }
+    }
+
+    return 0;
+}
+
+/* Queues count samples of one sync, cb runs after every block */
+static int progskeet_gpio_queue(struct progskeet_handle* handle, const struct progskeet_gpio_pattern* pattern,
+                                uint16_t* samples, const size_t count, progskeet_rx_cb cb, void* user_data)
+{
+    size_t done, chunk;
+    int res;
+
+    for (done = 0; done < count; done += chunk) {
+        chunk = count - done < pattern->per_block ? count - done : pattern->per_block;
+
+        if ((res = progskeet_enqueue_tx_ref(handle, pattern->buf, chunk * pattern->unit)) < 0)
+            return res;
+
+        if ((res = progskeet_enqueue_rx_buf(handle, samples + done, chunk * sizeof(uint16_t))) < 0)
+            return res;
+
+        if (cb && (res = progskeet_rx_notify(handle, cb, user_data)) < 0)
+            return res;
+    }
+
+    return 0;
+}
+
+uint64_t progskeet_gpio_sample_period_ps(const uint32_t interval_ns)
+{
+    return progskeet_gpio_time_ps(progskeet_gpio_nops(interval_ns) + GPIO_SAMPLE_SLOT_NOPS, 1);
+}
+
+int progskeet_gpio_sample(struct progskeet_handle* handle, uint16_t* samples, const size_t count, const uint32_t interval_ns)
+{
+    struct progskeet_gpio_pattern pattern;
+    size_t done, chunk;
+    int res;
+
+    if (!handle || !samples)
+        return -1;
+
+    if ((res = progskeet_gpio_pattern_create(&pattern, interval_ns)) < 0)
+        return res;
+
+    /* Commands queued before go out first, the samples start on an empty stream */
+    if ((res = progskeet_sync(handle)) < 0)
+        goto out;
+
+    for (done = 0; done < count && (res = progskeet_check_cancel(handle)) == 0; done += chunk) {
+        chunk = count - done < GPIO_SAMPLES_PER_SYNC ? count - done : GPIO_SAMPLES_PER_SYNC;
+
+        if ((res = progskeet_gpio_queue(handle, &pattern, samples + done, chunk, NULL, NULL)) < 0 ||
+            (res = progskeet_sync(handle)) < 0)
+            break;
+    }
+
+out:
+    free(pattern.buf);
+
+    return res;
+}
+
+static void progskeet_gpio_vcd_header(struct progskeet_gpio_vcd* vcd)
+{
+    int bit;
+
+    fprintf(vcd->fp, "$version libprogskeet %s $end\n", PROGSKEET_VERSION);
+    fprintf(vcd->fp, "$timescale 1 ps $end\n");
+    fprintf(vcd->fp, "$scope module progskeet $end\n");
+
+    for (bit = 0; bit < 16; bit++) {
+        if (vcd->mask & (1 << bit))
+            fprintf(vcd->fp, "$var wire 1 %c gpio%d $end\n", '!' + bit, bit);
+    }
+
+    fprintf(vcd->fp, "$upscope $end\n");
+    fprintf(vcd->fp, "$enddefinitions $end\n");
+}
+
+static void progskeet_gpio_vcd_values(struct progskeet_gpio_vcd* vcd, const uint16_t value, const uint16_t changed)
+{
+    int bit;
+
+    for (bit = 0; bit < 16; bit++) {
+        if (changed & (1 << bit))
+            fprintf(vcd->fp, "%c%c\n", (value & (1 << bit)) ? '1' : '0', '!' + bit);
+    }
+}
+
+/* Writes the samples of the block that just arrived, only the wires that changed */
+static void progskeet_gpio_vcd_block(struct progskeet_handle* handle, void* user_data)
+{
+    struct progskeet_gpio_vcd* vcd = (struct progskeet_gpio_vcd*)user_data;
+    uint16_t changed;
+    uint16_t value;
+    size_t end;
+
+    (void)handle;
+
+    end = vcd->count - vcd->written < vcd->per_block ? vcd->count : vcd->written + vcd->per_block;
+
+    for (; vcd->written < end; vcd->written++) {
+        value = vcd->samples[vcd->written];
+
+        if (!vcd->started) {
+            fprintf(vcd->fp, "#%llu\n$dumpvars\n", (unsigned long long)vcd->start_ps);
+            progskeet_gpio_vcd_values(vcd, value, vcd->mask);
+            fprintf(vcd->fp, "$end\n");
+
+            vcd->started = 1;
+        } else if ((changed = (value ^ vcd->last) & vcd->mask) != 0) {
+            fprintf(vcd->fp, "#%llu\n", (unsigned long long)(vcd->start_ps + progskeet_gpio_time_ps(vcd->slots, vcd->written)));
+            progskeet_gpio_vcd_values(vcd, value, changed);
+        }
+
+        vcd->last = value;
+    }
+
+    vcd->end_ps = vcd->start_ps + progskeet_gpio_time_ps(vcd->slots, vcd->written);
+}
+
+int progskeet_gpio_capture_vcd(struct progskeet_handle* handle, const char* path, const uint16_t mask,
+                               const uint32_t interval_ns, const uint64_t count)
+{
+    struct progskeet_gpio_pattern pattern;
+    struct progskeet_gpio_vcd vcd;
+    uint64_t first_us, host_ps;
+    uint16_t* samples;
+    uint64_t done;
+    size_t chunk;
+    int res;
+
+    if (!handle || !path || !mask)
+        return -1;
+
+    memset(&vcd, 0, sizeof(vcd));
+    vcd.mask = mask;
+
+    if ((vcd.fp = fopen(path, "w")) == NULL) {
+        progskeet_log(handle, progskeet_log_level_error, "Failed to open %s\n", path);
+        return -2;
+    }
+
+    samples = (uint16_t*)malloc(GPIO_SAMPLES_PER_SYNC * sizeof(uint16_t));
+
+    if (!samples || (res = progskeet_gpio_pattern_create(&pattern, interval_ns)) < 0) {
+        free(samples);
+        fclose(vcd.fp);
+        return samples ? res : -3;
+    }
+
+    vcd.slots = pattern.slots;
+    vcd.per_block = pattern.per_block;
+    vcd.samples = samples;
+
+    progskeet_gpio_vcd_header(&vcd);
+
+    res = progskeet_sync(handle);
+
+    first_us = progskeet_time_us();
+
+    for (done = 0; res == 0 && done < count && (res = progskeet_check_cancel(handle)) == 0; done += chunk) {
+        chunk = count - done < GPIO_SAMPLES_PER_SYNC ? (size_t)(count - done) : GPIO_SAMPLES_PER_SYNC;
+
+        /* Syncs follow each other with a gap only the host clock knows about */
+        host_ps = (progskeet_time_us() - first_us) * 1000000;
+        vcd.start_ps = done == 0 ? 0 : (host_ps > vcd.end_ps ? host_ps : vcd.end_ps);
+        vcd.count = chunk;
+        vcd.written = 0;
+
+        if ((res = progskeet_gpio_queue(handle, &pattern, samples, chunk, progskeet_gpio_vcd_block, &vcd)) < 0 ||
+            (res = progskeet_sync(handle)) < 0)
+            break;
+    }
+
+    /* Lets the viewer show the time after the last change */
+    if (vcd.started)
+        fprintf(vcd.fp, "#%llu\n", (unsigned long long)vcd.end_ps);
+
+    if (ferror(vcd.fp) && res == 0) {
+        progskeet_log(handle, progskeet_log_level_error, "Failed to write %s\n", path);
+        res = -4;
+    }
+
+    fclose(vcd.fp);
+    free(pattern.buf);
+    free(samples);
+
+    return res;
+}
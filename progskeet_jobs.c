@@ -0,0 +1,516 @@
+/*
+ * libprogskeet - ProgSkeet library
+ * Copyright (C) 2012 Axel Gembe <axel@gembe.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * ProgSkeet job graph functions
+ *
+ * Every job depends on its explicit predecessor and on every earlier job
+ * in the list that touches the same words, unless both only read. Ready
+ * jobs are picked closest to where the last one ended, and are queued
+ * into the same command stream as long as nothing needs a result from
+ * the host: the device runs them in order, so a program after an erase
+ * or a dump after a program needs no sync in between. Only a verify has
+ * to be compared before the jobs after it may start.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "progskeet.h"
+#include "progskeet_private.h"
+
+/* Bytes a verify reads back before they are compared */
+#define JOBS_VERIFY_SLICE           (1024 * 1024)
+
+#define JOBS_CMD_OVERHEAD           128
+
+#define JOBS_MS_TO_US(ms) ((ms) >= 0xFFFFFFFF / 1000 ? 0xFFFFFFFF : (ms) * 1000)
+
+enum progskeet_jobs_state {
+    progskeet_jobs_pending = 0,
+    progskeet_jobs_queued,
+    progskeet_jobs_done,
+    progskeet_jobs_failed,
+};
+
+struct progskeet_jobs_job
+{
+    struct progskeet_job* job;
+    enum progskeet_jobs_state state;
+
+    /* Bus words touched, erases are widened to whole blocks */
+    uint32_t start;
+    uint32_t end;
+
+    uint64_t start_us;
+
+    /* Verify: bytes compared and bytes read back but not compared yet */
+    char* verify_buf;
+    size_t verify_done;
+    size_t verify_len;
+};
+
+struct progskeet_jobs
+{
+    struct progskeet_handle* handle;
+    const struct progskeet_nor_info* nor;
+    struct progskeet_jobs_job* jobs;
+    int count;
+
+    /* deps[i * count + j] is set if job i waits for job j */
+    uint8_t* deps;
+
+    uint32_t last_end;
+};
+
+static int progskeet_jobs_writes(const struct progskeet_job* job)
+{
+    return job->op == progskeet_job_erase || job->op == progskeet_job_program;
+}
+
+static int progskeet_jobs_range(struct progskeet_jobs* jobs, struct progskeet_jobs_job* j)
+{
+    const struct progskeet_nor_info* nor = jobs->nor;
+    uint32_t words, start, len;
+
+    words = (uint32_t)((j->job->len + nor->bus_width - 1) / nor->bus_width);
+
+    j->start = j->job->addr;
+    j->end = j->job->addr + words;
+
+    if (j->job->op != progskeet_job_erase || words == 0)
+        return 0;
+
+    if (progskeet_nor_block_at(nor, j->start, &start, NULL) < 0)
+        return PROGSKEET_ERR_NOT_FOUND;
+
+    if (progskeet_nor_block_at(nor, j->end - 1, &j->end, &len) < 0)
+        return PROGSKEET_ERR_NOT_FOUND;
+
+    j->start = start;
+    j->end += len;
+
+    return 0;
+}
+
+static void progskeet_jobs_finish(struct progskeet_jobs* jobs, struct progskeet_jobs_job* j, const int res)
+{
+    (void)jobs;
+
+    j->job->result = res;
+    j->job->elapsed_us = (uint32_t)(progskeet_time_us() - j->start_us);
+    j->state = res < 0 ? progskeet_jobs_failed : progskeet_jobs_done;
+
+    free(j->verify_buf);
+    j->verify_buf = NULL;
+}
+
+/* Compares what a verify read back since the last sync */
+static int progskeet_jobs_verify_check(struct progskeet_jobs* jobs, struct progskeet_jobs_job* j)
+{
+    if (j->verify_len == 0)
+        return 0;
+
+    if (memcmp(j->verify_buf, j->job->buf + j->verify_done, j->verify_len) != 0) {
+        progskeet_log(jobs->handle, progskeet_log_level_error, "Verify failed for job %d\n", (int)(j - jobs->jobs));
+        return PROGSKEET_ERR_VERIFY;
+    }
+
+    j->verify_done += j->verify_len;
+    j->verify_len = 0;
+
+    return 0;
+}
+
+/* A failed sync stops the whole run, never just one job */
+static int progskeet_jobs_sync(struct progskeet_jobs* jobs)
+{
+    int res;
+
+    if ((res = progskeet_sync(jobs->handle)) < 0)
+        return res == PROGSKEET_ERR_CANCELLED || res == PROGSKEET_ERR_DEADLINE ? res : PROGSKEET_ERR_IO;
+
+    return 0;
+}
+
+/* Syncs and completes every queued job but the running one */
+static int progskeet_jobs_flush(struct progskeet_jobs* jobs, struct progskeet_jobs_job* running)
+{
+    struct progskeet_jobs_job* j;
+    int res;
+    int i;
+
+    if (jobs->handle->txlen > 0 && (res = progskeet_jobs_sync(jobs)) < 0)
+        return res;
+
+    for (i = 0; i < jobs->count; i++) {
+        j = &jobs->jobs[i];
+
+        if (j->state != progskeet_jobs_queued)
+            continue;
+
+        res = progskeet_jobs_verify_check(jobs, j);
+
+        if (j != running || res < 0)
+            progskeet_jobs_finish(jobs, j, res);
+    }
+
+    return 0;
+}
+
+static int progskeet_jobs_sync_if_full(struct progskeet_jobs* jobs, const size_t needed)
+{
+    if (progskeet_tx_free(jobs->handle) >= needed)
+        return 0;
+
+    return progskeet_jobs_sync(jobs);
+}
+
+static int progskeet_jobs_erase(struct progskeet_jobs* jobs, struct progskeet_jobs_job* j)
+{
+    const struct progskeet_nor_info* nor = jobs->nor;
+    uint32_t cur, start, len;
+    int res;
+
+    for (cur = j->start; cur < j->end; cur = start + len) {
+        if (progskeet_nor_block_at(nor, cur, &start, &len) < 0)
+            return PROGSKEET_ERR_NOT_FOUND;
+
+        if ((res = progskeet_jobs_sync_if_full(jobs, JOBS_CMD_OVERHEAD)) < 0)
+            return res;
+
+        if ((res = progskeet_nor_erase_block_start(jobs->handle, nor, start)) < 0)
+            return res;
+
+        if ((res = progskeet_nor_wait_ready(jobs->handle, nor, start, JOBS_MS_TO_US(nor->block_erase_ms))) < 0)
+            return res;
+
+        if ((res = progskeet_nor_read_array(jobs->handle, nor, start)) < 0)
+            return res;
+    }
+
+    return 0;
+}
+
+static int progskeet_jobs_program(struct progskeet_jobs* jobs, struct progskeet_jobs_job* j)
+{
+    const struct progskeet_nor_info* nor = jobs->nor;
+    const int width = nor->bus_width;
+    const char* buf = j->job->buf;
+    uint32_t buffer_words, cur;
+    size_t words, chunk, done;
+    int res;
+
+    words = j->job->len / width;
+    buffer_words = nor->write_buffer ? nor->write_buffer / width : 1;
+
+    for (done = 0; done < words; done += chunk) {
+        cur = j->start + (uint32_t)done;
+
+        chunk = buffer_words - (cur % buffer_words);
+        if (chunk > words - done)
+            chunk = words - done;
+
+        if (progskeet_nor_is_erased(buf + done * width, chunk * width))
+            continue;
+
+        if ((res = progskeet_jobs_sync_if_full(jobs, chunk * width + JOBS_CMD_OVERHEAD)) < 0)
+            return res;
+
+        if ((res = progskeet_nor_program_start(jobs->handle, nor, cur, buf + done * width, chunk)) < 0)
+            return res;
+
+        if ((res = progskeet_nor_wait_ready(jobs->handle, nor, cur, nor->write_buffer ? nor->buffer_program_us : nor->word_program_us)) < 0)
+            return res;
+    }
+
+    return progskeet_nor_read_array(jobs->handle, nor, j->start);
+}
+
+static int progskeet_jobs_read(struct progskeet_jobs* jobs, struct progskeet_jobs_job* j)
+{
+    const int width = jobs->nor->bus_width;
+    size_t len, done, chunk;
+    char* dst;
+    int res;
+
+    len = j->job->len - (j->job->len % width);
+
+    if (j->job->op == progskeet_job_verify && len > 0 &&
+        (j->verify_buf = (char*)malloc(len < JOBS_VERIFY_SLICE ? len : JOBS_VERIFY_SLICE)) == NULL)
+        return PROGSKEET_ERR_ALLOC;
+
+    for (done = 0; done < len; done += chunk) {
+        chunk = len - done;
+
+        if (j->job->op == progskeet_job_verify) {
+            if (chunk > JOBS_VERIFY_SLICE)
+                chunk = JOBS_VERIFY_SLICE;
+
+            /* The slice buffer is reused, compare what is in it first */
+            if (j->verify_len > 0 && (res = progskeet_jobs_flush(jobs, j)) < 0)
+                return res;
+
+            if (j->state != progskeet_jobs_queued)
+                return j->job->result;
+
+            dst = j->verify_buf;
+            j->verify_len = chunk;
+        } else {
+            dst = j->job->buf + done;
+        }
+
+        if ((res = progskeet_jobs_sync_if_full(jobs, JOBS_CMD_OVERHEAD)) < 0)
+            return res;
+
+        if ((res = progskeet_set_addr(jobs->handle, j->start + (uint32_t)(done / width), 1)) < 0)
+            return res;
+
+        if ((res = progskeet_read_uncached(jobs->handle, dst, chunk)) < 0)
+            return res;
+    }
+
+    return 0;
+}
+
+/* Fails every job waiting for a failed one, returns how many were failed */
+static int progskeet_jobs_skip_failed(struct progskeet_jobs* jobs)
+{
+    struct progskeet_jobs_job* j;
+    int skipped = 0;
+    int i, k;
+
+    for (i = 0; i < jobs->count; i++) {
+        j = &jobs->jobs[i];
+
+        if (j->state != progskeet_jobs_pending)
+            continue;
+
+        for (k = 0; k < jobs->count; k++) {
+            if (jobs->deps[i * jobs->count + k] && jobs->jobs[k].state == progskeet_jobs_failed) {
+                j->start_us = progskeet_time_us();
+                progskeet_jobs_finish(jobs, j, jobs->jobs[k].job->result);
+                skipped++;
+                break;
+            }
+        }
+    }
+
+    return skipped;
+}
+
+/* Picks the ready job starting closest to where the last one ended, -1 if none is ready */
+static int progskeet_jobs_pick(struct progskeet_jobs* jobs)
+{
+    struct progskeet_jobs_job* j;
+    struct progskeet_jobs_job* dep;
+    uint32_t dist, best_dist = 0;
+    int best = -1;
+    int ready;
+    int i, k;
+
+    while (progskeet_jobs_skip_failed(jobs) > 0)
+        ;
+
+    for (i = 0; i < jobs->count; i++) {
+        j = &jobs->jobs[i];
+
+        if (j->state != progskeet_jobs_pending)
+            continue;
+
+        ready = 1;
+
+        for (k = 0; k < jobs->count && ready; k++) {
+            if (!jobs->deps[i * jobs->count + k])
+                continue;
+
+            dep = &jobs->jobs[k];
+
+            /* Queued jobs are fine unless their result has to be known first */
+            if (dep->state == progskeet_jobs_pending)
+                ready = 0;
+            else if (dep->state == progskeet_jobs_queued && dep->job->op == progskeet_job_verify)
+                ready = 0;
+        }
+
+        if (!ready)
+            continue;
+
+        dist = j->start >= jobs->last_end ? j->start - jobs->last_end : jobs->last_end - j->start;
+
+        if (best < 0 || dist < best_dist) {
+            best = i;
+            best_dist = dist;
+        }
+    }
+
+    return best;
+}
+
+static int progskeet_jobs_graph(struct progskeet_jobs* jobs)
+{
+    struct progskeet_jobs_job* a;
+    struct progskeet_jobs_job* b;
+    int i, k;
+
+    for (i = 0; i < jobs->count; i++) {
+        a = &jobs->jobs[i];
+
+        if (a->job->after >= jobs->count || a->job->after == i)
+            return PROGSKEET_ERR_ARGS;
+
+        if (a->job->after >= 0)
+            jobs->deps[i * jobs->count + a->job->after] = 1;
+
+        for (k = 0; k < i; k++) {
+            b = &jobs->jobs[k];
+
+            if (!progskeet_jobs_writes(a->job) && !progskeet_jobs_writes(b->job))
+                continue;
+
+            if (a->start < b->end && b->start < a->end)
+                jobs->deps[i * jobs->count + k] = 1;
+        }
+    }
+
+    return 0;
+}
+
+int progskeet_nor_run_jobs(struct progskeet_handle* handle, const struct progskeet_nor_info* nor,
+                           struct progskeet_job* jobs, const int count)
+{
+    struct progskeet_jobs sched;
+    struct progskeet_jobs_job* j;
+    int pending, queued;
+    int res = 0;
+    int i;
+
+    if (!handle || !nor || !jobs || count < 1 || nor->bus_width < 1 || nor->bus_width > 2)
+        return PROGSKEET_ERR_ARGS;
+
+    for (i = 0; i < count; i++) {
+        if (jobs[i].op != progskeet_job_erase && !jobs[i].buf)
+            return PROGSKEET_ERR_ARGS;
+    }
+
+    memset(&sched, 0, sizeof(sched));
+
+    sched.jobs = (struct progskeet_jobs_job*)calloc(count, sizeof(struct progskeet_jobs_job));
+    sched.deps = (uint8_t*)calloc((size_t)count * count, 1);
+
+    if (!sched.jobs || !sched.deps) {
+        res = PROGSKEET_ERR_ALLOC;
+        goto out;
+    }
+
+    sched.handle = handle;
+    sched.nor = nor;
+    sched.count = count;
+    sched.last_end = handle->cur_addr;
+
+    for (i = 0; i < count; i++) {
+        jobs[i].result = 0;
+        jobs[i].elapsed_us = 0;
+
+        sched.jobs[i].job = &jobs[i];
+
+        if (progskeet_jobs_range(&sched, &sched.jobs[i]) < 0) {
+            progskeet_jobs_finish(&sched, &sched.jobs[i], PROGSKEET_ERR_NOT_FOUND);
+            continue;
+        }
+    }
+
+    if ((res = progskeet_jobs_graph(&sched)) < 0)
+        goto out;
+
+    while ((res = progskeet_check_cancel(handle)) == 0) {
+        if ((i = progskeet_jobs_pick(&sched)) < 0) {
+            pending = queued = 0;
+            for (i = 0; i < count; i++) {
+                pending |= sched.jobs[i].state == progskeet_jobs_pending;
+                queued |= sched.jobs[i].state == progskeet_jobs_queued;
+            }
+
+            if (!pending)
+                break;
+
+            if (queued) {
+                if ((res = progskeet_jobs_flush(&sched, NULL)) < 0)
+                    break;
+
+                continue;
+            }
+
+            /* Nothing is queued that could unblock the rest */
+            for (i = 0; i < count; i++) {
+                if (sched.jobs[i].state == progskeet_jobs_pending)
+                    progskeet_jobs_finish(&sched, &sched.jobs[i], PROGSKEET_ERR_ARGS);
+            }
+
+            progskeet_log(handle, progskeet_log_level_error, "Job dependencies form a cycle\n");
+            break;
+        }
+
+        j = &sched.jobs[i];
+        j->state = progskeet_jobs_queued;
+        j->start_us = progskeet_time_us();
+
+        switch (j->job->op) {
+        case progskeet_job_erase:
+            res = progskeet_jobs_erase(&sched, j);
+            break;
+        case progskeet_job_program:
+            res = progskeet_jobs_program(&sched, j);
+            break;
+        case progskeet_job_verify:
+        case progskeet_job_dump:
+            res = progskeet_jobs_read(&sched, j);
+            break;
+        default:
+            res = PROGSKEET_ERR_ARGS;
+            break;
+        }
+
+        if (res < 0 && j->state == progskeet_jobs_queued)
+            progskeet_jobs_finish(&sched, j, res);
+
+        /* Anything but a failure of this job alone stops the run */
+        if (res < 0 && res != PROGSKEET_ERR_ARGS && res != PROGSKEET_ERR_NOT_FOUND && res != PROGSKEET_ERR_VERIFY)
+            break;
+
+        res = 0;
+        sched.last_end = j->end;
+    }
+
+    if (res == 0)
+        res = progskeet_jobs_flush(&sched, NULL);
+
+    for (i = 0; i < count; i++) {
+        if (sched.jobs[i].state == progskeet_jobs_pending || sched.jobs[i].state == progskeet_jobs_queued)
+            progskeet_jobs_finish(&sched, &sched.jobs[i], res < 0 ? res : PROGSKEET_ERR_IO);
+
+        if (res == 0 && jobs[i].result < 0)
+            res = jobs[i].result;
+    }
+
+out:
+    free(sched.deps);
+    free(sched.jobs);
+
+    return res;
+}
@@ -20,62 +20,176 @@
  * ProgSkeet lowlevel functions
  */
 
+#include <stdlib.h>
+#include <string.h>
+
 #include "progskeet.h"
 #include "progskeet_private.h"
 
-/* Command codes */
-#define PROGSKEET_CMD_GET_GPIO      0x01
-#define PROGSKEET_CMD_SET_ADDR      0x02
-#define PROGSKEET_CMD_WRITE_CYCLE   0x03
-#define PROGSKEET_CMD_READ_CYCLE    0x04
-#define PROGSKEET_CMD_SET_CONFIG    0x05
-#define PROGSKEET_CMD_SET_GPIO      0x06
-#define PROGSKEET_CMD_SET_GPIO_DIR  0x07
-#define PROGSKEET_CMD_WAIT_GPIO     0x08
-#define PROGSKEET_CMD_NOP           0x09
-
 #define PROGSKEET_CFG_DELAY_MASK    0x0F
 
-#define PROGSKEET_ADDR_AUTO_INC (1 << 23)
+/* Sends the address again if the device counter is behind the handle */
+static int progskeet_addr_restore(struct progskeet_handle* handle)
+{
+    if (!handle->addr_stale)
+        return 0;
+
+    return progskeet_set_addr(handle, handle->cur_addr, handle->cur_addr_inc);
+}
+
+static uint32_t progskeet_addr_map(struct progskeet_handle* handle, const uint32_t addr)
+{
+    return (addr & handle->addr_mask) | handle->addr_add;
+}
+
+/* Words the device counter can auto increment before it runs into the next bank */
+static size_t progskeet_bank_span(struct progskeet_handle* handle)
+{
+    uint32_t bank_size;
+
+    if (handle->bank_bits == 0 || !handle->cur_addr_inc)
+        return (size_t)-1;
+
+    bank_size = (uint32_t)1 << handle->bank_native_bits;
+
+    return bank_size - (progskeet_addr_map(handle, handle->cur_addr) & (bank_size - 1));
+}
+
+static void progskeet_addr_advance(struct progskeet_handle* handle, const size_t words)
+{
+    if (!handle->cur_addr_inc)
+        return;
+
+    /* The counter does not carry into the bank lines, resend the address */
+    if (words >= progskeet_bank_span(handle))
+        handle->addr_stale = 1;
+
+    handle->cur_addr += (uint32_t)words;
+}
+
+static uint16_t progskeet_bank_mask(struct progskeet_handle* handle)
+{
+    uint16_t mask = 0;
+    uint8_t i;
+
+    for (i = 0; i < handle->bank_bits; i++)
+        mask |= handle->bank_gpio[i];
+
+    return mask;
+}
+
+static int progskeet_set_gpio_raw(struct progskeet_handle* handle, const uint16_t gpio)
+{
+    char cmdbuf[3];
+    int res;
+
+    cmdbuf[0] = PROGSKEET_CMD_SET_GPIO;
+    cmdbuf[1] = (gpio >> 0) & 0xFF;
+    cmdbuf[2] = (gpio >> 8) & 0xFF;
+
+    if ((res = progskeet_enqueue_tx_buf(handle, cmdbuf, sizeof(cmdbuf))) < 0)
+        return res;
+
+    handle->cur_gpio = gpio;
+
+    return 0;
+}
+
+static int progskeet_bank_select(struct progskeet_handle* handle, const uint32_t bank)
+{
+    uint16_t value = 0;
+    uint8_t i;
+    int res;
+
+    if (bank >> handle->bank_bits) {
+        progskeet_log(handle, progskeet_log_level_error, "Address is beyond the last bank\n");
+        return -2;
+    }
+
+    if (handle->cur_bank_valid && handle->cur_bank == bank)
+        return 0;
+
+    for (i = 0; i < handle->bank_bits; i++) {
+        if (bank & (1 << i))
+            value |= handle->bank_gpio[i];
+    }
+
+    if ((res = progskeet_set_gpio_raw(handle, (handle->cur_gpio & ~progskeet_bank_mask(handle)) | value)) < 0)
+        return res;
+
+    handle->cur_bank = bank;
+    handle->cur_bank_valid = 1;
+
+    return 0;
+}
+
+static void progskeet_cache_written(struct progskeet_handle* handle, const size_t words)
+{
+    if (handle->cache && words > 0)
+        progskeet_cache_invalidate(handle, handle->cur_addr, handle->cur_addr_inc ? words : 1);
+}
 
 int progskeet_set_gpio_dir(struct progskeet_handle* handle, const uint16_t dir)
 {
     char cmdbuf[3];
+    uint16_t mdir;
     int res;
 
     if (!handle)
         return -1;
 
+    /* Bank lines always stay outputs */
+    mdir = dir | progskeet_bank_mask(handle);
+
     cmdbuf[0] = PROGSKEET_CMD_SET_GPIO_DIR;
-    cmdbuf[1] = (dir >> 0) & 0xFF;
-    cmdbuf[2] = (dir >> 8) & 0xFF;
+    cmdbuf[1] = (mdir >> 0) & 0xFF;
+    cmdbuf[2] = (mdir >> 8) & 0xFF;
 
     if ((res = progskeet_enqueue_tx_buf(handle, cmdbuf, sizeof(cmdbuf))) < 0)
         return res;
 
-    handle->cur_gpio_dir = dir;
+    handle->cur_gpio_dir = mdir;
 
     return 0;
 }
 
 int progskeet_set_gpio(struct progskeet_handle* handle, const uint16_t gpio)
 {
-    char cmdbuf[3];
-    int res;
+    uint16_t bank_mask;
 
     if (!handle)
         return -1;
 
-    cmdbuf[0] = PROGSKEET_CMD_SET_GPIO;
-    cmdbuf[1] = (gpio >> 0) & 0xFF;
-    cmdbuf[2] = (gpio >> 8) & 0xFF;
+    /* Bank lines belong to the address translation, keep their state */
+    bank_mask = progskeet_bank_mask(handle);
 
-    if ((res = progskeet_enqueue_tx_buf(handle, cmdbuf, sizeof(cmdbuf))) < 0)
-        return res;
+    return progskeet_set_gpio_raw(handle, (gpio & ~bank_mask) | (handle->cur_gpio & bank_mask));
+}
 
-    handle->cur_gpio = gpio;
+int progskeet_set_bank_lines(struct progskeet_handle* handle, const uint8_t native_bits, const uint16_t* gpios, const uint8_t count)
+{
+    uint8_t i;
 
-    return 0;
+    if (!handle || (count > 0 && !gpios) || count > PROGSKEET_MAX_BANK_BITS ||
+        native_bits < 1 || native_bits > PROGSKEET_ADDR_BITS || native_bits + count > 32)
+        return -1;
+
+    handle->bank_bits = 0;
+
+    for (i = 0; i < count; i++)
+        handle->bank_gpio[i] = gpios[i];
+
+    handle->bank_native_bits = native_bits;
+    handle->bank_bits = count;
+    handle->cur_bank_valid = 0;
+
+    /* The next cycle has to select its bank first */
+    handle->addr_stale = 1;
+
+    if (count == 0)
+        return 0;
+
+    return progskeet_set_gpio_dir(handle, handle->cur_gpio_dir);
 }
 
 int progskeet_get_gpio(struct progskeet_handle* handle, uint16_t* gpio)
@@ -132,7 +246,16 @@ int progskeet_set_addr(struct progskeet_handle* handle, const uint32_t addr, int
     if (!handle)
         return -1;
 
-    maddr = (addr & handle->addr_mask) | handle->addr_add;
+    maddr = progskeet_addr_map(handle, addr);
+
+    /* The bits above the native ones go out on the bank lines */
+    if (handle->bank_bits > 0) {
+        if ((res = progskeet_bank_select(handle, maddr >> handle->bank_native_bits)) < 0)
+            return res;
+
+        maddr &= ((uint32_t)1 << handle->bank_native_bits) - 1;
+    }
+
     maddr |= auto_incr ? PROGSKEET_ADDR_AUTO_INC : 0;
 
     cmdbuf[0] = PROGSKEET_CMD_SET_ADDR;
@@ -143,6 +266,10 @@ int progskeet_set_addr(struct progskeet_handle* handle, const uint32_t addr, int
     if ((res = progskeet_enqueue_tx_buf(handle, cmdbuf, sizeof(cmdbuf))) < 0)
         return res;
 
+    handle->cur_addr = addr;
+    handle->cur_addr_inc = auto_incr ? 1 : 0;
+    handle->addr_stale = 0;
+
     return 0;
 }
 
@@ -150,19 +277,29 @@ int progskeet_set_data(struct progskeet_handle* handle, const uint16_t data)
 {
     char cmdbuf[5];
     size_t idx = 0;
+    int res;
 
     if (!handle)
         return -1;
 
+    if ((res = progskeet_addr_restore(handle)) < 0)
+        return res;
+
     cmdbuf[idx++] = PROGSKEET_CMD_WRITE_CYCLE;
     cmdbuf[idx++] = 0x01;
     cmdbuf[idx++] = 0x00;
     cmdbuf[idx++] = (data >> 0) & 0xFF;
 
-    if ((handle->cur_config & PROGSKEET_CFG_16BIT) == 0)
+    if ((handle->cur_config & PROGSKEET_CFG_16BIT) > 0)
         cmdbuf[idx++] = (data >> 8) & 0xFF;
 
-    return progskeet_enqueue_tx_buf(handle, cmdbuf, idx);
+    if ((res = progskeet_enqueue_tx_buf(handle, cmdbuf, idx)) < 0)
+        return res;
+
+    progskeet_cache_written(handle, 1);
+    progskeet_addr_advance(handle, 1);
+
+    return 0;
 }
 
 uint8_t progskeet_config_from_struct(struct progskeet_config* config)
@@ -182,9 +319,10 @@ int progskeet_config_set(struct progskeet_handle* handle, struct progskeet_confi
 {
     uint8_t cbyte;
 
-    if (!handle || !config)
+    if (!handle)
       return -1;
 
+    /* No config means the handle's default */
     if (config)
         cbyte = progskeet_config_from_struct(config);
     else
@@ -219,12 +357,65 @@ int progskeet_config_set_byte(struct progskeet_handle* handle, uint8_t config)
     if ((res = progskeet_enqueue_tx_buf(handle, cmdbuf, sizeof(cmdbuf))) < 0)
         return res;
 
+    /* Cached lines are stored per bus width */
+    if (handle->cache && ((handle->cur_config ^ config) & PROGSKEET_CFG_16BIT))
+        progskeet_cache_invalidate_all(handle);
+
     handle->cur_config = config;
 
     return 0;
 }
 
+static int progskeet_write_cycles(struct progskeet_handle* handle, const char* buf, const size_t len, const int ref);
+
+static int progskeet_read_cycles(struct progskeet_handle* handle, char* buf, const size_t len);
+
+/* Bytes of a transfer that fit before the next bank boundary */
+static size_t progskeet_bank_chunk(struct progskeet_handle* handle, const size_t len)
+{
+    size_t span;
+
+    span = progskeet_bank_span(handle);
+    if ((handle->cur_config & PROGSKEET_CFG_16BIT) > 0) {
+        if (span > len / 2)
+            return len;
+
+        return span * 2;
+    }
+
+    return span > len ? len : span;
+}
+
+static int progskeet_write_int(struct progskeet_handle* handle, const char* buf, const size_t len, const int ref)
+{
+    size_t chunk;
+    size_t done;
+    int res;
+
+    if (!handle || !buf)
+        return -1;
+
+    for (done = 0; done < len; done += chunk) {
+        chunk = progskeet_bank_chunk(handle, len - done);
+
+        if ((res = progskeet_write_cycles(handle, buf + done, chunk, ref)) < 0)
+            return res;
+    }
+
+    return 0;
+}
+
 int progskeet_write(struct progskeet_handle* handle, const char* buf, const size_t len)
+{
+    return progskeet_write_int(handle, buf, len, 0);
+}
+
+int progskeet_write_ref(struct progskeet_handle* handle, const char* buf, const size_t len)
+{
+    return progskeet_write_int(handle, buf, len, 1);
+}
+
+static int progskeet_write_cycles(struct progskeet_handle* handle, const char* buf, const size_t len, const int ref)
 {
     char cmdbuf[3];
     size_t remaining;
@@ -234,6 +425,9 @@ int progskeet_write(struct progskeet_handle* handle, const char* buf, const size
     if (!handle || !buf)
         return -1;
 
+    if (progskeet_addr_restore(handle) < 0)
+        return -2;
+
     len_words = len;
     blocksize = 0xFFFF;
     if ((handle->cur_config & PROGSKEET_CFG_16BIT) > 0) {
@@ -241,6 +435,8 @@ int progskeet_write(struct progskeet_handle* handle, const char* buf, const size
         blocksize *= 2;
     }
 
+    progskeet_cache_written(handle, len_words);
+
     remaining = len_words;
 
     cmdbuf[0] = PROGSKEET_CMD_WRITE_CYCLE;
@@ -251,7 +447,7 @@ int progskeet_write(struct progskeet_handle* handle, const char* buf, const size
         if (progskeet_enqueue_tx_buf(handle, cmdbuf, sizeof(cmdbuf)) < 0)
             return -2;
 
-        if (progskeet_enqueue_tx_buf(handle, buf, blocksize) < 0)
+        if ((ref ? progskeet_enqueue_tx_ref(handle, buf, blocksize) : progskeet_enqueue_tx_buf(handle, buf, blocksize)) < 0)
             return -3;
 
         buf += blocksize;
@@ -268,20 +464,58 @@ int progskeet_write(struct progskeet_handle* handle, const char* buf, const size
         if ((handle->cur_config & PROGSKEET_CFG_16BIT) > 0)
             remaining *= 2;
 
-        if (progskeet_enqueue_tx_buf(handle, buf, remaining) < 0)
+        if ((ref ? progskeet_enqueue_tx_ref(handle, buf, remaining) : progskeet_enqueue_tx_buf(handle, buf, remaining)) < 0)
             return -5;
     }
 
+    progskeet_addr_advance(handle, len_words);
+
     return 0;
 }
 
 int progskeet_read(struct progskeet_handle* handle, char* buf, const size_t len)
+{
+    int res;
+
+    if (!handle || !buf)
+        return -1;
+
+    /* A failed fetch is an error, only reads the cache can't take go to the device */
+    if (handle->cache && (res = progskeet_cache_read(handle, buf, len)) != 1)
+        return res;
+
+    return progskeet_read_uncached(handle, buf, len);
+}
+
+int progskeet_read_uncached(struct progskeet_handle* handle, char* buf, const size_t len)
+{
+    size_t chunk;
+    size_t done;
+    int res;
+
+    if (!handle || !buf)
+        return -1;
+
+    for (done = 0; done < len; done += chunk) {
+        chunk = progskeet_bank_chunk(handle, len - done);
+
+        if ((res = progskeet_read_cycles(handle, buf + done, chunk)) < 0)
+            return res;
+    }
+
+    return 0;
+}
+
+static int progskeet_read_cycles(struct progskeet_handle* handle, char* buf, const size_t len)
 {
     char cmdbuf[3];
     size_t remaining;
     size_t len_words;
     int res;
 
+    if ((res = progskeet_addr_restore(handle)) < 0)
+        return res;
+
     len_words = len;
     if ((handle->cur_config & PROGSKEET_CFG_16BIT) > 0)
         len_words /= 2;
@@ -309,6 +543,8 @@ int progskeet_read(struct progskeet_handle* handle, char* buf, const size_t len)
 
     progskeet_enqueue_rx_buf(handle, buf, len);
 
+    progskeet_addr_advance(handle, len_words);
+
     return 0;
 }
 
@@ -329,6 +565,15 @@ int progskeet_read_addr(struct progskeet_handle* handle, uint32_t addr, uint16_t
 {
     int res;
 
+    /* The address only has to go out if the cache misses */
+    if (handle->cache) {
+        handle->cur_addr = addr;
+        handle->cur_addr_inc = 0;
+        handle->addr_stale = 1;
+
+        return progskeet_read(handle, (char*)data, sizeof(uint16_t));
+    }
+
     if ((res = progskeet_set_addr(handle, addr, 0)) < 0)
         return res;
 
@@ -362,3 +607,313 @@ int progskeet_nop(struct progskeet_handle* handle, const uint32_t amount)
 
     return 0;
 }
+
+/*
+ * Image writer
+ *
+ * The image is cut into segments that each start with their own SET_ADDR,
+ * so the workers can encode them independently into buffers of their own.
+ * A window of segments goes out in place and in order while the workers
+ * encode the next window into the other set of buffers.
+ */
+
+/* Image bytes per segment */
+#define PROGSKEET_IMAGE_SEGMENT (1024 * 1024)
+
+/* Segments per window, each set of buffers holds one window */
+#define PROGSKEET_IMAGE_WINDOW_MAX 16
+
+/* Shorter erased runs cost more in SET_ADDR and WRITE_CYCLE headers than leaving them out saves */
+#define PROGSKEET_IMAGE_ERASED_MIN 16
+
+struct progskeet_image_seg
+{
+    struct progskeet_handle* handle;
+
+    const uint8_t* src;
+    uint32_t addr;
+    size_t words;
+    size_t width;
+    int flags;
+
+    char* out;
+    size_t out_len;
+};
+
+/* Encoded size of words words in the worst case, runs of data alternating with the shortest erased runs */
+static size_t progskeet_image_cap(const size_t words, const size_t width)
+{
+    const size_t runs = words / (PROGSKEET_IMAGE_ERASED_MIN + 1) + 1;
+
+    return words * width + runs * 4 + (words / 0xFFFF + runs) * 3;
+}
+
+static size_t progskeet_image_set_addr(struct progskeet_image_seg* seg, char* out, const size_t word)
+{
+    struct progskeet_handle* handle = seg->handle;
+    uint32_t maddr;
+
+    /* The bank lines are set by the caller, a segment never crosses a bank */
+    maddr = progskeet_addr_map(handle, seg->addr + (uint32_t)word);
+    if (handle->bank_bits > 0)
+        maddr &= ((uint32_t)1 << handle->bank_native_bits) - 1;
+
+    maddr |= PROGSKEET_ADDR_AUTO_INC;
+
+    out[0] = PROGSKEET_CMD_SET_ADDR;
+    out[1] = (maddr >>  0) & 0xFF;
+    out[2] = (maddr >>  8) & 0xFF;
+    out[3] = (maddr >> 16) & 0xFF;
+
+    return 4;
+}
+
+/* Encodes the words from start to end, behind a SET_ADDR of their own */
+static size_t progskeet_image_run(struct progskeet_image_seg* seg, char* out, const size_t start, const size_t end)
+{
+    const uint8_t* src = seg->src + start * seg->width;
+    const int swap = (seg->flags & PROGSKEET_IMAGE_SWAP) && seg->width == 2;
+    size_t remaining;
+    size_t block;
+    size_t pos;
+    size_t i;
+
+    if (end == start)
+        return 0;
+
+    pos = progskeet_image_set_addr(seg, out, start);
+
+    for (remaining = end - start; remaining > 0; remaining -= block) {
+        block = remaining < 0xFFFF ? remaining : 0xFFFF;
+
+        out[pos++] = PROGSKEET_CMD_WRITE_CYCLE;
+        out[pos++] = (uint8_t)((block >> 0) & 0xFF);
+        out[pos++] = (uint8_t)((block >> 8) & 0xFF);
+
+        if (swap) {
+            for (i = 0; i < block; i++) {
+                out[pos + i * 2 + 0] = src[i * 2 + 1];
+                out[pos + i * 2 + 1] = src[i * 2 + 0];
+            }
+        } else {
+            memcpy(out + pos, src, block * seg->width);
+        }
+
+        pos += block * seg->width;
+        src += block * seg->width;
+    }
+
+    return pos;
+}
+
+static int progskeet_image_is_erased(const struct progskeet_image_seg* seg, const size_t word)
+{
+    if (seg->width == 2)
+        return seg->src[word * 2] == 0xFF && seg->src[word * 2 + 1] == 0xFF;
+
+    return seg->src[word] == 0xFF;
+}
+
+/* Worker job, encodes one segment */
+static void progskeet_image_encode(void* arg)
+{
+    struct progskeet_image_seg* seg = (struct progskeet_image_seg*)arg;
+    size_t start, erased, i;
+    size_t pos = 0;
+
+    if ((seg->flags & PROGSKEET_IMAGE_SKIP_ERASED) == 0) {
+        seg->out_len = progskeet_image_run(seg, seg->out, 0, seg->words);
+        return;
+    }
+
+    start = 0;
+    erased = 0;
+    for (i = 0; i < seg->words; i++) {
+        if (progskeet_image_is_erased(seg, i)) {
+            erased++;
+            continue;
+        }
+
+        /* Data again after a run long enough to leave out */
+        if (erased >= PROGSKEET_IMAGE_ERASED_MIN) {
+            pos += progskeet_image_run(seg, seg->out + pos, start, i - erased);
+            start = i;
+        }
+
+        erased = 0;
+    }
+
+    pos += progskeet_image_run(seg, seg->out + pos, start, erased >= PROGSKEET_IMAGE_ERASED_MIN ? seg->words - erased : seg->words);
+
+    seg->out_len = pos;
+}
+
+/* Cuts the next segments off the image and hands them to the workers, returns how many */
+static unsigned int progskeet_image_fill(struct progskeet_handle* handle, struct progskeet_workers* workers,
+                                         struct progskeet_image_seg* segs, const unsigned int count,
+                                         const char* buf, const size_t words, size_t* done, const int flags)
+{
+    const size_t width = (handle->cur_config & PROGSKEET_CFG_16BIT) > 0 ? 2 : 1;
+    uint32_t bank_size;
+    size_t chunk;
+    size_t span;
+    unsigned int n;
+
+    for (n = 0; n < count && *done < words; n++) {
+        chunk = words - *done < PROGSKEET_IMAGE_SEGMENT / width ? words - *done : PROGSKEET_IMAGE_SEGMENT / width;
+
+        if (handle->bank_bits > 0) {
+            bank_size = (uint32_t)1 << handle->bank_native_bits;
+            span = bank_size - (progskeet_addr_map(handle, handle->cur_addr + (uint32_t)*done) & (bank_size - 1));
+
+            if (chunk > span)
+                chunk = span;
+        }
+
+        segs[n].handle = handle;
+        segs[n].src = (const uint8_t*)buf + *done * width;
+        segs[n].addr = handle->cur_addr + (uint32_t)*done;
+        segs[n].words = chunk;
+        segs[n].width = width;
+        segs[n].flags = flags;
+        segs[n].out_len = 0;
+
+        if (progskeet_workers_submit(workers, progskeet_image_encode, &segs[n]) < 0)
+            progskeet_image_encode(&segs[n]);
+
+        *done += chunk;
+    }
+
+    return n;
+}
+
+/* Queues encoded segments in order, with the bank lines each one needs */
+static int progskeet_image_queue(struct progskeet_handle* handle, struct progskeet_image_seg* segs, const unsigned int count)
+{
+    unsigned int i;
+    int res;
+
+    for (i = 0; i < count; i++) {
+        if (segs[i].out_len == 0)
+            continue;
+
+        if (handle->bank_bits > 0 &&
+            (res = progskeet_bank_select(handle, progskeet_addr_map(handle, segs[i].addr) >> handle->bank_native_bits)) < 0)
+            return res;
+
+        /* Segments thinned out by skipping get copied, make room for them */
+        if (segs[i].out_len < PROGSKEET_TXREF_MIN && progskeet_tx_free(handle) < segs[i].out_len &&
+            (res = progskeet_sync(handle)) < 0)
+            return res;
+
+        if ((res = progskeet_enqueue_tx_ref(handle, segs[i].out, segs[i].out_len)) < 0)
+            return res;
+    }
+
+    return 0;
+}
+
+static int progskeet_write_image_run(struct progskeet_handle* handle, const char* buf, const size_t len, const int flags)
+{
+    const size_t width = (handle->cur_config & PROGSKEET_CFG_16BIT) > 0 ? 2 : 1;
+    struct progskeet_image_seg* segs;
+    struct progskeet_workers* workers;
+    unsigned int window, n[2], i;
+    size_t words, done, cap;
+    uint32_t start;
+    int cur;
+    int res;
+
+    words = len / width;
+    start = handle->cur_addr;
+
+    window = progskeet_workers_cpu_count();
+    if (window > PROGSKEET_IMAGE_WINDOW_MAX)
+        window = PROGSKEET_IMAGE_WINDOW_MAX;
+
+    if (window > (words + PROGSKEET_IMAGE_SEGMENT / width - 1) / (PROGSKEET_IMAGE_SEGMENT / width))
+        window = (unsigned int)((words + PROGSKEET_IMAGE_SEGMENT / width - 1) / (PROGSKEET_IMAGE_SEGMENT / width));
+
+    if (window == 0)
+        return 0;
+
+    cap = progskeet_image_cap(PROGSKEET_IMAGE_SEGMENT / width, width);
+
+    if ((segs = (struct progskeet_image_seg*)calloc(2 * window, sizeof(struct progskeet_image_seg))) == NULL)
+        return -3;
+
+    res = 0;
+    for (i = 0; i < 2 * window && res == 0; i++) {
+        if ((segs[i].out = (char*)malloc(cap)) == NULL)
+            res = -3;
+    }
+
+    if (res < 0) {
+        for (i = 0; i < 2 * window; i++)
+            free(segs[i].out);
+
+        free(segs);
+        return res;
+    }
+
+    /* Without workers the segments get encoded inline */
+    workers = progskeet_workers_create(window);
+
+    handle->cur_addr_inc = 1;
+    progskeet_cache_written(handle, words);
+
+    /* The workers encode one window while the other one is on the wire */
+    done = 0;
+    cur = 0;
+    n[cur] = progskeet_image_fill(handle, workers, segs, window, buf, words, &done, flags);
+
+    while (n[cur] > 0) {
+        progskeet_workers_wait(workers);
+
+        if ((res = progskeet_check_cancel(handle)) < 0 ||
+            (res = progskeet_image_queue(handle, segs + cur * window, n[cur])) < 0)
+            break;
+
+        /* Credited before the sync that sends it, that sync moves it to done */
+        for (i = 0; i < n[cur]; i++)
+            progskeet_progress_add(handle, segs[cur * window + i].words * width);
+
+        n[!cur] = progskeet_image_fill(handle, workers, segs + !cur * window, window, buf, words, &done, flags);
+
+        if ((res = progskeet_sync(handle)) < 0)
+            break;
+
+        cur = !cur;
+    }
+
+    /* Runs whatever the workers still have before the buffers go */
+    progskeet_workers_destroy(workers);
+
+    for (i = 0; i < 2 * window; i++)
+        free(segs[i].out);
+
+    free(segs);
+
+    /* Skipped runs leave the device counter behind */
+    handle->cur_addr = start + (uint32_t)words;
+    handle->addr_stale = 1;
+
+    return res;
+}
+
+int progskeet_write_image(struct progskeet_handle* handle, const char* buf, const size_t len, const int flags)
+{
+    int res;
+
+    if (!handle || !buf)
+        return -1;
+
+    if ((handle->cur_config & PROGSKEET_CFG_16BIT) > 0 && (len & 1) != 0)
+        return -1;
+
+    progskeet_progress_begin(handle, len);
+    res = progskeet_write_image_run(handle, buf, len, flags);
+    progskeet_progress_end(handle);
+
+    return res;
+}
@@ -43,20 +43,25 @@ int progskeet_log_set_global_target(progskeet_log_target target)
     g_target = target;
 }
 
-static progskeet_log_target progskeet_log_get_target(struct progskeet_handle* handle)
+static progskeet_log_target progskeet_log_get_target(struct progskeet_context* ctx, struct progskeet_handle* handle)
 {
-    if (handle == NULL || handle->log_target == NULL)
-        return g_target;
+    if (handle != NULL && handle->log_target != NULL)
+        return handle->log_target;
 
-    return handle->log_target;
+    if (ctx != NULL && ctx->log_target != NULL)
+        return ctx->log_target;
+
+    return g_target;
 }
 
-static int progskeet_log_int(struct progskeet_handle* handle, const enum progskeet_log_level level, const char* fmt, va_list argp)
+static int progskeet_log_int(struct progskeet_context* ctx, struct progskeet_handle* handle, const enum progskeet_log_level level,
+                             const char* fmt, va_list argp)
 {
-    static char buf[(1024 * 8)];
+    /* On the stack, handles of different contexts log from different threads */
+    char buf[(1024 * 8)];
     progskeet_log_target target;
 
-    if ((target = progskeet_log_get_target(handle)) == NULL)
+    if ((target = progskeet_log_get_target(ctx, handle)) == NULL)
         return -1;
 
     vsnprintf(buf, sizeof(buf), fmt, argp);
@@ -75,7 +80,7 @@ int progskeet_log(struct progskeet_handle* handle, const enum progskeet_log_leve
         return -1;
 
     va_start(argp, fmt);
-    res = progskeet_log_int(handle, level, fmt, argp);
+    res = progskeet_log_int(handle->ctx, handle, level, fmt, argp);
     va_end(argp);
 
     return res;
@@ -90,7 +95,19 @@ int progskeet_log_global(const enum progskeet_log_level level, const char* fmt,
         return -1;
 
     va_start(argp, fmt);
-    res = progskeet_log_int(NULL, level, fmt, argp);
+    res = progskeet_log_int(NULL, NULL, level, fmt, argp);
+    va_end(argp);
+
+    return res;
+}
+
+int progskeet_log_context(struct progskeet_context* ctx, const enum progskeet_log_level level, const char* fmt, ...)
+{
+    va_list argp;
+    int res;
+
+    va_start(argp, fmt);
+    res = progskeet_log_int(ctx, NULL, level, fmt, argp);
     va_end(argp);
 
     return res;
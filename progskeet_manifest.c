@@ -0,0 +1,522 @@
+/*
+ * libprogskeet - ProgSkeet library
+ * Copyright (C) 2012 Axel Gembe <axel@gembe.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * ProgSkeet content manifests
+ *
+ * A manifest stores the SHA-256 of every block that was last programmed
+ * into a board, in a file named after the device serial and chip identity.
+ * All integers in the file are little endian:
+ *
+ *   "PSKM" version key_len key[key_len] addr len block_size nblocks
+ *   sha256[nblocks][32]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "progskeet.h"
+#include "progskeet_private.h"
+
+#define PROGSKEET_MANIFEST_MAGIC "PSKM"
+#define PROGSKEET_MANIFEST_VERSION 1
+
+/* Reads during verification are grouped up to this many bytes per sync */
+#define PROGSKEET_MANIFEST_READ_BATCH (512 * 1024)
+
+/* Varies the sample selection between plans within the same second */
+static uint32_t g_plan_count = 0;
+
+struct progskeet_manifest
+{
+    char key[512];
+
+    uint32_t addr;
+    uint64_t len;
+    uint32_t block_size;
+    uint32_t nblocks;
+
+    uint8_t* hashes;
+};
+
+struct progskeet_manifest_cfg
+{
+    char dir[512];
+    char chip_id[200];
+    size_t block_size;
+};
+
+static int progskeet_manifest_key(struct progskeet_handle* handle, const char* chip_id, char* key, size_t keylen)
+{
+    char serial[256];
+
+    if (progskeet_get_serial(handle, serial, sizeof(serial)) < 0)
+        return -1;
+
+    /* Block addresses depend on the bus width, so it is part of the identity */
+    snprintf(key, keylen, "%s/%s/%s", serial, chip_id,
+             (handle->cur_config & PROGSKEET_CFG_16BIT) ? "x16" : "x8");
+
+    return 0;
+}
+
+static void progskeet_manifest_path(const char* dir, const char* key, char* path, size_t pathlen)
+{
+    struct progskeet_sha256_ctx ctx;
+    uint8_t digest[32];
+
+    progskeet_sha256_init(&ctx);
+    progskeet_sha256_update(&ctx, key, strlen(key));
+    progskeet_sha256_final(&ctx, digest);
+
+    snprintf(path, pathlen, "%s/%02x%02x%02x%02x%02x%02x%02x%02x.psm", dir,
+             digest[0], digest[1], digest[2], digest[3], digest[4], digest[5], digest[6], digest[7]);
+}
+
+static void progskeet_manifest_put32(uint8_t* p, uint32_t v)
+{
+    p[0] = (uint8_t)(v >> 0);
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static uint32_t progskeet_manifest_get32(const uint8_t* p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void progskeet_manifest_hash_blocks(const char* image, const size_t len, const size_t block_size, uint8_t* hashes)
+{
+    struct progskeet_sha256_ctx ctx;
+    size_t off, n;
+    uint32_t i;
+
+    for (i = 0, off = 0; off < len; i++, off += block_size) {
+        n = (len - off) < block_size ? (len - off) : block_size;
+
+        progskeet_sha256_init(&ctx);
+        progskeet_sha256_update(&ctx, image + off, n);
+        progskeet_sha256_final(&ctx, hashes + (size_t)i * 32);
+    }
+}
+
+static int progskeet_manifest_load(const char* path, const char* key, struct progskeet_manifest* manifest)
+{
+    uint8_t hdr[8];
+    uint8_t geom[20];
+    uint32_t keylen;
+    FILE* fp;
+
+    memset(manifest, 0, sizeof(struct progskeet_manifest));
+
+    if ((fp = fopen(path, "rb")) == NULL)
+        return -1;
+
+    if (fread(hdr, 1, sizeof(hdr), fp) != sizeof(hdr) || memcmp(hdr, PROGSKEET_MANIFEST_MAGIC, 4) != 0 ||
+        progskeet_manifest_get32(hdr + 4) != PROGSKEET_MANIFEST_VERSION)
+        goto fail;
+
+    if (fread(hdr, 1, 4, fp) != 4 || (keylen = progskeet_manifest_get32(hdr)) >= sizeof(manifest->key))
+        goto fail;
+
+    if (fread(manifest->key, 1, keylen, fp) != keylen || strcmp(manifest->key, key) != 0)
+        goto fail;
+
+    if (fread(geom, 1, sizeof(geom), fp) != sizeof(geom))
+        goto fail;
+
+    manifest->addr = progskeet_manifest_get32(geom);
+    manifest->len = (uint64_t)progskeet_manifest_get32(geom + 4) | ((uint64_t)progskeet_manifest_get32(geom + 8) << 32);
+    manifest->block_size = progskeet_manifest_get32(geom + 12);
+    manifest->nblocks = progskeet_manifest_get32(geom + 16);
+
+    if (manifest->block_size == 0 || manifest->nblocks != (manifest->len + manifest->block_size - 1) / manifest->block_size)
+        goto fail;
+
+    if ((manifest->hashes = (uint8_t*)malloc((size_t)manifest->nblocks * 32)) == NULL)
+        goto fail;
+
+    if (fread(manifest->hashes, 32, manifest->nblocks, fp) != manifest->nblocks) {
+        free(manifest->hashes);
+        manifest->hashes = NULL;
+        goto fail;
+    }
+
+    fclose(fp);
+
+    return 0;
+
+fail:
+    fclose(fp);
+
+    return -2;
+}
+
+/* Reads the listed blocks back and clears dirty for those that match the image */
+static int progskeet_manifest_readback(struct progskeet_handle* handle, const uint32_t addr, const char* image,
+                                       const size_t len, const size_t block_size, const uint32_t* blocks,
+                                       const uint32_t count, uint8_t* dirty, uint32_t* mismatches)
+{
+    size_t word_size;
+    size_t batch_blocks;
+    size_t off, n;
+    uint32_t i, j, k;
+    char* buf;
+    int res;
+
+    word_size = (handle->cur_config & PROGSKEET_CFG_16BIT) ? 2 : 1;
+
+    batch_blocks = PROGSKEET_MANIFEST_READ_BATCH / block_size;
+    if (batch_blocks < 1)
+        batch_blocks = 1;
+
+    if ((buf = (char*)malloc(batch_blocks * block_size)) == NULL)
+        return -2;
+
+    *mismatches = 0;
+
+    for (i = 0; i < count; i += j) {
+        for (j = 0; j < batch_blocks && i + j < count; j++) {
+            off = (size_t)blocks[i + j] * block_size;
+            n = (len - off) < block_size ? (len - off) : block_size;
+
+            if ((res = progskeet_set_addr(handle, addr + (uint32_t)(off / word_size), 1)) < 0)
+                goto out;
+
+            /* The cache could confirm what it holds rather than what the chip does */
+            if ((res = progskeet_read_uncached(handle, buf + j * block_size, n)) < 0)
+                goto out;
+        }
+
+        if ((res = progskeet_sync(handle)) < 0)
+            goto out;
+
+        for (k = 0; k < j; k++) {
+            off = (size_t)blocks[i + k] * block_size;
+            n = (len - off) < block_size ? (len - off) : block_size;
+
+            if (memcmp(buf + k * block_size, image + off, n) == 0) {
+                dirty[blocks[i + k]] = 0;
+            } else {
+                dirty[blocks[i + k]] = 1;
+                (*mismatches)++;
+            }
+        }
+    }
+
+    res = 0;
+
+out:
+    free(buf);
+
+    return res;
+}
+
+int progskeet_manifest_plan(struct progskeet_handle* handle, const char* dir, const char* chip_id,
+                            const uint32_t addr, const char* image, const size_t len,
+                            const size_t block_size, const unsigned int samples, uint8_t* dirty)
+{
+    struct progskeet_manifest manifest;
+    char key[512];
+    char path[1024];
+    uint8_t* hashes;
+    uint32_t* blocks;
+    uint32_t nblocks, nclean, nsampled, mismatches;
+    uint32_t i, j, tmp, seed;
+    uint32_t count;
+    int res;
+
+    if (!handle || !dir || !chip_id || !image || !dirty || block_size == 0 || len == 0)
+        return -1;
+
+    nblocks = (uint32_t)((len + block_size - 1) / block_size);
+
+    if ((hashes = (uint8_t*)malloc((size_t)nblocks * 32)) == NULL)
+        return -2;
+
+    if ((blocks = (uint32_t*)malloc((size_t)nblocks * sizeof(uint32_t))) == NULL) {
+        free(hashes);
+        return -2;
+    }
+
+    progskeet_manifest_hash_blocks(image, len, block_size, hashes);
+
+    res = -3;
+    nclean = 0;
+
+    if (progskeet_manifest_key(handle, chip_id, key, sizeof(key)) == 0) {
+        progskeet_manifest_path(dir, key, path, sizeof(path));
+        res = progskeet_manifest_load(path, key, &manifest);
+    }
+
+    if (res == 0 && (manifest.addr != addr || manifest.len != len || manifest.block_size != block_size)) {
+        progskeet_log(handle, progskeet_log_level_info, "Manifest covers a different range, ignoring it\n");
+        free(manifest.hashes);
+        res = -4;
+    }
+
+    if (res == 0) {
+        /* The manifest says what is on the chip, blocks it disagrees with get rewritten */
+        for (i = 0; i < nblocks; i++) {
+            dirty[i] = memcmp(manifest.hashes + (size_t)i * 32, hashes + (size_t)i * 32, 32) != 0;
+
+            if (!dirty[i])
+                blocks[nclean++] = i;
+        }
+
+        free(manifest.hashes);
+
+        /* Confirm it on a random subset of the blocks that would be skipped */
+        seed = (uint32_t)time(NULL) ^ (uint32_t)clock() ^ progskeet_crc32c(0, key, strlen(key)) ^ (g_plan_count++ * 0x9E3779B9);
+        if (seed == 0)
+            seed = 1;
+
+        nsampled = samples < nclean ? samples : nclean;
+        for (i = 0; i < nsampled; i++) {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+
+            j = i + seed % (nclean - i);
+            tmp = blocks[i];
+            blocks[i] = blocks[j];
+            blocks[j] = tmp;
+        }
+
+        if ((res = progskeet_manifest_readback(handle, addr, image, len, block_size, blocks, nsampled, dirty, &mismatches)) < 0)
+            goto out;
+
+        if (mismatches == 0) {
+            progskeet_log(handle, progskeet_log_level_info, "Manifest confirmed by %u sampled blocks\n", nsampled);
+            goto count;
+        }
+
+        progskeet_log(handle, progskeet_log_level_info, "Manifest is stale, %u of %u sampled blocks differ\n",
+                      mismatches, nsampled);
+        remove(path);
+    }
+
+    /* No usable manifest, compare everything */
+    for (i = 0; i < nblocks; i++)
+        blocks[i] = i;
+
+    if ((res = progskeet_manifest_readback(handle, addr, image, len, block_size, blocks, nblocks, dirty, &mismatches)) < 0)
+        goto out;
+
+count:
+    for (i = 0, count = 0; i < nblocks; i++)
+        count += dirty[i] ? 1 : 0;
+
+    res = (int)count;
+
+out:
+    free(blocks);
+    free(hashes);
+
+    return res;
+}
+
+/* Writes the manifest next to path and renames it over the old one once it is complete */
+static int progskeet_manifest_store(struct progskeet_handle* handle, const char* path, const char* key,
+                                    const struct progskeet_manifest* manifest)
+{
+    char tmppath[1040];
+    uint8_t hdr[12];
+    uint8_t geom[20];
+    size_t keylen;
+    FILE* fp;
+    int ok;
+
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+
+    if ((fp = fopen(tmppath, "wb")) == NULL) {
+        progskeet_log(handle, progskeet_log_level_error, "Failed to create manifest %s\n", tmppath);
+        return -4;
+    }
+
+    keylen = strlen(key) + 1;
+
+    memcpy(hdr, PROGSKEET_MANIFEST_MAGIC, 4);
+    progskeet_manifest_put32(hdr + 4, PROGSKEET_MANIFEST_VERSION);
+    progskeet_manifest_put32(hdr + 8, (uint32_t)keylen);
+
+    progskeet_manifest_put32(geom, manifest->addr);
+    progskeet_manifest_put32(geom + 4, (uint32_t)(manifest->len & 0xFFFFFFFF));
+    progskeet_manifest_put32(geom + 8, (uint32_t)(manifest->len >> 32));
+    progskeet_manifest_put32(geom + 12, manifest->block_size);
+    progskeet_manifest_put32(geom + 16, manifest->nblocks);
+
+    ok = fwrite(hdr, 1, sizeof(hdr), fp) == sizeof(hdr) &&
+         fwrite(key, 1, keylen, fp) == keylen &&
+         fwrite(geom, 1, sizeof(geom), fp) == sizeof(geom) &&
+         fwrite(manifest->hashes, 32, manifest->nblocks, fp) == manifest->nblocks;
+
+    ok = (fclose(fp) == 0) && ok;
+
+    /* Replace the old manifest only once the new one is complete, rename does it atomically on POSIX */
+#ifdef WIN32
+    if (ok)
+        remove(path);
+#endif /* WIN32 */
+    if (!ok || rename(tmppath, path) != 0) {
+        progskeet_log(handle, progskeet_log_level_error, "Failed to write manifest %s\n", path);
+        remove(tmppath);
+
+        /* The flash no longer matches the old one */
+        remove(path);
+        return -4;
+    }
+
+    return 0;
+}
+
+int progskeet_manifest_update(struct progskeet_handle* handle, const char* dir, const char* chip_id,
+                              const uint32_t addr, const char* image, const size_t len,
+                              const size_t block_size)
+{
+    struct progskeet_manifest manifest;
+    char key[512];
+    char path[1024];
+    int res;
+
+    if (!handle || !dir || !chip_id || !image || block_size == 0 || len == 0)
+        return -1;
+
+    if (progskeet_manifest_key(handle, chip_id, key, sizeof(key)) < 0)
+        return -2;
+
+    manifest.addr = addr;
+    manifest.len = len;
+    manifest.block_size = (uint32_t)block_size;
+    manifest.nblocks = (uint32_t)((len + block_size - 1) / block_size);
+
+    if ((manifest.hashes = (uint8_t*)malloc((size_t)manifest.nblocks * 32)) == NULL)
+        return -3;
+
+    progskeet_manifest_hash_blocks(image, len, block_size, manifest.hashes);
+
+    progskeet_manifest_path(dir, key, path, sizeof(path));
+    res = progskeet_manifest_store(handle, path, key, &manifest);
+
+    free(manifest.hashes);
+
+    return res;
+}
+
+int progskeet_manifest_enable(struct progskeet_handle* handle, const char* dir, const char* chip_id,
+                              const size_t block_size)
+{
+    struct progskeet_manifest_cfg* cfg;
+
+    if (!handle || !dir || !chip_id || block_size == 0)
+        return -1;
+
+    /* Blocks start on bus words, or a program could not tell which blocks it covers */
+    if (block_size % ((handle->cur_config & PROGSKEET_CFG_16BIT) ? 2 : 1) != 0)
+        return -1;
+
+    if (strlen(dir) >= sizeof(cfg->dir) || strlen(chip_id) >= sizeof(cfg->chip_id))
+        return -1;
+
+    progskeet_manifest_disable(handle);
+
+    if ((cfg = (struct progskeet_manifest_cfg*)malloc(sizeof(struct progskeet_manifest_cfg))) == NULL)
+        return -3;
+
+    strcpy(cfg->dir, dir);
+    strcpy(cfg->chip_id, chip_id);
+    cfg->block_size = block_size;
+
+    handle->manifest = cfg;
+
+    return 0;
+}
+
+int progskeet_manifest_disable(struct progskeet_handle* handle)
+{
+    if (!handle)
+        return -1;
+
+    free(handle->manifest);
+    handle->manifest = NULL;
+
+    return 0;
+}
+
+/*
+ * A program usually covers only the blocks a plan found dirty, so the range
+ * is merged into the manifest of the whole image rather than replacing it.
+ * Blocks the range covers in part no longer match either hash and are
+ * zeroed, which no block hashes to.
+ */
+int progskeet_manifest_programmed(struct progskeet_handle* handle, const uint32_t addr, const char* image, const size_t len)
+{
+    const struct progskeet_manifest_cfg* cfg = handle->manifest;
+    struct progskeet_sha256_ctx ctx;
+    struct progskeet_manifest manifest;
+    char key[512];
+    char path[1024];
+    size_t word_size;
+    int64_t start, end;
+    int64_t off, n;
+    uint32_t i;
+    int res;
+
+    if (!cfg || len == 0)
+        return 0;
+
+    if (progskeet_manifest_key(handle, cfg->chip_id, key, sizeof(key)) < 0)
+        return -2;
+
+    progskeet_manifest_path(cfg->dir, key, path, sizeof(path));
+
+    if (progskeet_manifest_load(path, key, &manifest) < 0 || manifest.block_size != cfg->block_size) {
+        free(manifest.hashes);
+        return progskeet_manifest_update(handle, cfg->dir, cfg->chip_id, addr, image, len, cfg->block_size);
+    }
+
+    word_size = (handle->cur_config & PROGSKEET_CFG_16BIT) ? 2 : 1;
+
+    /* The programmed range in bytes from the start of the manifest */
+    start = ((int64_t)addr - (int64_t)manifest.addr) * (int64_t)word_size;
+    end = start + (int64_t)len;
+
+    for (i = 0, off = 0; i < manifest.nblocks; i++, off += manifest.block_size) {
+        n = (int64_t)manifest.len - off < (int64_t)manifest.block_size ? (int64_t)manifest.len - off : (int64_t)manifest.block_size;
+
+        if (off + n <= start || off >= end)
+            continue;
+
+        if (off >= start && off + n <= end) {
+            progskeet_sha256_init(&ctx);
+            progskeet_sha256_update(&ctx, image + (off - start), (size_t)n);
+            progskeet_sha256_final(&ctx, manifest.hashes + (size_t)i * 32);
+        } else {
+            memset(manifest.hashes + (size_t)i * 32, 0, 32);
+        }
+    }
+
+    res = progskeet_manifest_store(handle, path, key, &manifest);
+
+    free(manifest.hashes);
+
+    return res;
+}
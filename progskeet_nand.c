@@ -0,0 +1,673 @@
+/*
+ * libprogskeet - ProgSkeet library
+ * Copyright (C) 2012 Axel Gembe <axel@gembe.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * ProgSkeet NAND flash functions
+ *
+ * CLE, ALE, CE# and WP# are GPIOs, WE# and RE# are the strobes of the
+ * write and read cycles. R/B# is waited for on the device with WAIT_GPIO,
+ * so a whole dump or program job goes out as one command stream. The
+ * address lines are not used, they stay at 0 without auto increment.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "progskeet.h"
+#include "progskeet_private.h"
+
+/* Commands */
+#define NAND_CMD_READ               0x00
+#define NAND_CMD_READ_START         0x30
+#define NAND_CMD_READ_CACHE_SEQ     0x31
+#define NAND_CMD_READ_CACHE_END     0x3F
+#define NAND_CMD_PROGRAM            0x80
+#define NAND_CMD_PROGRAM_START      0x10
+#define NAND_CMD_ERASE              0x60
+#define NAND_CMD_ERASE_START        0xD0
+#define NAND_CMD_STATUS             0x70
+#define NAND_CMD_READ_PARAM         0xEC
+#define NAND_CMD_RESET              0xFF
+
+#define NAND_STATUS_FAIL            0x01
+
+/* Parameter page offsets */
+#define ONFI_FEATURES               6
+#define ONFI_OPT_COMMANDS           8
+#define ONFI_MANUFACTURER           32
+#define ONFI_MODEL                  44
+#define ONFI_PAGE_SIZE              80
+#define ONFI_SPARE_SIZE             84
+#define ONFI_PAGES_PER_BLOCK        92
+#define ONFI_BLOCKS_PER_LUN         96
+#define ONFI_LUNS                   100
+#define ONFI_ADDR_CYCLES            101
+#define ONFI_T_PROG                 133
+#define ONFI_T_BERS                 135
+#define ONFI_T_R                    137
+#define ONFI_CRC                    254
+#define ONFI_PARAM_LEN              256
+#define ONFI_PARAM_COPIES           3
+
+#define ONFI_FEATURE_16BIT          0x0001
+#define ONFI_OPT_CACHE_READ         0x0002
+
+#define ONFI_CRC_INIT               0x4F4E
+#define ONFI_CRC_POLY               0x8005
+
+/* Time from the last command cycle until R/B# is valid */
+#define NAND_BUSY_DELAY_NS          100
+
+/* Pages per sync, bounds the RX list and lets a cancel through */
+#define NAND_PAGES_PER_SYNC         64
+
+#define NAND_CMD_OVERHEAD           128
+
+#define LE16(p) ((uint32_t)(p)[0] | ((uint32_t)(p)[1] << 8))
+#define LE32(p) (LE16(p) | ((uint32_t)(p)[2] << 16) | ((uint32_t)(p)[3] << 24))
+
+static uint8_t progskeet_nand_bits(uint32_t n)
+{
+    uint8_t bits = 0;
+
+    while (((uint32_t)1 << bits) < n)
+        bits++;
+
+    return bits;
+}
+
+static uint32_t progskeet_nand_pages(const struct progskeet_nand_info* nand)
+{
+    return nand->pages_per_block * nand->blocks_per_lun * nand->luns;
+}
+
+/* Row address of a page, the LUN and block go above the page bits */
+static uint32_t progskeet_nand_row(const struct progskeet_nand_info* nand, const uint32_t page)
+{
+    uint8_t page_bits = progskeet_nand_bits(nand->pages_per_block);
+    uint8_t block_bits = progskeet_nand_bits(nand->blocks_per_lun);
+    uint32_t per_lun = nand->pages_per_block * nand->blocks_per_lun;
+    uint32_t lun = page / per_lun;
+    uint32_t block = (page % per_lun) / nand->pages_per_block;
+
+    return (lun << (page_bits + block_bits)) | (block << page_bits) | (page % nand->pages_per_block);
+}
+
+/* Takes the bus with CE# low and CLE, ALE low, WP# high and R/B# as an input */
+static int progskeet_nand_select(struct progskeet_handle* handle, const struct progskeet_nand_info* nand)
+{
+    uint16_t outputs = nand->cle_gpio | nand->ale_gpio | nand->ce_gpio | nand->wp_gpio;
+    uint16_t dir, gpio;
+    int res;
+
+    dir = (handle->cur_gpio_dir | outputs) & ~nand->rb_gpio;
+    if (dir != handle->cur_gpio_dir && (res = progskeet_set_gpio_dir(handle, dir)) < 0)
+        return res;
+
+    gpio = (handle->cur_gpio & ~(nand->cle_gpio | nand->ale_gpio | nand->ce_gpio)) | nand->wp_gpio;
+    if (gpio != handle->cur_gpio && (res = progskeet_set_gpio(handle, gpio)) < 0)
+        return res;
+
+    return progskeet_set_addr(handle, 0, 0);
+}
+
+static int progskeet_nand_deselect(struct progskeet_handle* handle, const struct progskeet_nand_info* nand)
+{
+    return progskeet_set_gpio(handle, handle->cur_gpio | nand->ce_gpio);
+}
+
+static int progskeet_nand_cmd(struct progskeet_handle* handle, const struct progskeet_nand_info* nand, const uint8_t cmd)
+{
+    int res;
+
+    if ((res = progskeet_assert_gpio(handle, nand->cle_gpio)) < 0)
+        return res;
+
+    if ((res = progskeet_set_data(handle, cmd)) < 0)
+        return res;
+
+    return progskeet_deassert_gpio(handle, nand->cle_gpio);
+}
+
+static int progskeet_nand_addr(struct progskeet_handle* handle, const struct progskeet_nand_info* nand,
+                               const uint32_t col, const uint8_t col_cycles, const uint32_t row, const uint8_t row_cycles)
+{
+    uint8_t i;
+    int res;
+
+    if ((res = progskeet_assert_gpio(handle, nand->ale_gpio)) < 0)
+        return res;
+
+    for (i = 0; i < col_cycles; i++) {
+        if ((res = progskeet_set_data(handle, (col >> (i * 8)) & 0xFF)) < 0)
+            return res;
+    }
+
+    for (i = 0; i < row_cycles; i++) {
+        if ((res = progskeet_set_data(handle, (row >> (i * 8)) & 0xFF)) < 0)
+            return res;
+    }
+
+    return progskeet_deassert_gpio(handle, nand->ale_gpio);
+}
+
+/* Waits on R/B#, or for max_us when there is none */
+static int progskeet_nand_wait(struct progskeet_handle* handle, const struct progskeet_nand_info* nand, const uint32_t max_us)
+{
+    int res;
+
+    if (!nand->rb_gpio)
+        return progskeet_wait_us(handle, max_us);
+
+    if ((res = progskeet_wait_ns(handle, NAND_BUSY_DELAY_NS)) < 0)
+        return res;
+
+    return progskeet_wait_gpio(handle, nand->rb_gpio, nand->rb_gpio);
+}
+
+static int progskeet_nand_status(struct progskeet_handle* handle, const struct progskeet_nand_info* nand, uint16_t* status)
+{
+    int res;
+
+    *status = 0;
+
+    if ((res = progskeet_nand_cmd(handle, nand, NAND_CMD_STATUS)) < 0)
+        return res;
+
+    return progskeet_read_uncached(handle, (char*)status, nand->bus_width);
+}
+
+static uint16_t progskeet_nand_onfi_crc(const uint8_t* buf, const size_t len)
+{
+    uint16_t crc = ONFI_CRC_INIT;
+    size_t i;
+    int bit;
+
+    for (i = 0; i < len; i++) {
+        crc ^= (uint16_t)buf[i] << 8;
+
+        for (bit = 0; bit < 8; bit++)
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ ONFI_CRC_POLY) : (uint16_t)(crc << 1);
+    }
+
+    return crc;
+}
+
+static void progskeet_nand_copy_string(char* dst, const uint8_t* src, const size_t len)
+{
+    size_t n = len;
+
+    memcpy(dst, src, len);
+
+    while (n > 0 && dst[n - 1] == ' ')
+        n--;
+
+    dst[n] = '\0';
+}
+
+int progskeet_nand_onfi_parse(const uint8_t* param, const size_t len, struct progskeet_nand_info* nand)
+{
+    uint16_t features, opt;
+
+    if (!param || !nand || len < ONFI_PARAM_LEN)
+        return -1;
+
+    if (memcmp(param, "ONFI", 4) != 0)
+        return -2;
+
+    if (progskeet_nand_onfi_crc(param, ONFI_CRC) != LE16(param + ONFI_CRC))
+        return -3;
+
+    features = (uint16_t)LE16(param + ONFI_FEATURES);
+    opt = (uint16_t)LE16(param + ONFI_OPT_COMMANDS);
+
+    progskeet_nand_copy_string(nand->manufacturer, param + ONFI_MANUFACTURER, 12);
+    progskeet_nand_copy_string(nand->model, param + ONFI_MODEL, 20);
+
+    nand->bus_width = (features & ONFI_FEATURE_16BIT) ? 2 : 1;
+
+    nand->page_size = LE32(param + ONFI_PAGE_SIZE);
+    nand->spare_size = LE16(param + ONFI_SPARE_SIZE);
+    nand->pages_per_block = LE32(param + ONFI_PAGES_PER_BLOCK);
+    nand->blocks_per_lun = LE32(param + ONFI_BLOCKS_PER_LUN);
+    nand->luns = param[ONFI_LUNS];
+
+    nand->row_cycles = param[ONFI_ADDR_CYCLES] & 0x0F;
+    nand->col_cycles = param[ONFI_ADDR_CYCLES] >> 4;
+
+    nand->cache_read = (opt & ONFI_OPT_CACHE_READ) ? 1 : 0;
+
+    nand->program_us = LE16(param + ONFI_T_PROG);
+    nand->erase_us = LE16(param + ONFI_T_BERS);
+    nand->read_us = LE16(param + ONFI_T_R);
+
+    if (nand->page_size == 0 || nand->pages_per_block == 0 || nand->blocks_per_lun == 0 || nand->luns == 0)
+        return -2;
+
+    return 0;
+}
+
+int progskeet_nand_onfi_query(struct progskeet_handle* handle, struct progskeet_nand_info* nand)
+{
+    uint8_t raw[ONFI_PARAM_LEN * ONFI_PARAM_COPIES * 2];
+    uint8_t param[ONFI_PARAM_LEN];
+    size_t width;
+    int copy;
+    int i;
+    int res;
+
+    if (!handle || !nand)
+        return -1;
+
+    width = (handle->cur_config & PROGSKEET_CFG_16BIT) ? 2 : 1;
+
+    progskeet_nand_select(handle, nand);
+
+    progskeet_nand_cmd(handle, nand, NAND_CMD_RESET);
+    progskeet_nand_wait(handle, nand, 1000);
+
+    progskeet_nand_cmd(handle, nand, NAND_CMD_READ_PARAM);
+    progskeet_nand_addr(handle, nand, 0, 1, 0, 0);
+    progskeet_nand_wait(handle, nand, 1000);
+
+    progskeet_read_uncached(handle, (char*)raw, ONFI_PARAM_LEN * ONFI_PARAM_COPIES * width);
+
+    progskeet_nand_deselect(handle, nand);
+
+    if ((res = progskeet_sync(handle)) < 0)
+        return res;
+
+    /* Parameter page data is only on the low byte of an x16 bus */
+    for (copy = 0; copy < ONFI_PARAM_COPIES; copy++) {
+        for (i = 0; i < ONFI_PARAM_LEN; i++)
+            param[i] = raw[(copy * ONFI_PARAM_LEN + i) * width];
+
+        if ((res = progskeet_nand_onfi_parse(param, sizeof(param), nand)) == 0)
+            break;
+    }
+
+    if (res < 0) {
+        progskeet_log(handle, progskeet_log_level_error, "No valid ONFI parameter page\n");
+        return -2;
+    }
+
+    if ((size_t)nand->bus_width != width) {
+        progskeet_log(handle, progskeet_log_level_error, "NAND bus width does not match the configuration\n");
+        return -3;
+    }
+
+    return 0;
+}
+
+static int progskeet_nand_check(const struct progskeet_nand_info* nand, const uint32_t page, const uint32_t count)
+{
+    uint32_t pages = progskeet_nand_pages(nand);
+
+    return page < pages && count <= pages - page;
+}
+
+/*
+ * With cache reads the next page is loaded from the array while the
+ * current one streams out, only the first page of every block waits for a
+ * full tR. Sequential cache reads are not continued over a block boundary.
+ */
+typedef int (*progskeet_nand_batch_fn)(void* ctx, const uint32_t first, const uint32_t count);
+
+static int progskeet_nand_read_batched_run(struct progskeet_handle* handle, const struct progskeet_nand_info* nand,
+                                           const uint32_t page, const uint32_t count, char* buf,
+                                           progskeet_nand_batch_fn batch, void* ctx)
+{
+    const size_t page_len = nand ? nand->page_size + nand->spare_size : 0;
+    uint32_t i, cur, first = 0;
+    int start, last;
+    int res;
+
+    if (!handle || !nand || !buf)
+        return -1;
+
+    if (!progskeet_nand_check(nand, page, count))
+        return -2;
+
+    if ((res = progskeet_nand_select(handle, nand)) < 0)
+        return res;
+
+    for (i = 0; i < count && (res = progskeet_check_cancel(handle)) == 0; i++) {
+        cur = page + i;
+        start = (i == 0) || (cur % nand->pages_per_block == 0);
+        last = (i + 1 == count) || ((cur + 1) % nand->pages_per_block == 0);
+
+        if (start || !nand->cache_read) {
+            progskeet_nand_cmd(handle, nand, NAND_CMD_READ);
+            progskeet_nand_addr(handle, nand, 0, nand->col_cycles, progskeet_nand_row(nand, cur), nand->row_cycles);
+            progskeet_nand_cmd(handle, nand, NAND_CMD_READ_START);
+
+            if ((res = progskeet_nand_wait(handle, nand, nand->read_us)) < 0)
+                goto fail;
+        }
+
+        /* Moves this page to the cache register and starts loading the next one, or ends the sequence */
+        if (nand->cache_read && !(start && last)) {
+            progskeet_nand_cmd(handle, nand, last ? NAND_CMD_READ_CACHE_END : NAND_CMD_READ_CACHE_SEQ);
+
+            if ((res = progskeet_nand_wait(handle, nand, nand->read_us)) < 0)
+                goto fail;
+        }
+
+        if ((res = progskeet_read_uncached(handle, buf + (size_t)i * page_len, page_len)) < 0)
+            goto fail;
+
+        progskeet_progress_add(handle, page_len);
+
+        if ((i + 1) % NAND_PAGES_PER_SYNC == 0) {
+            if ((res = progskeet_sync(handle)) < 0)
+                goto fail;
+
+            if (batch && (res = batch(ctx, first, i + 1 - first)) < 0)
+                goto fail;
+
+            first = i + 1;
+        }
+    }
+
+    if (res < 0)
+        goto fail;
+
+    progskeet_nand_deselect(handle, nand);
+
+    if ((res = progskeet_sync(handle)) < 0)
+        return res;
+
+    if (batch && i > first)
+        return batch(ctx, first, i - first);
+
+    return 0;
+
+fail:
+    /* Whatever failed, CE# must not stay asserted */
+    progskeet_nand_deselect(handle, nand);
+    progskeet_sync(handle);
+
+    return res;
+}
+
+static int progskeet_nand_read_batched(struct progskeet_handle* handle, const struct progskeet_nand_info* nand,
+                                       const uint32_t page, const uint32_t count, char* buf,
+                                       progskeet_nand_batch_fn batch, void* ctx)
+{
+    int res;
+
+    if (!handle || !nand)
+        return -1;
+
+    progskeet_progress_begin(handle, (uint64_t)count * (nand->page_size + nand->spare_size));
+    res = progskeet_nand_read_batched_run(handle, nand, page, count, buf, batch, ctx);
+    progskeet_progress_end(handle);
+
+    return res;
+}
+
+int progskeet_nand_read(struct progskeet_handle* handle, const struct progskeet_nand_info* nand,
+                        const uint32_t page, const uint32_t count, char* buf)
+{
+    return progskeet_nand_read_batched(handle, nand, page, count, buf, NULL, NULL);
+}
+
+struct progskeet_nand_ecc_job
+{
+    const struct progskeet_ecc* ecc;
+    const struct progskeet_nand_info* nand;
+    char* page;
+    struct progskeet_ecc_stats* stats;
+};
+
+struct progskeet_nand_ecc_ctx
+{
+    struct progskeet_workers* workers;
+    struct progskeet_nand_ecc_job* jobs;
+};
+
+static void progskeet_nand_ecc_work(void* arg)
+{
+    struct progskeet_nand_ecc_job* job = (struct progskeet_nand_ecc_job*)arg;
+
+    progskeet_ecc_correct_page(job->ecc, job->page, job->nand->page_size, job->nand->spare_size, job->stats);
+}
+
+/* Hands the pages of the last sync to the workers while the next ones are transferred */
+static int progskeet_nand_ecc_batch(void* ctx, const uint32_t first, const uint32_t count)
+{
+    struct progskeet_nand_ecc_ctx* ecc_ctx = (struct progskeet_nand_ecc_ctx*)ctx;
+    uint32_t i;
+    int res;
+
+    for (i = first; i < first + count; i++) {
+        if ((res = progskeet_workers_submit(ecc_ctx->workers, progskeet_nand_ecc_work, &ecc_ctx->jobs[i])) < 0)
+            return res;
+    }
+
+    return 0;
+}
+
+int progskeet_nand_read_ecc(struct progskeet_handle* handle, const struct progskeet_nand_info* nand,
+                            const struct progskeet_ecc* ecc, const uint32_t page, const uint32_t count,
+                            char* buf, struct progskeet_ecc_stats* stats)
+{
+    const size_t page_len = nand ? nand->page_size + nand->spare_size : 0;
+    struct progskeet_nand_ecc_ctx ctx;
+    uint32_t i;
+    int res;
+
+    if (!handle || !nand || !ecc || !buf || !stats)
+        return -1;
+
+    if ((ctx.jobs = (struct progskeet_nand_ecc_job*)malloc(count * sizeof(struct progskeet_nand_ecc_job))) == NULL)
+        return -3;
+
+    for (i = 0; i < count; i++) {
+        ctx.jobs[i].ecc = ecc;
+        ctx.jobs[i].nand = nand;
+        ctx.jobs[i].page = buf + (size_t)i * page_len;
+        ctx.jobs[i].stats = &stats[i];
+        memset(&stats[i], 0, sizeof(struct progskeet_ecc_stats));
+    }
+
+    if ((ctx.workers = progskeet_workers_create(progskeet_workers_cpu_count())) == NULL) {
+        free(ctx.jobs);
+        return -3;
+    }
+
+    res = progskeet_nand_read_batched(handle, nand, page, count, buf, progskeet_nand_ecc_batch, &ctx);
+
+    progskeet_workers_destroy(ctx.workers);
+    free(ctx.jobs);
+
+    if (res < 0)
+        return res;
+
+    for (i = 0; i < count; i++) {
+        if (stats[i].failed)
+            return -5;
+    }
+
+    return 0;
+}
+
+static int progskeet_nand_check_status(struct progskeet_handle* handle, const uint16_t* status, const uint32_t count)
+{
+    uint32_t i;
+
+    for (i = 0; i < count; i++) {
+        if (status[i] & NAND_STATUS_FAIL) {
+            progskeet_log(handle, progskeet_log_level_error, "NAND program or erase failed\n");
+            return -5;
+        }
+    }
+
+    return 0;
+}
+
+static int progskeet_nand_is_erased(const char* buf, const size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if ((uint8_t)buf[i] != 0xFF)
+            return 0;
+    }
+
+    return 1;
+}
+
+static int progskeet_nand_program_run(struct progskeet_handle* handle, const struct progskeet_nand_info* nand,
+                                      const uint32_t page, const uint32_t count, const char* buf)
+{
+    const size_t page_len = nand ? nand->page_size + nand->spare_size : 0;
+    uint16_t status[NAND_PAGES_PER_SYNC];
+    uint32_t pending = 0;
+    uint32_t i;
+    int res;
+
+    if (!handle || !nand || !buf)
+        return -1;
+
+    if (!progskeet_nand_check(nand, page, count))
+        return -2;
+
+    if ((res = progskeet_nand_select(handle, nand)) < 0)
+        return res;
+
+    for (i = 0; i < count && (res = progskeet_check_cancel(handle)) == 0; i++) {
+        progskeet_progress_add(handle, page_len);
+
+        if (progskeet_nand_is_erased(buf + (size_t)i * page_len, page_len))
+            continue;
+
+        if (pending == NAND_PAGES_PER_SYNC || progskeet_tx_free(handle) < page_len + NAND_CMD_OVERHEAD) {
+            if ((res = progskeet_sync(handle)) < 0)
+                goto fail;
+
+            if ((res = progskeet_nand_check_status(handle, status, pending)) < 0)
+                goto fail;
+
+            pending = 0;
+        }
+
+        progskeet_nand_cmd(handle, nand, NAND_CMD_PROGRAM);
+        progskeet_nand_addr(handle, nand, 0, nand->col_cycles, progskeet_nand_row(nand, page + i), nand->row_cycles);
+
+        if ((res = progskeet_write(handle, buf + (size_t)i * page_len, page_len)) < 0)
+            goto fail;
+
+        progskeet_nand_cmd(handle, nand, NAND_CMD_PROGRAM_START);
+
+        if ((res = progskeet_nand_wait(handle, nand, nand->program_us)) < 0)
+            goto fail;
+
+        if ((res = progskeet_nand_status(handle, nand, &status[pending++])) < 0)
+            goto fail;
+    }
+
+    if (res < 0)
+        goto fail;
+
+    progskeet_nand_deselect(handle, nand);
+
+    if ((res = progskeet_sync(handle)) < 0)
+        return res;
+
+    return progskeet_nand_check_status(handle, status, pending);
+
+fail:
+    /* Whatever failed, CE# must not stay asserted */
+    progskeet_nand_deselect(handle, nand);
+    progskeet_sync(handle);
+
+    return res;
+}
+
+int progskeet_nand_program(struct progskeet_handle* handle, const struct progskeet_nand_info* nand,
+                           const uint32_t page, const uint32_t count, const char* buf)
+{
+    int res;
+
+    if (!handle || !nand)
+        return -1;
+
+    progskeet_progress_begin(handle, (uint64_t)count * (nand->page_size + nand->spare_size));
+    res = progskeet_nand_program_run(handle, nand, page, count, buf);
+    progskeet_progress_end(handle);
+
+    return res;
+}
+
+int progskeet_nand_erase(struct progskeet_handle* handle, const struct progskeet_nand_info* nand,
+                         const uint32_t block, const uint32_t count)
+{
+    uint16_t status[NAND_PAGES_PER_SYNC];
+    uint32_t pending = 0;
+    uint32_t i;
+    int res;
+
+    if (!handle || !nand)
+        return -1;
+
+    if (!progskeet_nand_check(nand, block * nand->pages_per_block, count * nand->pages_per_block))
+        return -2;
+
+    if ((res = progskeet_nand_select(handle, nand)) < 0)
+        return res;
+
+    for (i = 0; i < count && (res = progskeet_check_cancel(handle)) == 0; i++) {
+        if (pending == NAND_PAGES_PER_SYNC) {
+            if ((res = progskeet_sync(handle)) < 0)
+                goto fail;
+
+            if ((res = progskeet_nand_check_status(handle, status, pending)) < 0)
+                goto fail;
+
+            pending = 0;
+        }
+
+        progskeet_nand_cmd(handle, nand, NAND_CMD_ERASE);
+        progskeet_nand_addr(handle, nand, 0, 0, progskeet_nand_row(nand, (block + i) * nand->pages_per_block), nand->row_cycles);
+        progskeet_nand_cmd(handle, nand, NAND_CMD_ERASE_START);
+
+        if ((res = progskeet_nand_wait(handle, nand, nand->erase_us)) < 0)
+            goto fail;
+
+        if ((res = progskeet_nand_status(handle, nand, &status[pending++])) < 0)
+            goto fail;
+    }
+
+    if (res < 0)
+        goto fail;
+
+    progskeet_nand_deselect(handle, nand);
+
+    if ((res = progskeet_sync(handle)) < 0)
+        return res;
+
+    return progskeet_nand_check_status(handle, status, pending);
+
+fail:
+    /* Whatever failed, CE# must not stay asserted */
+    progskeet_nand_deselect(handle, nand);
+    progskeet_sync(handle);
+
+    return res;
+}
@@ -0,0 +1,906 @@
+/*
+ * libprogskeet - ProgSkeet library
+ * Copyright (C) 2012 Axel Gembe <axel@gembe.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * ProgSkeet NOR flash functions
+ *
+ * All addresses are bus addresses like for progskeet_set_addr, so words
+ * on a 16 bit bus and bytes on an 8 bit bus. Completion is waited for on
+ * the device with WAIT_GPIO on RY/BY#, so whole erase and program jobs
+ * go out as one command stream.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "progskeet.h"
+#include "progskeet_private.h"
+
+/* CFI query offsets, in words */
+#define CFI_QRY                     0x10
+#define CFI_CMD_SET                 0x13
+#define CFI_TYP_WORD_PROGRAM        0x1F
+#define CFI_TYP_BUFFER_PROGRAM      0x20
+#define CFI_TYP_BLOCK_ERASE         0x21
+#define CFI_TYP_CHIP_ERASE          0x22
+#define CFI_MAX_WORD_PROGRAM        0x23
+#define CFI_MAX_BUFFER_PROGRAM      0x24
+#define CFI_MAX_BLOCK_ERASE         0x25
+#define CFI_MAX_CHIP_ERASE          0x26
+#define CFI_DEVICE_SIZE             0x27
+#define CFI_INTERFACE               0x28
+#define CFI_WRITE_BUFFER            0x2A
+#define CFI_NUM_REGIONS             0x2C
+#define CFI_REGIONS                 0x2D
+#define CFI_END                     0x40
+
+/* Autoselect offsets, in words, the block status one is relative to the block */
+#define NOR_ID_MANUFACTURER         0x00
+#define NOR_ID_DEVICE               0x01
+#define NOR_ID_BLOCK_STATUS         0x02
+#define NOR_ID_DEVICE2              0x0E
+#define NOR_ID_DEVICE3              0x0F
+#define NOR_ID_WORDS                4
+
+/* Cached CFI tables, "PSNC" version manufacturer device[3] cfi[CFI_END], little endian */
+#define NOR_CACHE_MAGIC             "PSNC"
+#define NOR_CACHE_VERSION           1
+#define NOR_CACHE_LEN               (8 + NOR_ID_WORDS * 2 + CFI_END)
+
+/* Copy of the table of the chip probed last on the station */
+#define NOR_CACHE_LAST              "nor-last.cfi"
+
+/* Command sets */
+#define CFI_CMD_SET_INTEL_EXT       0x0001
+#define CFI_CMD_SET_AMD             0x0002
+#define CFI_CMD_SET_INTEL_STD       0x0003
+
+/* Command addresses for x16 and x8 buses */
+#define NOR_ADDR_UNLOCK1            0x555
+#define NOR_ADDR_UNLOCK2            0x2AA
+#define NOR_ADDR_CFI                0x55
+#define NOR_ADDR_UNLOCK1_X8         0xAAA
+#define NOR_ADDR_UNLOCK2_X8         0x555
+#define NOR_ADDR_CFI_X8             0xAA
+
+/* Longest wait that is still done with NOPs when there is no RY/BY# */
+#define NOR_NOP_WAIT_MAX_US         1000
+
+/* Enough for any command sequence besides the data itself */
+#define NOR_CMD_OVERHEAD            128
+
+#define NOR_MS_TO_US(ms) ((ms) >= 0xFFFFFFFF / 1000 ? 0xFFFFFFFF : (ms) * 1000)
+
+#define NOR_UNLOCK1(nor) ((nor)->bus_width == 1 ? NOR_ADDR_UNLOCK1_X8 : NOR_ADDR_UNLOCK1)
+#define NOR_UNLOCK2(nor) ((nor)->bus_width == 1 ? NOR_ADDR_UNLOCK2_X8 : NOR_ADDR_UNLOCK2)
+
+static int progskeet_nor_is_intel(const struct progskeet_nor_info* nor)
+{
+    return nor->cmd_set == CFI_CMD_SET_INTEL_EXT || nor->cmd_set == CFI_CMD_SET_INTEL_STD;
+}
+
+static int progskeet_nor_cmd(struct progskeet_handle* handle, const uint32_t addr, const uint16_t data)
+{
+    int res;
+
+    if ((res = progskeet_set_addr(handle, addr, 0)) < 0)
+        return res;
+
+    return progskeet_set_data(handle, data);
+}
+
+static int progskeet_nor_unlock(struct progskeet_handle* handle, const struct progskeet_nor_info* nor)
+{
+    int res;
+
+    if ((res = progskeet_nor_cmd(handle, NOR_UNLOCK1(nor), 0xAA)) < 0)
+        return res;
+
+    return progskeet_nor_cmd(handle, NOR_UNLOCK2(nor), 0x55);
+}
+
+static int progskeet_nor_sync_if_full(struct progskeet_handle* handle, const size_t needed)
+{
+    if (progskeet_tx_free(handle) >= needed)
+        return 0;
+
+    return progskeet_sync(handle);
+}
+
+/* Leaves autoselect and CFI query mode for both command sets */
+static void progskeet_nor_reset_queue(struct progskeet_handle* handle)
+{
+    progskeet_set_addr(handle, 0, 0);
+    progskeet_set_data(handle, 0xF0);
+    progskeet_set_data(handle, 0xFF);
+}
+
+/* Queues the CFI query, raw gets the low bytes of the query words from CFI_QRY on */
+static void progskeet_nor_cfi_queue(struct progskeet_handle* handle, const int bus_width, uint8_t* raw)
+{
+    /* Reset to read array for both command sets, then enter CFI query mode */
+    progskeet_nor_reset_queue(handle);
+
+    progskeet_set_addr(handle, bus_width == 1 ? NOR_ADDR_CFI_X8 : NOR_ADDR_CFI, 0);
+    progskeet_set_data(handle, 0x98);
+
+    /* On an 8 bit bus the query data is on every even byte */
+    progskeet_set_addr(handle, bus_width == 1 ? CFI_QRY * 2 : CFI_QRY, 1);
+    progskeet_read_uncached(handle, (char*)raw, (CFI_END - CFI_QRY) * 2);
+
+    progskeet_nor_reset_queue(handle);
+}
+
+static int progskeet_nor_cfi_decode(struct progskeet_handle* handle, const uint8_t* raw, uint8_t* cfi)
+{
+    int i;
+
+    memset(cfi, 0, CFI_END);
+    for (i = 0; i < CFI_END - CFI_QRY; i++)
+        cfi[CFI_QRY + i] = raw[i * 2];
+
+    if (cfi[CFI_QRY] != 'Q' || cfi[CFI_QRY + 1] != 'R' || cfi[CFI_QRY + 2] != 'Y') {
+        progskeet_log(handle, progskeet_log_level_error, "No CFI query response\n");
+        return -2;
+    }
+
+    return 0;
+}
+
+int progskeet_nor_cfi_query(struct progskeet_handle* handle, struct progskeet_nor_info* nor)
+{
+    uint8_t raw[(CFI_END - CFI_QRY) * 2];
+    uint8_t cfi[CFI_END];
+    int bus_width;
+    int res;
+
+    if (!handle || !nor)
+        return -1;
+
+    bus_width = (handle->cur_config & PROGSKEET_CFG_16BIT) ? 2 : 1;
+
+    progskeet_nor_cfi_queue(handle, bus_width, raw);
+
+    if ((res = progskeet_sync(handle)) < 0)
+        return res;
+
+    if ((res = progskeet_nor_cfi_decode(handle, raw, cfi)) < 0)
+        return res;
+
+    return progskeet_nor_cfi_parse(cfi, sizeof(cfi), bus_width, nor);
+}
+
+int progskeet_nor_cfi_parse(const uint8_t* cfi, const size_t len, const int bus_width, struct progskeet_nor_info* nor)
+{
+    uint16_t ready_gpio;
+    uint32_t blocks, size;
+    int i;
+
+    if (!cfi || !nor || len < CFI_END)
+        return -1;
+
+    ready_gpio = nor->ready_gpio;
+    memset(nor, 0, sizeof(struct progskeet_nor_info));
+    nor->ready_gpio = ready_gpio;
+
+    nor->bus_width = bus_width;
+    nor->cmd_set = cfi[CFI_CMD_SET] | (cfi[CFI_CMD_SET + 1] << 8);
+    nor->size = (uint32_t)1 << cfi[CFI_DEVICE_SIZE];
+    nor->interface = cfi[CFI_INTERFACE] | (cfi[CFI_INTERFACE + 1] << 8);
+
+    if (cfi[CFI_WRITE_BUFFER] | cfi[CFI_WRITE_BUFFER + 1])
+        nor->write_buffer = (uint32_t)1 << (cfi[CFI_WRITE_BUFFER] | (cfi[CFI_WRITE_BUFFER + 1] << 8));
+
+    /* No buffered write timing means no buffered write */
+    if (cfi[CFI_TYP_BUFFER_PROGRAM] == 0)
+        nor->write_buffer = 0;
+
+    nor->word_program_us = (uint32_t)1 << (cfi[CFI_TYP_WORD_PROGRAM] + cfi[CFI_MAX_WORD_PROGRAM]);
+    nor->buffer_program_us = cfi[CFI_TYP_BUFFER_PROGRAM] ?
+                             (uint32_t)1 << (cfi[CFI_TYP_BUFFER_PROGRAM] + cfi[CFI_MAX_BUFFER_PROGRAM]) : 0;
+    nor->block_erase_ms = (uint32_t)1 << (cfi[CFI_TYP_BLOCK_ERASE] + cfi[CFI_MAX_BLOCK_ERASE]);
+    nor->chip_erase_ms = cfi[CFI_TYP_CHIP_ERASE] ?
+                         (uint32_t)1 << (cfi[CFI_TYP_CHIP_ERASE] + cfi[CFI_MAX_CHIP_ERASE]) : 0;
+
+    nor->nregions = cfi[CFI_NUM_REGIONS];
+    if (nor->nregions > PROGSKEET_NOR_MAX_REGIONS)
+        nor->nregions = PROGSKEET_NOR_MAX_REGIONS;
+
+    for (i = 0; i < nor->nregions; i++) {
+        blocks = (cfi[CFI_REGIONS + i * 4] | (cfi[CFI_REGIONS + i * 4 + 1] << 8)) + 1;
+        size = (cfi[CFI_REGIONS + i * 4 + 2] | (cfi[CFI_REGIONS + i * 4 + 3] << 8)) * 256;
+
+        nor->regions[i].blocks = blocks;
+        nor->regions[i].block_size = size ? size : 128;
+    }
+
+    return 0;
+}
+
+int progskeet_nor_block_at(const struct progskeet_nor_info* nor, const uint32_t addr, uint32_t* start, uint32_t* len)
+{
+    uint32_t base = 0;
+    uint32_t region_len;
+    uint32_t block_len;
+    int i;
+
+    if (!nor)
+        return -1;
+
+    for (i = 0; i < nor->nregions; i++) {
+        block_len = nor->regions[i].block_size / nor->bus_width;
+        region_len = block_len * nor->regions[i].blocks;
+
+        if (addr < base + region_len) {
+            if (start)
+                *start = base + ((addr - base) / block_len) * block_len;
+            if (len)
+                *len = block_len;
+            return 0;
+        }
+
+        base += region_len;
+    }
+
+    return -2;
+}
+
+static uint16_t progskeet_nor_word(const uint8_t* raw, const int bus_width)
+{
+    return bus_width == 1 ? raw[0] : (uint16_t)(raw[0] | (raw[1] << 8));
+}
+
+/* Bus address of an autoselect word in the block at base */
+static uint32_t progskeet_nor_id_addr(const int bus_width, const uint32_t base, const uint32_t offset)
+{
+    return base + (bus_width == 1 ? offset * 2 : offset);
+}
+
+static uint32_t progskeet_nor_count_blocks(const struct progskeet_nor_info* nor)
+{
+    uint32_t blocks = 0;
+    int i;
+
+    for (i = 0; i < nor->nregions; i++)
+        blocks += nor->regions[i].blocks;
+
+    return blocks > PROGSKEET_NOR_MAX_BLOCKS ? PROGSKEET_NOR_MAX_BLOCKS : blocks;
+}
+
+/*
+ * Queues the ID reads in autoselect mode, the status of every block of
+ * layout if there is one and the CFI query if raw_cfi is given. Intel
+ * parts ignore the unlock cycles and go to read identifier mode on the
+ * 0x90 all the same.
+ */
+static void progskeet_nor_probe_queue(struct progskeet_handle* handle, const int bus_width, const struct progskeet_nor_info* layout,
+                                      uint8_t* ids, uint8_t* status, uint8_t* raw_cfi)
+{
+    static const uint32_t id_offsets[NOR_ID_WORDS] = {
+        NOR_ID_MANUFACTURER, NOR_ID_DEVICE, NOR_ID_DEVICE2, NOR_ID_DEVICE3
+    };
+    struct progskeet_nor_info amd;
+    uint32_t base, block_len, n;
+    uint32_t j;
+    int i;
+
+    memset(&amd, 0, sizeof(amd));
+    amd.bus_width = bus_width;
+
+    progskeet_nor_reset_queue(handle);
+    progskeet_nor_unlock(handle, &amd);
+    progskeet_nor_cmd(handle, NOR_UNLOCK1(&amd), 0x90);
+
+    for (i = 0; i < NOR_ID_WORDS; i++) {
+        progskeet_set_addr(handle, progskeet_nor_id_addr(bus_width, 0, id_offsets[i]), 0);
+        progskeet_read_uncached(handle, (char*)ids + i * 2, bus_width);
+    }
+
+    for (i = 0, n = 0, base = 0; layout && i < layout->nregions; i++) {
+        block_len = layout->regions[i].block_size / layout->bus_width;
+
+        for (j = 0; j < layout->regions[i].blocks && n < PROGSKEET_NOR_MAX_BLOCKS; j++, n++, base += block_len) {
+            progskeet_set_addr(handle, progskeet_nor_id_addr(bus_width, base, NOR_ID_BLOCK_STATUS), 0);
+            progskeet_read_uncached(handle, (char*)status + n * 2, bus_width);
+        }
+    }
+
+    progskeet_nor_reset_queue(handle);
+
+    if (raw_cfi)
+        progskeet_nor_cfi_queue(handle, bus_width, raw_cfi);
+}
+
+static int progskeet_nor_ids_equal(const struct progskeet_nor_id* a, const struct progskeet_nor_id* b)
+{
+    return a->manufacturer == b->manufacturer && a->device[0] == b->device[0] &&
+           a->device[1] == b->device[1] && a->device[2] == b->device[2];
+}
+
+static int progskeet_nor_cache_load(const char* path, struct progskeet_nor_id* id, uint8_t* cfi)
+{
+    uint8_t buf[NOR_CACHE_LEN];
+    size_t got;
+    FILE* fp;
+    int i;
+
+    if ((fp = fopen(path, "rb")) == NULL)
+        return -2;
+
+    got = fread(buf, 1, sizeof(buf), fp);
+    fclose(fp);
+
+    if (got != sizeof(buf) || memcmp(buf, NOR_CACHE_MAGIC, 4) != 0 ||
+        (buf[4] | (buf[5] << 8) | (buf[6] << 16) | ((uint32_t)buf[7] << 24)) != NOR_CACHE_VERSION)
+        return -2;
+
+    id->manufacturer = buf[8] | (buf[9] << 8);
+    for (i = 0; i < 3; i++)
+        id->device[i] = buf[10 + i * 2] | (buf[11 + i * 2] << 8);
+
+    memcpy(cfi, buf + 8 + NOR_ID_WORDS * 2, CFI_END);
+
+    return 0;
+}
+
+static int progskeet_nor_cache_store(struct progskeet_handle* handle, const char* path, const struct progskeet_nor_id* id,
+                                     const uint8_t* cfi)
+{
+    uint8_t buf[NOR_CACHE_LEN];
+    char tmppath[1024];
+    FILE* fp;
+    int ok;
+    int i;
+
+    memcpy(buf, NOR_CACHE_MAGIC, 4);
+    buf[4] = NOR_CACHE_VERSION;
+    buf[5] = buf[6] = buf[7] = 0;
+
+    buf[8] = id->manufacturer & 0xFF;
+    buf[9] = id->manufacturer >> 8;
+    for (i = 0; i < 3; i++) {
+        buf[10 + i * 2] = id->device[i] & 0xFF;
+        buf[11 + i * 2] = id->device[i] >> 8;
+    }
+
+    memcpy(buf + 8 + NOR_ID_WORDS * 2, cfi, CFI_END);
+
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+
+    if ((fp = fopen(tmppath, "wb")) == NULL) {
+        progskeet_log(handle, progskeet_log_level_error, "Failed to create %s\n", tmppath);
+        return -4;
+    }
+
+    ok = fwrite(buf, 1, sizeof(buf), fp) == sizeof(buf);
+    ok = (fclose(fp) == 0) && ok;
+
+    /* Replace the old table only once the new one is complete, rename does it atomically on POSIX */
+#ifdef WIN32
+    if (ok)
+        remove(path);
+#endif /* WIN32 */
+    if (!ok || rename(tmppath, path) != 0) {
+        progskeet_log(handle, progskeet_log_level_error, "Failed to write %s\n", path);
+        remove(tmppath);
+        return -4;
+    }
+
+    return 0;
+}
+
+static void progskeet_nor_cache_path(const char* dir, const struct progskeet_nor_id* id, char* path, const size_t pathlen)
+{
+    snprintf(path, pathlen, "%s/nor-%04x-%04x%04x%04x.cfi", dir,
+             id->manufacturer, id->device[0], id->device[1], id->device[2]);
+}
+
+/* Loads a cached chip, by ID or the last one if id is NULL */
+static int progskeet_nor_cache_find(const char* dir, const struct progskeet_nor_id* id, const int bus_width,
+                                    struct progskeet_nor_chip* chip)
+{
+    char path[1024];
+
+    if (id)
+        progskeet_nor_cache_path(dir, id, path, sizeof(path));
+    else
+        snprintf(path, sizeof(path), "%s/%s", dir, NOR_CACHE_LAST);
+
+    if (progskeet_nor_cache_load(path, &chip->id, chip->cfi) < 0)
+        return -2;
+
+    /* A file for another chip under its name is as good as none */
+    if (id && !progskeet_nor_ids_equal(id, &chip->id))
+        return -2;
+
+    return progskeet_nor_cfi_parse(chip->cfi, sizeof(chip->cfi), bus_width, &chip->nor);
+}
+
+int progskeet_nor_probe(struct progskeet_handle* handle, const char* cache_dir, struct progskeet_nor_chip* chip)
+{
+    uint8_t raw_cfi[(CFI_END - CFI_QRY) * 2];
+    uint8_t ids[NOR_ID_WORDS * 2];
+    struct progskeet_nor_chip found;
+    struct progskeet_nor_chip last;
+    const struct progskeet_nor_chip* hint = NULL;
+    char path[1024];
+    uint8_t* status;
+    int from_chip = 0;
+    int bus_width;
+    uint32_t i;
+    int res;
+
+    if (!handle || !chip)
+        return -1;
+
+    bus_width = (handle->cur_config & PROGSKEET_CFG_16BIT) ? 2 : 1;
+
+    memset(&last, 0, sizeof(last));
+
+    /* The chip probed last is most likely the one in the socket again */
+    if (handle->nor_chip && handle->nor_chip->nor.bus_width == bus_width)
+        hint = handle->nor_chip;
+    else if (cache_dir && progskeet_nor_cache_find(cache_dir, NULL, bus_width, &last) == 0)
+        hint = &last;
+
+    if ((status = (uint8_t*)malloc(PROGSKEET_NOR_MAX_BLOCKS * 2)) == NULL)
+        return -3;
+
+    memset(&found, 0, sizeof(found));
+    found.nor.ready_gpio = chip->nor.ready_gpio;
+
+    /* With a guess the protection of its blocks comes along, without one the CFI table does */
+    if ((res = progskeet_nor_sync_if_full(handle, NOR_CMD_OVERHEAD * 2 + PROGSKEET_NOR_MAX_BLOCKS * 8)) < 0)
+        goto out;
+
+    progskeet_nor_probe_queue(handle, bus_width, hint ? &hint->nor : NULL, ids, status, hint ? NULL : raw_cfi);
+
+    if ((res = progskeet_sync(handle)) < 0)
+        goto out;
+
+    found.id.manufacturer = progskeet_nor_word(ids, bus_width);
+    for (i = 0; i < 3; i++)
+        found.id.device[i] = progskeet_nor_word(ids + (i + 1) * 2, bus_width);
+
+    if (hint && progskeet_nor_ids_equal(&found.id, &hint->id)) {
+        memcpy(found.cfi, hint->cfi, sizeof(found.cfi));
+        found.nor = hint->nor;
+        found.nor.ready_gpio = chip->nor.ready_gpio;
+    } else {
+        /* Another chip than guessed, its table may still be in the cache */
+        if (hint && (!cache_dir || progskeet_nor_cache_find(cache_dir, &found.id, bus_width, &last) < 0)) {
+            progskeet_nor_cfi_queue(handle, bus_width, raw_cfi);
+
+            if ((res = progskeet_sync(handle)) < 0)
+                goto out;
+
+            hint = NULL;
+        }
+
+        if (!hint) {
+            if ((res = progskeet_nor_cfi_decode(handle, raw_cfi, found.cfi)) < 0)
+                goto out;
+
+            from_chip = 1;
+        } else {
+            memcpy(found.cfi, last.cfi, sizeof(found.cfi));
+        }
+
+        if ((res = progskeet_nor_cfi_parse(found.cfi, sizeof(found.cfi), bus_width, &found.nor)) < 0)
+            goto out;
+
+        /* The blocks are only known now, their protection takes another batch */
+        progskeet_nor_probe_queue(handle, bus_width, &found.nor, ids, status, NULL);
+
+        if ((res = progskeet_sync(handle)) < 0)
+            goto out;
+
+        if (cache_dir) {
+            if (from_chip) {
+                progskeet_nor_cache_path(cache_dir, &found.id, path, sizeof(path));
+                progskeet_nor_cache_store(handle, path, &found.id, found.cfi);
+            }
+
+            snprintf(path, sizeof(path), "%s/%s", cache_dir, NOR_CACHE_LAST);
+            progskeet_nor_cache_store(handle, path, &found.id, found.cfi);
+        }
+    }
+
+    found.nblocks = progskeet_nor_count_blocks(&found.nor);
+    for (i = 0; i < found.nblocks; i++) {
+        /* Only the low bit is defined, the rest may be anything */
+        if (status[i * 2] & 0x01) {
+            found.protect[i / 8] |= 1 << (i % 8);
+            found.nprotected++;
+        }
+    }
+
+    if (!handle->nor_chip && (handle->nor_chip = (struct progskeet_nor_chip*)malloc(sizeof(struct progskeet_nor_chip))) == NULL) {
+        res = -3;
+        goto out;
+    }
+
+    *handle->nor_chip = found;
+    *chip = found;
+
+out:
+    free(status);
+
+    return res;
+}
+
+int progskeet_nor_probed(struct progskeet_handle* handle, struct progskeet_nor_chip* chip)
+{
+    if (!handle || !chip)
+        return -1;
+
+    if (!handle->nor_chip)
+        return -2;
+
+    *chip = *handle->nor_chip;
+
+    return 0;
+}
+
+int progskeet_nor_status_start(struct progskeet_handle* handle, const struct progskeet_nor_info* nor,
+                               const uint32_t addr, uint16_t* status)
+{
+    int res;
+
+    if (!handle || !nor || !status)
+        return -1;
+
+    status[0] = status[1] = 0;
+
+    if (progskeet_nor_is_intel(nor)) {
+        if ((res = progskeet_nor_cmd(handle, addr, 0x70)) < 0)
+            return res;
+
+        if ((res = progskeet_set_addr(handle, addr, 0)) < 0)
+            return res;
+
+        return progskeet_read_uncached(handle, (char*)&status[0], nor->bus_width);
+    }
+
+    if ((res = progskeet_set_addr(handle, addr, 0)) < 0)
+        return res;
+
+    if ((res = progskeet_read_uncached(handle, (char*)&status[0], nor->bus_width)) < 0)
+        return res;
+
+    return progskeet_read_uncached(handle, (char*)&status[1], nor->bus_width);
+}
+
+int progskeet_nor_status_ready(const struct progskeet_nor_info* nor, const uint16_t* status)
+{
+    /* DQ6 stops toggling on AMD parts, SR.7 is set on Intel parts */
+    if (progskeet_nor_is_intel(nor))
+        return (status[0] & 0x80) != 0;
+
+    return ((status[0] ^ status[1]) & 0x40) == 0;
+}
+
+/* Host side polling for boards without RY/BY# */
+static int progskeet_nor_poll(struct progskeet_handle* handle, const struct progskeet_nor_info* nor,
+                              const uint32_t addr, const uint32_t max_us)
+{
+    uint16_t status[2];
+    uint32_t polls;
+    int res;
+
+    /* Every poll is at least a USB microframe */
+    for (polls = 0; polls <= max_us / 125; polls++) {
+        if ((res = progskeet_nor_status_start(handle, nor, addr, status)) < 0)
+            return res;
+
+        if ((res = progskeet_sync(handle)) < 0)
+            return res;
+
+        if (progskeet_nor_status_ready(nor, status))
+            return 0;
+    }
+
+    progskeet_log(handle, progskeet_log_level_error, "Timeout waiting for the flash\n");
+
+    return -2;
+}
+
+int progskeet_nor_wait_ready(struct progskeet_handle* handle, const struct progskeet_nor_info* nor,
+                             const uint32_t addr, const uint32_t max_us)
+{
+    int res;
+
+    if (!handle || !nor)
+        return -1;
+
+    if (!nor->ready_gpio) {
+        if (max_us <= NOR_NOP_WAIT_MAX_US)
+            return progskeet_wait_us(handle, max_us);
+
+        return progskeet_nor_poll(handle, nor, addr, max_us);
+    }
+
+    if ((res = progskeet_wait_ns(handle, PROGSKEET_NOR_BUSY_DELAY_NS)) < 0)
+        return res;
+
+    return progskeet_wait_gpio(handle, nor->ready_gpio, nor->ready_gpio);
+}
+
+int progskeet_nor_erase_block_start(struct progskeet_handle* handle, const struct progskeet_nor_info* nor, const uint32_t addr)
+{
+    uint32_t start, len;
+    int res;
+
+    if (!handle || !nor)
+        return -1;
+
+    if (progskeet_nor_block_at(nor, addr, &start, &len) < 0)
+        return -2;
+
+    if (progskeet_nor_is_intel(nor)) {
+        if ((res = progskeet_nor_cmd(handle, start, 0x20)) < 0)
+            return res;
+
+        res = progskeet_nor_cmd(handle, start, 0xD0);
+    } else {
+        if ((res = progskeet_nor_unlock(handle, nor)) < 0)
+            return res;
+
+        if ((res = progskeet_nor_cmd(handle, NOR_UNLOCK1(nor), 0x80)) < 0)
+            return res;
+
+        if ((res = progskeet_nor_unlock(handle, nor)) < 0)
+            return res;
+
+        res = progskeet_nor_cmd(handle, start, 0x30);
+    }
+
+    progskeet_cache_invalidate(handle, start, len);
+
+    return res;
+}
+
+int progskeet_nor_read_array(struct progskeet_handle* handle, const struct progskeet_nor_info* nor, const uint32_t addr)
+{
+    if (!handle || !nor)
+        return -1;
+
+    /* AMD parts go back to read array by themselves */
+    if (!progskeet_nor_is_intel(nor))
+        return 0;
+
+    return progskeet_nor_cmd(handle, addr, 0xFF);
+}
+
+int progskeet_nor_program_start(struct progskeet_handle* handle, const struct progskeet_nor_info* nor,
+                                const uint32_t addr, const char* buf, const size_t words)
+{
+    uint32_t start;
+    int res;
+
+    if (!handle || !nor || !buf || words < 1)
+        return -1;
+
+    if (progskeet_nor_block_at(nor, addr, &start, NULL) < 0)
+        return -2;
+
+    /* Word program */
+    if (nor->write_buffer == 0 || words == 1) {
+        if (words != 1)
+            return -3;
+
+        if (progskeet_nor_is_intel(nor)) {
+            if ((res = progskeet_nor_cmd(handle, addr, 0x40)) < 0)
+                return res;
+        } else {
+            if ((res = progskeet_nor_unlock(handle, nor)) < 0)
+                return res;
+
+            if ((res = progskeet_nor_cmd(handle, NOR_UNLOCK1(nor), 0xA0)) < 0)
+                return res;
+        }
+
+        if ((res = progskeet_set_addr(handle, addr, 0)) < 0)
+            return res;
+
+        return progskeet_write(handle, buf, nor->bus_width);
+    }
+
+    if (words > nor->write_buffer / nor->bus_width)
+        return -3;
+
+    /* Write to buffer, word count, data, program buffer to flash */
+    if (progskeet_nor_is_intel(nor)) {
+        if ((res = progskeet_nor_cmd(handle, start, 0xE8)) < 0)
+            return res;
+
+        /* Buffer available shows up on RY/BY# as well */
+        if ((res = progskeet_nor_wait_ready(handle, nor, start, nor->buffer_program_us)) < 0)
+            return res;
+    } else {
+        if ((res = progskeet_nor_unlock(handle, nor)) < 0)
+            return res;
+
+        if ((res = progskeet_nor_cmd(handle, start, 0x25)) < 0)
+            return res;
+    }
+
+    if ((res = progskeet_nor_cmd(handle, start, (uint16_t)(words - 1))) < 0)
+        return res;
+
+    if ((res = progskeet_set_addr(handle, addr, 1)) < 0)
+        return res;
+
+    if ((res = progskeet_write(handle, buf, words * nor->bus_width)) < 0)
+        return res;
+
+    return progskeet_nor_cmd(handle, start, progskeet_nor_is_intel(nor) ? 0xD0 : 0x29);
+}
+
+int progskeet_nor_is_erased(const char* buf, const size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if ((uint8_t)buf[i] != 0xFF)
+            return 0;
+    }
+
+    return 1;
+}
+
+static int progskeet_nor_program_run(struct progskeet_handle* handle, const struct progskeet_nor_info* nor,
+                                     const uint32_t addr, const char* buf, const size_t len)
+{
+    uint32_t buffer_words;
+    uint32_t cur;
+    size_t words, chunk, done;
+    int res;
+
+    if (!handle || !nor || !buf)
+        return -1;
+
+    words = len / nor->bus_width;
+    buffer_words = nor->write_buffer ? nor->write_buffer / nor->bus_width : 1;
+
+    for (done = 0; done < words; done += chunk) {
+        cur = addr + (uint32_t)done;
+
+        /* Buffers may not cross a write buffer boundary */
+        chunk = buffer_words - (cur % buffer_words);
+        if (chunk > words - done)
+            chunk = words - done;
+
+        progskeet_progress_add(handle, chunk * nor->bus_width);
+
+        /* Programming erased words changes nothing */
+        if (progskeet_nor_is_erased(buf + done * nor->bus_width, chunk * nor->bus_width))
+            continue;
+
+        if ((res = progskeet_nor_sync_if_full(handle, chunk * nor->bus_width + NOR_CMD_OVERHEAD)) < 0)
+            return res;
+
+        if ((res = progskeet_nor_program_start(handle, nor, cur, buf + done * nor->bus_width, chunk)) < 0)
+            return res;
+
+        if ((res = progskeet_nor_wait_ready(handle, nor, cur, nor->write_buffer ? nor->buffer_program_us : nor->word_program_us)) < 0)
+            return res;
+    }
+
+    if ((res = progskeet_nor_read_array(handle, nor, addr)) < 0)
+        return res;
+
+    return progskeet_sync(handle);
+}
+
+int progskeet_nor_program(struct progskeet_handle* handle, const struct progskeet_nor_info* nor,
+                          const uint32_t addr, const char* buf, const size_t len)
+{
+    int res;
+
+    if (!handle || !nor || !buf)
+        return -1;
+
+    progskeet_progress_begin(handle, len);
+    res = progskeet_nor_program_run(handle, nor, addr, buf, len);
+    progskeet_progress_end(handle);
+
+    /* The chip is programmed either way, a missing manifest only costs a full readback next time */
+    if (res == 0 && progskeet_manifest_programmed(handle, addr, buf, len) < 0)
+        progskeet_log(handle, progskeet_log_level_error, "Program succeeded but its manifest was not written\n");
+
+    return res;
+}
+
+static int progskeet_nor_erase_run(struct progskeet_handle* handle, const struct progskeet_nor_info* nor,
+                                   const uint32_t addr, const uint32_t len)
+{
+    uint32_t cur, start, block_len;
+    int res;
+
+    if (!handle || !nor)
+        return -1;
+
+    for (cur = addr; cur < addr + len; cur = start + block_len) {
+        if (progskeet_nor_block_at(nor, cur, &start, &block_len) < 0)
+            return -2;
+
+        progskeet_progress_add(handle, (uint64_t)block_len * nor->bus_width);
+
+        if ((res = progskeet_nor_sync_if_full(handle, NOR_CMD_OVERHEAD)) < 0)
+            return res;
+
+        if ((res = progskeet_nor_erase_block_start(handle, nor, start)) < 0)
+            return res;
+
+        if ((res = progskeet_nor_wait_ready(handle, nor, start, NOR_MS_TO_US(nor->block_erase_ms))) < 0)
+            return res;
+
+        if ((res = progskeet_nor_read_array(handle, nor, start)) < 0)
+            return res;
+    }
+
+    return progskeet_sync(handle);
+}
+
+int progskeet_nor_erase(struct progskeet_handle* handle, const struct progskeet_nor_info* nor,
+                        const uint32_t addr, const uint32_t len)
+{
+    int res;
+
+    if (!handle || !nor)
+        return -1;
+
+    progskeet_progress_begin(handle, (uint64_t)len * nor->bus_width);
+    res = progskeet_nor_erase_run(handle, nor, addr, len);
+    progskeet_progress_end(handle);
+
+    return res;
+}
+
+int progskeet_nor_erase_chip(struct progskeet_handle* handle, const struct progskeet_nor_info* nor)
+{
+    int res;
+
+    if (!handle || !nor)
+        return -1;
+
+    /* Intel parts have no chip erase */
+    if (progskeet_nor_is_intel(nor) || nor->chip_erase_ms == 0)
+        return progskeet_nor_erase(handle, nor, 0, nor->size / nor->bus_width);
+
+    if ((res = progskeet_nor_unlock(handle, nor)) < 0)
+        return res;
+
+    if ((res = progskeet_nor_cmd(handle, NOR_UNLOCK1(nor), 0x80)) < 0)
+        return res;
+
+    if ((res = progskeet_nor_unlock(handle, nor)) < 0)
+        return res;
+
+    if ((res = progskeet_nor_cmd(handle, NOR_UNLOCK1(nor), 0x10)) < 0)
+        return res;
+
+    if ((res = progskeet_nor_wait_ready(handle, nor, 0, NOR_MS_TO_US(nor->chip_erase_ms))) < 0)
+        return res;
+
+    progskeet_cache_invalidate_all(handle);
+
+    return progskeet_sync(handle);
+}
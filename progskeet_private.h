@@ -19,12 +19,76 @@
 #ifndef _PROGSKEET_PRIVATE_H
 #define _PROGSKEET_PRIVATE_H
 
+/* Address bits the device counter drives natively */
+#define PROGSKEET_ADDR_BITS 23
+
+/* Upper address bits that can be driven on GPIOs */
+#define PROGSKEET_MAX_BANK_BITS 8
+
+/* Smaller blocks are copied, a transfer of their own costs more than the copy */
+#define PROGSKEET_TXREF_MIN (64 * 1024)
+
+/* Time from the last NOR command cycle until RY/BY# is valid */
+#define PROGSKEET_NOR_BUSY_DELAY_NS 500
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * PRIVATE CONTEXT
+ */
+
+struct progskeet_context
+{
+    /* LibUSB context, NULL for the default context */
+    void* usb;
+
+    progskeet_log_target log_target;
+
+    struct progskeet_config def_config;
+
+    /* Handles opened on this context, guarded by lock */
+    struct progskeet_handle* handles;
+    void* lock;
+
+    progskeet_pollfd_added_cb pollfd_added;
+    progskeet_pollfd_removed_cb pollfd_removed;
+    void* pollfd_user_data;
+};
+
+/* Progress of the long operation running on a handle */
+struct progskeet_progress_state
+{
+    progskeet_progress_cb cb;
+    void* user_data;
+    uint64_t interval_us;
+
+    /* Nested operations report as part of the outermost one */
+    int depth;
+
+    uint64_t total;
+
+    /* Payload done before the sync in flight, moving in it and queued for the next one */
+    uint64_t done;
+    uint64_t in_sync;
+    uint64_t queued;
+
+    uint64_t start_us;
+    uint64_t last_us;
+    uint64_t last_done;
+};
+
 /*
  * PRIVATE HANDLE
  */
 
 struct progskeet_handle
 {
+    /* Context the handle was opened on and the next handle on it */
+    struct progskeet_context* ctx;
+    struct progskeet_handle* ctx_next;
+
     /* LibUSB device handle */
     void* hdev;
 
@@ -32,13 +96,26 @@ struct progskeet_handle
     char* txbuf;
     size_t txlen;
 
+    /* Caller memory sent in place, each one after the first at bytes of txbuf */
+    struct progskeet_txref* txrefs;
+    size_t txref_count;
+    size_t txref_cap;
+
     /* Receive list */
     struct progskeet_rxloc* rxlist;
     size_t rxlen;
 
-    /* Set to 1 to cancel any running operations */
+    /* Set by progskeet_cancel from any thread, read it through progskeet_check_cancel */
     int cancel;
 
+    /* progskeet_time_us after which operations stop, 0 for none */
+    uint64_t deadline_us;
+
+    struct progskeet_progress_state progress;
+
+    /* Transfers of the sync in flight, see progskeet_sync_submit */
+    struct progskeet_xfer* xfer;
+
     /*
      * Device state cache
      */
@@ -46,6 +123,25 @@ struct progskeet_handle
     uint16_t cur_gpio_dir;
     uint8_t cur_config;
 
+    /*
+     * Address the next cycle goes to, as passed to progskeet_set_addr.
+     * When addr_stale is set the device counter differs and the address
+     * has to be sent again before the next cycle.
+     */
+    uint32_t cur_addr;
+    int cur_addr_inc;
+    int addr_stale;
+
+    /*
+     * Bank lines, logical address bit (bank_native_bits + i) is driven
+     * on the GPIO in bank_gpio[i]. Disabled if bank_bits is 0.
+     */
+    uint16_t bank_gpio[PROGSKEET_MAX_BANK_BITS];
+    uint8_t bank_bits;
+    uint8_t bank_native_bits;
+    uint32_t cur_bank;
+    int cur_bank_valid;
+
     /*
      * This gets used to mask and add to the address.
      * It's used for such things as the virtual chip enable
@@ -54,6 +150,15 @@ struct progskeet_handle
     uint32_t addr_mask;
     uint32_t addr_add;
 
+    /* Read-through sector cache, NULL if disabled */
+    struct progskeet_cache* cache;
+
+    /* Where programs record their manifest, NULL if disabled */
+    struct progskeet_manifest_cfg* manifest;
+
+    /* What progskeet_nor_probe found last, NULL before the first probe */
+    struct progskeet_nor_chip* nor_chip;
+
     progskeet_log_target log_target;
 
     struct progskeet_config def_config;
@@ -67,6 +172,9 @@ int progskeet_log(struct progskeet_handle* handle, const enum progskeet_log_leve
 
 int progskeet_log_global(const enum progskeet_log_level level, const char* fmt, ...);
 
+/* Logs to the context target, or the global one if it has none */
+int progskeet_log_context(struct progskeet_context* ctx, const enum progskeet_log_level level, const char* fmt, ...);
+
 /*
  * COMMUNICATION FUNCTIONS
  */
@@ -74,16 +182,54 @@ int progskeet_log_global(const enum progskeet_log_level level, const char* fmt,
 /* Sends until the TX buffer is empty */
 int DLL_API progskeet_sync(struct progskeet_handle* handle);
 
+/* 0 while the running operation may go on, else PROGSKEET_ERR_CANCELLED or PROGSKEET_ERR_DEADLINE */
+int progskeet_check_cancel(struct progskeet_handle* handle);
+
+/* Long operations report their progress between these, the totals are payload bytes */
+void progskeet_progress_begin(struct progskeet_handle* handle, const uint64_t total);
+
+/* Payload bytes that the next sync moves */
+void progskeet_progress_add(struct progskeet_handle* handle, const uint64_t bytes);
+
+void progskeet_progress_end(struct progskeet_handle* handle);
+
+/* Bytes that can still be queued before the next sync */
+size_t DLL_API progskeet_tx_free(struct progskeet_handle* handle);
+
 int DLL_API progskeet_enqueue_tx(struct progskeet_handle* handle, char data);
 
 int DLL_API progskeet_enqueue_tx_buf(struct progskeet_handle* handle, const char* buf, const size_t len);
 
+/*
+ * Queues buf to be sent in place instead of copying it into the TX buffer,
+ * buf has to stay valid and unchanged until the next sync. Small blocks are
+ * copied anyway, a transfer of their own would cost more than the copy.
+ */
+int DLL_API progskeet_enqueue_tx_ref(struct progskeet_handle* handle, const char* buf, const size_t len);
+
+/* Appends len bytes to the TX buffer for the caller to encode into, NULL if they do not fit */
+char* DLL_API progskeet_tx_reserve(struct progskeet_handle* handle, const size_t len);
+
 int DLL_API progskeet_enqueue_rx_buf(struct progskeet_handle* handle, void* addr, size_t len);
 
 /*
  * LOWLEVEL FUNCTIONS
  */
 
+/* Command codes, for engines that build their command streams ahead of time */
+#define PROGSKEET_CMD_GET_GPIO      0x01
+#define PROGSKEET_CMD_SET_ADDR      0x02
+#define PROGSKEET_CMD_WRITE_CYCLE   0x03
+#define PROGSKEET_CMD_READ_CYCLE    0x04
+#define PROGSKEET_CMD_SET_CONFIG    0x05
+#define PROGSKEET_CMD_SET_GPIO      0x06
+#define PROGSKEET_CMD_SET_GPIO_DIR  0x07
+#define PROGSKEET_CMD_WAIT_GPIO     0x08
+#define PROGSKEET_CMD_NOP           0x09
+
+/* SET_ADDR bit that makes the device counter count up after each cycle */
+#define PROGSKEET_ADDR_AUTO_INC     (1 << 23)
+
 int DLL_API progskeet_set_gpio_dir(struct progskeet_handle* handle, const uint16_t dir);
 
 int DLL_API progskeet_set_gpio(struct progskeet_handle* handle, const uint16_t gpio);
@@ -99,6 +245,14 @@ int DLL_API progskeet_deassert_gpio(struct progskeet_handle* handle, const uint1
 
 int DLL_API progskeet_set_addr(struct progskeet_handle* handle, const uint32_t addr, int auto_incr);
 
+/*
+ * Drives the address bits from native_bits up on the GPIOs in gpios, one
+ * GPIO mask per bit. Reads and writes are split at the bank boundaries
+ * and continue in the next bank. The bank lines are kept as outputs and
+ * progskeet_set_gpio leaves them alone. Pass count 0 to disable.
+ */
+int DLL_API progskeet_set_bank_lines(struct progskeet_handle* handle, const uint8_t native_bits, const uint16_t* gpios, const uint8_t count);
+
 int DLL_API progskeet_set_data(struct progskeet_handle* handle, const uint16_t data);
 
 /* Configuration (progskeet_config_set) */
@@ -119,12 +273,167 @@ int DLL_API progskeet_config_set_byte(struct progskeet_handle* handle, uint8_t c
 
 int DLL_API progskeet_write(struct progskeet_handle* handle, const char* buf, const size_t len);
 
+/* Like progskeet_write, but buf is sent in place and has to stay valid and unchanged until the next sync */
+int DLL_API progskeet_write_ref(struct progskeet_handle* handle, const char* buf, const size_t len);
+
+/* progskeet_write_image flags */
+#define PROGSKEET_IMAGE_SWAP        (1 << 0)
+#define PROGSKEET_IMAGE_SKIP_ERASED (1 << 1)
+
+/*
+ * Writes an image from the current address up, encoded on worker threads
+ * and synced as it goes. PROGSKEET_IMAGE_SWAP swaps the bytes of each word
+ * on a 16 bit bus, PROGSKEET_IMAGE_SKIP_ERASED leaves out runs of 0xFF.
+ */
+int DLL_API progskeet_write_image(struct progskeet_handle* handle, const char* buf, const size_t len, const int flags);
+
 int DLL_API progskeet_read(struct progskeet_handle* handle, char* buf, const size_t len);
 
+/* Queues read cycles, never served from the cache */
+int progskeet_read_uncached(struct progskeet_handle* handle, char* buf, const size_t len);
+
 int DLL_API progskeet_write_addr(struct progskeet_handle* handle, uint32_t addr, uint16_t data);
 
 int DLL_API progskeet_read_addr(struct progskeet_handle* handle, uint32_t addr, uint16_t *data);
 
+/*
+ * NOR FLASH FUNCTIONS
+ *
+ * These only queue the command cycles, completion is waited for with
+ * progskeet_nor_wait_ready.
+ */
+
+/* Waits on RY/BY#, or for max_us when there is none */
+int DLL_API progskeet_nor_wait_ready(struct progskeet_handle* handle, const struct progskeet_nor_info* nor,
+                                     const uint32_t addr, const uint32_t max_us);
+
+int DLL_API progskeet_nor_erase_block_start(struct progskeet_handle* handle, const struct progskeet_nor_info* nor, const uint32_t addr);
+
+/* Programs up to one write buffer of words, it may not cross a write buffer boundary */
+int DLL_API progskeet_nor_program_start(struct progskeet_handle* handle, const struct progskeet_nor_info* nor,
+                                        const uint32_t addr, const char* buf, const size_t words);
+
+/* Returns Intel parts to read array mode, AMD parts do that by themselves */
+int DLL_API progskeet_nor_read_array(struct progskeet_handle* handle, const struct progskeet_nor_info* nor, const uint32_t addr);
+
+/* Queues a status read, progskeet_nor_status_ready tells after the sync if the flash is done */
+int DLL_API progskeet_nor_status_start(struct progskeet_handle* handle, const struct progskeet_nor_info* nor,
+                                       const uint32_t addr, uint16_t* status);
+int DLL_API progskeet_nor_status_ready(const struct progskeet_nor_info* nor, const uint16_t* status);
+
+int DLL_API progskeet_nor_is_erased(const char* buf, const size_t len);
+
+/*
+ * FILE FUNCTIONS
+ */
+
+/* Writes len bytes of the file starting at offset, the file is mapped window by window */
+int DLL_API progskeet_write_fd(struct progskeet_handle* handle, int fd, const uint64_t offset, const uint64_t len);
+
+/* Reads len bytes into the file at offset, the file is preallocated and mapped window by window */
+int DLL_API progskeet_read_fd(struct progskeet_handle* handle, int fd, const uint64_t offset, const uint64_t len);
+
+/* Like progskeet_read_fd, but also hashes the data on a worker thread while the next window transfers */
+int DLL_API progskeet_read_fd_hashed(struct progskeet_handle* handle, int fd, const uint64_t offset, const uint64_t len,
+                                     const int hash_flags, struct progskeet_digest* digest);
+
+int DLL_API progskeet_write_file(struct progskeet_handle* handle, const char* path);
+
+int DLL_API progskeet_read_file(struct progskeet_handle* handle, const char* path, const uint64_t len);
+
+int DLL_API progskeet_read_file_hashed(struct progskeet_handle* handle, const char* path, const uint64_t len,
+                                       const int hash_flags, struct progskeet_digest* digest);
+
+/*
+ * CACHE FUNCTIONS
+ */
+
+/* Fetch the next line along with a missed one when reads look sequential */
+#define PROGSKEET_CACHE_PREFETCH    (1 << 0)
+
+/*
+ * Enables the sector cache, line_size is in bytes and has to be a power of two.
+ * Small progskeet_read and progskeet_read_addr calls are then served from the
+ * cache, misses read a whole aligned line right away. Writes and set_data
+ * through the library invalidate the lines they touch, anything else that
+ * changes the flash contents (erase sequences) has to call
+ * progskeet_cache_invalidate.
+ */
+int DLL_API progskeet_cache_enable(struct progskeet_handle* handle, const size_t line_size, const size_t lines, const int flags);
+
+int DLL_API progskeet_cache_disable(struct progskeet_handle* handle);
+
+/* Invalidates every line overlapping len bus words at addr */
+int DLL_API progskeet_cache_invalidate(struct progskeet_handle* handle, const uint32_t addr, const size_t len);
+
+int DLL_API progskeet_cache_invalidate_all(struct progskeet_handle* handle);
+
+int DLL_API progskeet_cache_get_stats(struct progskeet_handle* handle, struct progskeet_cache_stats* stats);
+
+/* Returns 0 if the read was served, 1 if it has to go to the device */
+int progskeet_cache_read(struct progskeet_handle* handle, char* buf, const size_t len);
+
+/*
+ * MANIFEST FUNCTIONS
+ */
+
+/* Writes the manifest for a program that just succeeded, if manifests are enabled */
+int progskeet_manifest_programmed(struct progskeet_handle* handle, const uint32_t addr, const char* image, const size_t len);
+
+/*
+ * HASH FUNCTIONS
+ */
+
+struct progskeet_sha256_ctx
+{
+    uint32_t state[8];
+    uint64_t count;
+    uint8_t buf[64];
+};
+
+struct progskeet_digest_ctx
+{
+    int flags;
+
+    uint32_t crc32c;
+    struct progskeet_sha256_ctx sha256;
+};
+
+/* Uses the SSE4.2 or ARMv8 CRC instructions when available */
+uint32_t DLL_API progskeet_crc32c(uint32_t crc, const void* buf, size_t len);
+
+void DLL_API progskeet_sha256_init(struct progskeet_sha256_ctx* ctx);
+
+void DLL_API progskeet_sha256_update(struct progskeet_sha256_ctx* ctx, const void* data, size_t len);
+
+void DLL_API progskeet_sha256_final(struct progskeet_sha256_ctx* ctx, uint8_t digest[32]);
+
+void DLL_API progskeet_digest_init(struct progskeet_digest_ctx* ctx, int flags);
+
+void DLL_API progskeet_digest_update(struct progskeet_digest_ctx* ctx, const void* data, size_t len);
+
+void DLL_API progskeet_digest_final(struct progskeet_digest_ctx* ctx, struct progskeet_digest* digest);
+
+/*
+ * WORKER FUNCTIONS
+ */
+
+struct progskeet_workers;
+
+typedef void (*progskeet_work_fn)(void* arg);
+
+unsigned int progskeet_workers_cpu_count();
+
+/* Starts count threads, with 0 threads jobs run synchronously in submit */
+struct progskeet_workers* progskeet_workers_create(unsigned int count);
+
+int progskeet_workers_submit(struct progskeet_workers* workers, progskeet_work_fn fn, void* arg);
+
+/* Waits until all submitted jobs have finished */
+int progskeet_workers_wait(struct progskeet_workers* workers);
+
+void progskeet_workers_destroy(struct progskeet_workers* workers);
+
 /* Does nothing by the specified amount, 48 nops are 1us */
 int DLL_API progskeet_nop(struct progskeet_handle* handle, const uint32_t amount);
 
@@ -144,4 +453,11 @@ int DLL_API progskeet_wait_ms(struct progskeet_handle* handle, const uint32_t ms
 /* Waits for the specified amount of seconds */
 int DLL_API progskeet_wait(struct progskeet_handle* handle, const uint32_t seconds);
 
+/* Host side monotonic clock, for timings and deadlines */
+uint64_t progskeet_time_us();
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* _PROGSKEET_PRIVATE_H */
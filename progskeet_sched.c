@@ -0,0 +1,525 @@
+/*
+ * libprogskeet - ProgSkeet library
+ * Copyright (C) 2012 Axel Gembe <axel@gembe.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * ProgSkeet multi die scheduler functions
+ *
+ * Erases are only started and then polled for once per round, so the
+ * other dies keep being programmed or verified in the same command stream
+ * while one of them erases. Programs are interleaved a write buffer at a
+ * time, the data for one die goes out while the others are busy
+ * programming theirs, and each die is only waited for right before its
+ * next command.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "progskeet.h"
+#include "progskeet_private.h"
+
+/* Write buffers per die and round */
+#define SCHED_PROGRAM_STEPS         64
+
+/* Bytes read back per die and round */
+#define SCHED_VERIFY_SLICE          (64 * 1024)
+
+/* Device side delay between polls when no die has anything else to do */
+#define SCHED_IDLE_POLL_US          1000
+
+#define SCHED_CMD_OVERHEAD          128
+
+enum progskeet_sched_phase {
+    progskeet_sched_erase = 0,
+    progskeet_sched_program,
+    progskeet_sched_verify,
+    progskeet_sched_done,
+};
+
+struct progskeet_sched_die
+{
+    struct progskeet_nor_die* die;
+    enum progskeet_sched_phase phase;
+
+    /* Erase: next block, the block that is erasing and when it has to be done */
+    uint32_t erase_next;
+    uint32_t erase_block;
+    int erasing;
+    int erased;
+    time_t erase_deadline;
+    uint16_t status[2];
+
+    /* Program and verify: words done */
+    size_t done;
+    int program_pending;
+    uint32_t pending_addr;
+
+    char* verify_buf;
+    size_t verify_len;
+};
+
+struct progskeet_sched
+{
+    struct progskeet_handle* handle;
+    struct progskeet_sched_die* dies;
+    int count;
+    int selected;
+    uint16_t cs_mask;
+    uint16_t ready_gpio;
+};
+
+static int progskeet_sched_fail(struct progskeet_sched_die* s, const int res)
+{
+    s->die->result = res;
+    s->phase = progskeet_sched_done;
+    s->erasing = 0;
+
+    return res;
+}
+
+static int progskeet_sched_select(struct progskeet_sched* sched, const int idx)
+{
+    struct progskeet_handle* handle = sched->handle;
+    struct progskeet_nor_die* die = sched->dies[idx].die;
+    uint16_t gpio;
+
+    if (sched->selected == idx)
+        return 0;
+
+    handle->addr_mask = die->addr_mask ? die->addr_mask : ~(uint32_t)0;
+    handle->addr_add = die->addr_mask ? die->addr_add : 0;
+    handle->addr_stale = 1;
+
+    sched->selected = idx;
+
+    if (!sched->cs_mask)
+        return 0;
+
+    gpio = (handle->cur_gpio | sched->cs_mask) & ~die->cs_gpio;
+    if (gpio == handle->cur_gpio)
+        return 0;
+
+    return progskeet_set_gpio(handle, gpio);
+}
+
+static int progskeet_sched_sync_if_full(struct progskeet_sched* sched, const size_t needed)
+{
+    if (progskeet_tx_free(sched->handle) >= needed)
+        return 0;
+
+    return progskeet_sync(sched->handle);
+}
+
+static uint32_t progskeet_sched_program_us(const struct progskeet_nor_info* nor)
+{
+    return nor->write_buffer ? nor->buffer_program_us : nor->word_program_us;
+}
+
+/* Waits for the last program of this die, the die has to be selected */
+static int progskeet_sched_program_wait(struct progskeet_sched* sched, struct progskeet_sched_die* s)
+{
+    if (!s->program_pending)
+        return 0;
+
+    s->program_pending = 0;
+
+    return progskeet_nor_wait_ready(sched->handle, &s->die->nor, s->pending_addr, progskeet_sched_program_us(&s->die->nor));
+}
+
+/* Returns a die to read array mode after its erase, the die has to be selected */
+static int progskeet_sched_erase_finish(struct progskeet_sched* sched, struct progskeet_sched_die* s)
+{
+    if (!s->erased)
+        return 0;
+
+    s->erased = 0;
+
+    return progskeet_nor_read_array(sched->handle, &s->die->nor, s->erase_block);
+}
+
+/* Starts the next erase, or moves on to programming when all blocks are done */
+static int progskeet_sched_erase_step(struct progskeet_sched* sched, const int idx)
+{
+    struct progskeet_sched_die* s = &sched->dies[idx];
+    struct progskeet_nor_die* die = s->die;
+    uint32_t start, len;
+    int res;
+
+    if (s->erase_next >= die->erase_addr + die->erase_len) {
+        s->phase = progskeet_sched_program;
+        return 0;
+    }
+
+    if (progskeet_nor_block_at(&die->nor, s->erase_next, &start, &len) < 0)
+        return progskeet_sched_fail(s, -2);
+
+    if ((res = progskeet_sched_sync_if_full(sched, SCHED_CMD_OVERHEAD)) < 0)
+        return res;
+
+    if ((res = progskeet_sched_select(sched, idx)) < 0)
+        return res;
+
+    if ((res = progskeet_sched_erase_finish(sched, s)) < 0)
+        return progskeet_sched_fail(s, res);
+
+    if ((res = progskeet_nor_erase_block_start(sched->handle, &die->nor, start)) < 0)
+        return progskeet_sched_fail(s, res);
+
+    /* The next poll may sample RY/BY# right after the command cycles */
+    if ((res = progskeet_wait_ns(sched->handle, PROGSKEET_NOR_BUSY_DELAY_NS)) < 0)
+        return progskeet_sched_fail(s, res);
+
+    s->erase_block = start;
+    s->erase_next = start + len;
+    s->erasing = 1;
+    s->erase_deadline = time(NULL) + die->nor.block_erase_ms / 1000 + 1;
+
+    return 1;
+}
+
+/* Starts the next non erased write buffer, returns 0 once the image is done */
+static int progskeet_sched_program_step(struct progskeet_sched* sched, const int idx)
+{
+    struct progskeet_sched_die* s = &sched->dies[idx];
+    struct progskeet_nor_die* die = s->die;
+    const int width = die->nor.bus_width;
+    uint32_t buffer_words, cur = 0;
+    size_t words, chunk = 0;
+    int res;
+
+    words = die->program_buf ? die->program_len / width : 0;
+    buffer_words = die->nor.write_buffer ? die->nor.write_buffer / width : 1;
+
+    for (; s->done < words; s->done += chunk) {
+        cur = die->program_addr + (uint32_t)s->done;
+
+        chunk = buffer_words - (cur % buffer_words);
+        if (chunk > words - s->done)
+            chunk = words - s->done;
+
+        if (!progskeet_nor_is_erased(die->program_buf + s->done * width, chunk * width))
+            break;
+    }
+
+    if ((res = progskeet_sched_sync_if_full(sched, (s->done < words ? chunk * width : 0) + SCHED_CMD_OVERHEAD)) < 0)
+        return res;
+
+    if ((res = progskeet_sched_select(sched, idx)) < 0)
+        return res;
+
+    if ((res = progskeet_sched_erase_finish(sched, s)) < 0)
+        return progskeet_sched_fail(s, res);
+
+    if ((res = progskeet_sched_program_wait(sched, s)) < 0)
+        return progskeet_sched_fail(s, res);
+
+    if (s->done >= words) {
+        if ((res = progskeet_nor_read_array(sched->handle, &die->nor, die->program_addr)) < 0)
+            return progskeet_sched_fail(s, res);
+
+        s->done = 0;
+        s->phase = (die->verify && words > 0) ? progskeet_sched_verify : progskeet_sched_done;
+        return 0;
+    }
+
+    if ((res = progskeet_nor_program_start(sched->handle, &die->nor, cur, die->program_buf + s->done * width, chunk)) < 0)
+        return progskeet_sched_fail(s, res);
+
+    s->program_pending = 1;
+    s->pending_addr = cur;
+    s->done += chunk;
+
+    return 1;
+}
+
+/* Queues the next slice of the read back, it is compared after the sync */
+static int progskeet_sched_verify_step(struct progskeet_sched* sched, const int idx)
+{
+    struct progskeet_sched_die* s = &sched->dies[idx];
+    struct progskeet_nor_die* die = s->die;
+    const int width = die->nor.bus_width;
+    size_t len;
+    int res;
+
+    len = die->program_len - s->done * width;
+    if (len > SCHED_VERIFY_SLICE)
+        len = SCHED_VERIFY_SLICE;
+    len -= len % width;
+
+    if (len == 0) {
+        s->phase = progskeet_sched_done;
+        return 0;
+    }
+
+    if (!s->verify_buf && (s->verify_buf = (char*)malloc(SCHED_VERIFY_SLICE)) == NULL)
+        return progskeet_sched_fail(s, -3);
+
+    if ((res = progskeet_sched_sync_if_full(sched, SCHED_CMD_OVERHEAD)) < 0)
+        return res;
+
+    if ((res = progskeet_sched_select(sched, idx)) < 0)
+        return res;
+
+    if ((res = progskeet_set_addr(sched->handle, die->program_addr + (uint32_t)s->done, 1)) < 0)
+        return progskeet_sched_fail(s, res);
+
+    if ((res = progskeet_read_uncached(sched->handle, s->verify_buf, len)) < 0)
+        return progskeet_sched_fail(s, res);
+
+    s->verify_len = len;
+
+    return 1;
+}
+
+static void progskeet_sched_verify_check(struct progskeet_sched* sched, struct progskeet_sched_die* s)
+{
+    struct progskeet_nor_die* die = s->die;
+    const int width = die->nor.bus_width;
+
+    if (s->verify_len == 0)
+        return;
+
+    if (memcmp(s->verify_buf, die->program_buf + s->done * width, s->verify_len) != 0) {
+        progskeet_log(sched->handle, progskeet_log_level_error, "Verify failed on die %d\n", (int)(s - sched->dies));
+        progskeet_sched_fail(s, -5);
+    } else {
+        s->done += s->verify_len / width;
+    }
+
+    s->verify_len = 0;
+}
+
+/* Queues a status read for every erasing die, one GET_GPIO covers all RY/BY# lines */
+static int progskeet_sched_poll_start(struct progskeet_sched* sched, uint16_t* gpio)
+{
+    struct progskeet_sched_die* s;
+    int i;
+    int res;
+
+    if (sched->ready_gpio) {
+        if ((res = progskeet_get_gpio(sched->handle, gpio)) < 0)
+            return res;
+    }
+
+    for (i = 0; i < sched->count; i++) {
+        s = &sched->dies[i];
+
+        if (!s->erasing || s->die->nor.ready_gpio)
+            continue;
+
+        if ((res = progskeet_sched_select(sched, i)) < 0)
+            return res;
+
+        if ((res = progskeet_nor_status_start(sched->handle, &s->die->nor, s->erase_block, s->status)) < 0)
+            return progskeet_sched_fail(s, res);
+    }
+
+    return 0;
+}
+
+static void progskeet_sched_poll_check(struct progskeet_sched* sched, const uint16_t gpio, const time_t now)
+{
+    struct progskeet_sched_die* s;
+    int ready;
+    int i;
+
+    for (i = 0; i < sched->count; i++) {
+        s = &sched->dies[i];
+
+        if (!s->erasing)
+            continue;
+
+        if (s->die->nor.ready_gpio)
+            ready = (gpio & s->die->nor.ready_gpio) == s->die->nor.ready_gpio;
+        else
+            ready = progskeet_nor_status_ready(&s->die->nor, s->status);
+
+        if (ready) {
+            s->erasing = 0;
+            s->erased = 1;
+        } else if (now > s->erase_deadline) {
+            progskeet_log(sched->handle, progskeet_log_level_error, "Timeout erasing die %d\n", i);
+            progskeet_sched_fail(s, -2);
+        }
+    }
+}
+
+static int progskeet_sched_round(struct progskeet_sched* sched)
+{
+    struct progskeet_handle* handle = sched->handle;
+    struct progskeet_sched_die* s;
+    uint16_t gpio = 0;
+    int busy = 0;
+    int work = 0;
+    int step;
+    int i;
+    int res;
+
+    /* Dies whose erase finished start their next one right away */
+    for (i = 0; i < sched->count; i++) {
+        s = &sched->dies[i];
+
+        if (s->phase == progskeet_sched_erase && !s->erasing) {
+            if ((res = progskeet_sched_erase_step(sched, i)) < 0 && s->phase != progskeet_sched_done)
+                return res;
+
+            work |= res > 0;
+        }
+    }
+
+    /* Programs go round robin, one write buffer per die */
+    for (step = 0; step < SCHED_PROGRAM_STEPS; step++) {
+        res = 0;
+
+        for (i = 0; i < sched->count; i++) {
+            s = &sched->dies[i];
+
+            if (s->phase != progskeet_sched_program)
+                continue;
+
+            if ((res = progskeet_sched_program_step(sched, i)) < 0 && s->phase != progskeet_sched_done)
+                return res;
+
+            work |= res > 0;
+            busy |= res > 0;
+        }
+
+        if (!busy)
+            break;
+
+        busy = 0;
+    }
+
+    for (i = 0; i < sched->count; i++) {
+        s = &sched->dies[i];
+
+        if (s->phase != progskeet_sched_verify)
+            continue;
+
+        if ((res = progskeet_sched_verify_step(sched, i)) < 0 && s->phase != progskeet_sched_done)
+            return res;
+
+        work |= res > 0;
+    }
+
+    for (i = 0; i < sched->count; i++)
+        busy |= sched->dies[i].erasing;
+
+    if (busy) {
+        /* Nothing but erases left, pace the polls on the device */
+        if (!work && (res = progskeet_wait_us(handle, SCHED_IDLE_POLL_US)) < 0)
+            return res;
+
+        if ((res = progskeet_sched_poll_start(sched, &gpio)) < 0)
+            return res;
+    }
+
+    if (handle->txlen > 0 && (res = progskeet_sync(handle)) < 0)
+        return res;
+
+    for (i = 0; i < sched->count; i++) {
+        if (sched->dies[i].phase == progskeet_sched_verify)
+            progskeet_sched_verify_check(sched, &sched->dies[i]);
+    }
+
+    if (busy)
+        progskeet_sched_poll_check(sched, gpio, time(NULL));
+
+    return 0;
+}
+
+int progskeet_nor_run_dies(struct progskeet_handle* handle, struct progskeet_nor_die* dies, const int count)
+{
+    struct progskeet_sched sched;
+    uint32_t addr_mask, addr_add;
+    int pending;
+    int res = 0;
+    int i;
+
+    if (!handle || !dies || count < 1)
+        return -1;
+
+    memset(&sched, 0, sizeof(sched));
+
+    if ((sched.dies = (struct progskeet_sched_die*)calloc(count, sizeof(struct progskeet_sched_die))) == NULL)
+        return -3;
+
+    sched.handle = handle;
+    sched.count = count;
+    sched.selected = -1;
+
+    for (i = 0; i < count; i++) {
+        dies[i].result = 0;
+
+        sched.dies[i].die = &dies[i];
+
+        if (dies[i].nor.bus_width < 1 || dies[i].nor.bus_width > 2) {
+            progskeet_sched_fail(&sched.dies[i], -1);
+            continue;
+        }
+
+        sched.dies[i].phase = progskeet_sched_erase;
+        sched.dies[i].erase_next = dies[i].erase_addr;
+
+        sched.cs_mask |= dies[i].cs_gpio;
+        sched.ready_gpio |= dies[i].nor.ready_gpio;
+    }
+
+    addr_mask = handle->addr_mask;
+    addr_add = handle->addr_add;
+
+    /* Chip enables start out deasserted */
+    if (sched.cs_mask) {
+        progskeet_set_gpio_dir(handle, handle->cur_gpio_dir | sched.cs_mask);
+        progskeet_set_gpio(handle, handle->cur_gpio | sched.cs_mask);
+    }
+
+    while ((res = progskeet_check_cancel(handle)) == 0) {
+        pending = 0;
+        for (i = 0; i < count; i++)
+            pending |= sched.dies[i].phase != progskeet_sched_done;
+
+        if (!pending)
+            break;
+
+        if ((res = progskeet_sched_round(&sched)) < 0)
+            break;
+    }
+
+    handle->addr_mask = addr_mask;
+    handle->addr_add = addr_add;
+    handle->addr_stale = 1;
+
+    if (sched.cs_mask)
+        progskeet_set_gpio(handle, handle->cur_gpio | sched.cs_mask);
+
+    if (progskeet_sync(handle) < 0 && res == 0)
+        res = -4;
+
+    for (i = 0; i < count; i++) {
+        free(sched.dies[i].verify_buf);
+
+        if (res == 0 && dies[i].result < 0)
+            res = dies[i].result;
+    }
+
+    free(sched.dies);
+
+    return res;
+}
@@ -0,0 +1,704 @@
+/*
+ * libprogskeet - ProgSkeet library
+ * Copyright (C) 2012 Axel Gembe <axel@gembe.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * ProgSkeet SPI flash functions
+ *
+ * SPI mode 0 bit-banged with SET_GPIO. Each bit is two SET_GPIO
+ * commands, SCK low with MOSI and SCK high, and the commands for every
+ * byte value are built once per call, so a byte goes out as one copy from
+ * a table. Reads sample MISO with GET_GPIO after each rising edge. All
+ * samples of a transfer land in one RX buffer and are packed into bytes
+ * after the sync.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "progskeet.h"
+#include "progskeet_private.h"
+
+#define SPI_CMD_WRITE_ENABLE        0x06
+#define SPI_CMD_READ_STATUS         0x05
+#define SPI_CMD_READ                0x03
+#define SPI_CMD_FAST_READ           0x0B
+#define SPI_CMD_PAGE_PROGRAM        0x02
+#define SPI_CMD_SECTOR_ERASE        0x20
+#define SPI_CMD_READ_ID             0x9F
+#define SPI_CMD_READ4               0x13
+#define SPI_CMD_FAST_READ4          0x0C
+#define SPI_CMD_PAGE_PROGRAM4       0x12
+#define SPI_CMD_SECTOR_ERASE4       0x21
+
+#define SPI_STATUS_WIP              0x01
+
+#define SPI_DEFAULT_PAGE_SIZE       256
+#define SPI_DEFAULT_SECTOR_SIZE     4096
+#define SPI_DEFAULT_PROGRAM_US      700
+#define SPI_DEFAULT_ERASE_US        45000
+#define SPI_MAX_PROGRAM_US          5000
+
+/* Device side delay between status polls */
+#define SPI_POLL_US                 1000
+#define SPI_POLL_TIMEOUT_US         (10 * 1000 * 1000)
+
+/* Pages programmed per sync before their status is checked */
+#define SPI_PAGES_PER_SYNC          64
+
+/* Bytes of commands per data byte */
+#define SPI_OUT_LEN                 (8 * 6)
+#define SPI_IN_LEN                  (8 * 7)
+
+#define SPI_CMD_OVERHEAD            (16 * SPI_OUT_LEN)
+
+struct progskeet_spi_enc
+{
+    /* Lines with CS# low and SCK low, everything else as it was */
+    uint16_t base;
+
+    char out[256][SPI_OUT_LEN];
+    char in[SPI_IN_LEN];
+};
+
+static char* progskeet_spi_put_gpio(char* p, const uint16_t gpio)
+{
+    *p++ = PROGSKEET_CMD_SET_GPIO;
+    *p++ = (gpio >> 0) & 0xFF;
+    *p++ = (gpio >> 8) & 0xFF;
+
+    return p;
+}
+
+static struct progskeet_spi_enc* progskeet_spi_enc_create(struct progskeet_handle* handle, const struct progskeet_spi_info* spi)
+{
+    struct progskeet_spi_enc* enc;
+    uint16_t mosi;
+    char* p;
+    int v, bit;
+
+    if ((enc = (struct progskeet_spi_enc*)malloc(sizeof(struct progskeet_spi_enc))) == NULL)
+        return NULL;
+
+    enc->base = handle->cur_gpio & ~(spi->cs_gpio | spi->sck_gpio | spi->mosi_gpio);
+
+    for (v = 0; v < 256; v++) {
+        p = enc->out[v];
+
+        for (bit = 7; bit >= 0; bit--) {
+            mosi = (v & (1 << bit)) ? spi->mosi_gpio : 0;
+            p = progskeet_spi_put_gpio(p, enc->base | mosi);
+            p = progskeet_spi_put_gpio(p, enc->base | mosi | spi->sck_gpio);
+        }
+    }
+
+    p = enc->in;
+    for (bit = 7; bit >= 0; bit--) {
+        p = progskeet_spi_put_gpio(p, enc->base);
+        p = progskeet_spi_put_gpio(p, enc->base | spi->sck_gpio);
+        *p++ = PROGSKEET_CMD_GET_GPIO;
+    }
+
+    return enc;
+}
+
+static int progskeet_spi_set(struct progskeet_handle* handle, const uint16_t gpio)
+{
+    char cmdbuf[3];
+    int res;
+
+    progskeet_spi_put_gpio(cmdbuf, gpio);
+
+    if ((res = progskeet_enqueue_tx_buf(handle, cmdbuf, sizeof(cmdbuf))) < 0)
+        return res;
+
+    handle->cur_gpio = gpio;
+
+    return 0;
+}
+
+/* Lines are configured and CS# is deasserted */
+static int progskeet_spi_setup(struct progskeet_handle* handle, const struct progskeet_spi_info* spi)
+{
+    uint16_t dir;
+    int res;
+
+    dir = (handle->cur_gpio_dir | spi->cs_gpio | spi->sck_gpio | spi->mosi_gpio) & ~spi->miso_gpio;
+    if (dir != handle->cur_gpio_dir && (res = progskeet_set_gpio_dir(handle, dir)) < 0)
+        return res;
+
+    return progskeet_spi_set(handle, (handle->cur_gpio & ~spi->sck_gpio) | spi->cs_gpio);
+}
+
+static int progskeet_spi_begin(struct progskeet_handle* handle, const struct progskeet_spi_enc* enc)
+{
+    return progskeet_spi_set(handle, enc->base);
+}
+
+static int progskeet_spi_end(struct progskeet_handle* handle, const struct progskeet_spi_info* spi, const struct progskeet_spi_enc* enc)
+{
+    char cmdbuf[6];
+    int res;
+
+    progskeet_spi_put_gpio(progskeet_spi_put_gpio(cmdbuf, enc->base), enc->base | spi->cs_gpio);
+
+    if ((res = progskeet_enqueue_tx_buf(handle, cmdbuf, sizeof(cmdbuf))) < 0)
+        return res;
+
+    handle->cur_gpio = enc->base | spi->cs_gpio;
+
+    return 0;
+}
+
+static int progskeet_spi_out(struct progskeet_handle* handle, const struct progskeet_spi_enc* enc, const uint8_t* buf, const size_t len)
+{
+    size_t i;
+    int res;
+
+    for (i = 0; i < len; i++) {
+        if ((res = progskeet_enqueue_tx_buf(handle, enc->out[buf[i]], SPI_OUT_LEN)) < 0)
+            return res;
+    }
+
+    return 0;
+}
+
+/* Clocks in len bytes, the raw samples go to raw, 8 per byte */
+static int progskeet_spi_in(struct progskeet_handle* handle, const struct progskeet_spi_enc* enc, uint16_t* raw, const size_t len)
+{
+    size_t i;
+    int res;
+
+    for (i = 0; i < len; i++) {
+        if ((res = progskeet_enqueue_tx_buf(handle, enc->in, SPI_IN_LEN)) < 0)
+            return res;
+    }
+
+    return progskeet_enqueue_rx_buf(handle, raw, len * 8 * sizeof(uint16_t));
+}
+
+static void progskeet_spi_unpack(const struct progskeet_spi_info* spi, const uint16_t* raw, uint8_t* buf, const size_t len)
+{
+    size_t i;
+    uint8_t v;
+    int bit;
+
+    for (i = 0; i < len; i++) {
+        v = 0;
+        for (bit = 0; bit < 8; bit++)
+            v = (uint8_t)((v << 1) | ((raw[i * 8 + bit] & spi->miso_gpio) ? 1 : 0));
+        buf[i] = v;
+    }
+}
+
+static size_t progskeet_spi_put_addr(const struct progskeet_spi_info* spi, uint8_t* p, const uint8_t cmd3, const uint8_t cmd4,
+                                     const uint32_t addr)
+{
+    size_t n = 0;
+
+    if (spi->addr_bytes == 4) {
+        p[n++] = cmd4;
+        p[n++] = (uint8_t)(addr >> 24);
+    } else {
+        p[n++] = cmd3;
+    }
+
+    p[n++] = (uint8_t)(addr >> 16);
+    p[n++] = (uint8_t)(addr >> 8);
+    p[n++] = (uint8_t)(addr >> 0);
+
+    return n;
+}
+
+/* Queues a one byte command */
+static int progskeet_spi_cmd(struct progskeet_handle* handle, const struct progskeet_spi_info* spi,
+                             const struct progskeet_spi_enc* enc, const uint8_t cmd)
+{
+    int res;
+
+    if ((res = progskeet_spi_begin(handle, enc)) < 0)
+        return res;
+
+    if ((res = progskeet_spi_out(handle, enc, &cmd, 1)) < 0)
+        return res;
+
+    return progskeet_spi_end(handle, spi, enc);
+}
+
+static int progskeet_spi_status_start(struct progskeet_handle* handle, const struct progskeet_spi_info* spi,
+                                      const struct progskeet_spi_enc* enc, uint16_t* raw)
+{
+    const uint8_t cmd = SPI_CMD_READ_STATUS;
+    int res;
+
+    if ((res = progskeet_spi_begin(handle, enc)) < 0)
+        return res;
+
+    if ((res = progskeet_spi_out(handle, enc, &cmd, 1)) < 0)
+        return res;
+
+    if ((res = progskeet_spi_in(handle, enc, raw, 1)) < 0)
+        return res;
+
+    return progskeet_spi_end(handle, spi, enc);
+}
+
+/* Polls RDSR until WIP clears, the polls are paced on the device */
+static int progskeet_spi_wait_idle(struct progskeet_handle* handle, const struct progskeet_spi_info* spi,
+                                   const struct progskeet_spi_enc* enc, const uint32_t first_us)
+{
+    uint16_t raw[8];
+    uint32_t waited = 0;
+    uint32_t delay = first_us;
+    uint8_t status;
+    int res;
+
+    while (waited < SPI_POLL_TIMEOUT_US && (res = progskeet_check_cancel(handle)) == 0) {
+        if (delay && (res = progskeet_wait_us(handle, delay)) < 0)
+            return res;
+
+        if ((res = progskeet_spi_status_start(handle, spi, enc, raw)) < 0)
+            return res;
+
+        if ((res = progskeet_sync(handle)) < 0)
+            return res;
+
+        progskeet_spi_unpack(spi, raw, &status, 1);
+        if (!(status & SPI_STATUS_WIP))
+            return 0;
+
+        waited += delay;
+        delay = SPI_POLL_US;
+    }
+
+    if (res < 0)
+        return res;
+
+    progskeet_log(handle, progskeet_log_level_error, "Timeout waiting for the SPI flash\n");
+
+    return -2;
+}
+
+int progskeet_spi_read_id(struct progskeet_handle* handle, struct progskeet_spi_info* spi)
+{
+    struct progskeet_spi_enc* enc;
+    const uint8_t cmd = SPI_CMD_READ_ID;
+    uint16_t raw[3 * 8];
+    int res;
+
+    if (!handle || !spi)
+        return -1;
+
+    if ((res = progskeet_spi_setup(handle, spi)) < 0)
+        return res;
+
+    if ((enc = progskeet_spi_enc_create(handle, spi)) == NULL)
+        return -3;
+
+    progskeet_spi_begin(handle, enc);
+    progskeet_spi_out(handle, enc, &cmd, 1);
+    progskeet_spi_in(handle, enc, raw, 3);
+    res = progskeet_spi_end(handle, spi, enc);
+
+    free(enc);
+
+    if (res < 0 || (res = progskeet_sync(handle)) < 0)
+        return res;
+
+    progskeet_spi_unpack(spi, raw, spi->jedec_id, 3);
+
+    if ((spi->jedec_id[0] == 0x00 || spi->jedec_id[0] == 0xFF) || spi->jedec_id[2] < 10 || spi->jedec_id[2] > 31) {
+        progskeet_log(handle, progskeet_log_level_error, "No SPI flash responded\n");
+        return -2;
+    }
+
+    /* Most vendors encode the capacity as a power of two */
+    spi->size = (uint32_t)1 << spi->jedec_id[2];
+    spi->addr_bytes = spi->size > (1 << 24) ? 4 : 3;
+
+    if (!spi->page_size)
+        spi->page_size = SPI_DEFAULT_PAGE_SIZE;
+    if (!spi->sector_size)
+        spi->sector_size = SPI_DEFAULT_SECTOR_SIZE;
+
+    return 0;
+}
+
+int progskeet_spi_read_status(struct progskeet_handle* handle, const struct progskeet_spi_info* spi, uint8_t* status)
+{
+    struct progskeet_spi_enc* enc;
+    uint16_t raw[8];
+    int res;
+
+    if (!handle || !spi || !status)
+        return -1;
+
+    if ((res = progskeet_spi_setup(handle, spi)) < 0)
+        return res;
+
+    if ((enc = progskeet_spi_enc_create(handle, spi)) == NULL)
+        return -3;
+
+    res = progskeet_spi_status_start(handle, spi, enc, raw);
+
+    free(enc);
+
+    if (res < 0 || (res = progskeet_sync(handle)) < 0)
+        return res;
+
+    progskeet_spi_unpack(spi, raw, status, 1);
+
+    return 0;
+}
+
+static int progskeet_spi_read_run(struct progskeet_handle* handle, const struct progskeet_spi_info* spi,
+                                  const uint32_t addr, char* buf, const size_t len)
+{
+    struct progskeet_spi_enc* enc;
+    uint16_t* raw;
+    uint8_t cmd[6];
+    size_t cmdlen, chunk, max_chunk, done;
+    int res = 0;
+
+    if (!handle || !spi || !buf)
+        return -1;
+
+    if ((res = progskeet_spi_setup(handle, spi)) < 0)
+        return res;
+
+    /* Whatever fits into an empty TX buffer next to the command */
+    max_chunk = (progskeet_tx_free(handle) + handle->txlen - SPI_CMD_OVERHEAD) / SPI_IN_LEN;
+
+    enc = progskeet_spi_enc_create(handle, spi);
+    raw = (uint16_t*)malloc(max_chunk * 8 * sizeof(uint16_t));
+
+    if (!enc || !raw) {
+        free(enc);
+        free(raw);
+        return -3;
+    }
+
+    for (done = 0; done < len && (res = progskeet_check_cancel(handle)) == 0; done += chunk) {
+        if (progskeet_tx_free(handle) < SPI_CMD_OVERHEAD + SPI_IN_LEN && (res = progskeet_sync(handle)) < 0)
+            break;
+
+        chunk = (progskeet_tx_free(handle) - SPI_CMD_OVERHEAD) / SPI_IN_LEN;
+        if (chunk > len - done)
+            chunk = len - done;
+
+        if (spi->fast_read) {
+            cmdlen = progskeet_spi_put_addr(spi, cmd, SPI_CMD_FAST_READ, SPI_CMD_FAST_READ4, addr + (uint32_t)done);
+            cmd[cmdlen++] = 0x00;
+        } else {
+            cmdlen = progskeet_spi_put_addr(spi, cmd, SPI_CMD_READ, SPI_CMD_READ4, addr + (uint32_t)done);
+        }
+
+        progskeet_spi_begin(handle, enc);
+        progskeet_spi_out(handle, enc, cmd, cmdlen);
+        progskeet_spi_in(handle, enc, raw, chunk);
+        progskeet_progress_add(handle, chunk);
+
+        if ((res = progskeet_spi_end(handle, spi, enc)) < 0 || (res = progskeet_sync(handle)) < 0)
+            break;
+
+        progskeet_spi_unpack(spi, raw, (uint8_t*)buf + done, chunk);
+    }
+
+    free(raw);
+    free(enc);
+
+    return res;
+}
+
+int progskeet_spi_read(struct progskeet_handle* handle, const struct progskeet_spi_info* spi,
+                       const uint32_t addr, char* buf, const size_t len)
+{
+    int res;
+
+    if (!handle)
+        return -1;
+
+    progskeet_progress_begin(handle, len);
+    res = progskeet_spi_read_run(handle, spi, addr, buf, len);
+    progskeet_progress_end(handle);
+
+    return res;
+}
+
+static int progskeet_spi_is_erased(const char* buf, const size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if ((uint8_t)buf[i] != 0xFF)
+            return 0;
+    }
+
+    return 1;
+}
+
+/* TX bytes of a page program of len bytes with its status read, waiting program_us */
+static size_t progskeet_spi_page_tx(const size_t len, const uint32_t program_us)
+{
+    return len * SPI_OUT_LEN + 2 * SPI_CMD_OVERHEAD + (program_us / 5 + 1) * 2;
+}
+
+/* Queues the write enable, the page program and the typical program time */
+static int progskeet_spi_page_queue(struct progskeet_handle* handle, const struct progskeet_spi_info* spi,
+                                    const struct progskeet_spi_enc* enc, const uint32_t addr, const char* data, const size_t len)
+{
+    uint8_t cmd[5];
+    size_t cmdlen;
+    int res;
+
+    cmdlen = progskeet_spi_put_addr(spi, cmd, SPI_CMD_PAGE_PROGRAM, SPI_CMD_PAGE_PROGRAM4, addr);
+
+    if ((res = progskeet_spi_cmd(handle, spi, enc, SPI_CMD_WRITE_ENABLE)) < 0 ||
+        (res = progskeet_spi_begin(handle, enc)) < 0 ||
+        (res = progskeet_spi_out(handle, enc, cmd, cmdlen)) < 0 ||
+        (res = progskeet_spi_out(handle, enc, (const uint8_t*)data, len)) < 0 ||
+        (res = progskeet_spi_end(handle, spi, enc)) < 0)
+        return res;
+
+    return progskeet_wait_us(handle, spi->program_us);
+}
+
+/*
+ * Reads back the pages queued after a busy one, starting at first, and
+ * programs the ones the chip dropped again one at a time. The pages that
+ * did get programmed are left alone.
+ */
+static int progskeet_spi_program_retry(struct progskeet_handle* handle, const struct progskeet_spi_info* spi,
+                                       const struct progskeet_spi_enc* enc, const char* buf, const uint32_t* page_addr,
+                                       const size_t* page_off, const size_t* page_len, const int first, const int pages)
+{
+    uint16_t* raw;
+    char* data;
+    uint8_t cmd[5];
+    size_t cmdlen;
+    int res = 0;
+    int i;
+
+    raw = (uint16_t*)malloc(spi->page_size * 8 * sizeof(uint16_t));
+    data = (char*)malloc(spi->page_size);
+
+    if (!raw || !data) {
+        free(raw);
+        free(data);
+        return -3;
+    }
+
+    for (i = first; i < pages; i++) {
+        cmdlen = progskeet_spi_put_addr(spi, cmd, SPI_CMD_READ, SPI_CMD_READ4, page_addr[i]);
+
+        if ((res = progskeet_spi_begin(handle, enc)) < 0 ||
+            (res = progskeet_spi_out(handle, enc, cmd, cmdlen)) < 0 ||
+            (res = progskeet_spi_in(handle, enc, raw, page_len[i])) < 0 ||
+            (res = progskeet_spi_end(handle, spi, enc)) < 0 ||
+            (res = progskeet_sync(handle)) < 0)
+            break;
+
+        progskeet_spi_unpack(spi, raw, (uint8_t*)data, page_len[i]);
+
+        if (memcmp(data, buf + page_off[i], page_len[i]) == 0)
+            continue;
+
+        progskeet_log(handle, progskeet_log_level_verbose, "SPI page at 0x%08X was dropped, programming it again\n", page_addr[i]);
+
+        if ((res = progskeet_spi_page_queue(handle, spi, enc, page_addr[i], buf + page_off[i], page_len[i])) < 0 ||
+            (res = progskeet_spi_wait_idle(handle, spi, enc, 0)) < 0)
+            break;
+    }
+
+    free(data);
+    free(raw);
+
+    return res;
+}
+
+/*
+ * Pages are programmed back to back with a wait of the typical program
+ * time in between, and a status read after every page. A page that was
+ * still busy at its status read made the chip ignore the next write
+ * enable, so after a host side poll the pages after it are checked and
+ * the dropped ones programmed again, and the wait gets longer.
+ */
+static int progskeet_spi_program_run(struct progskeet_handle* handle, struct progskeet_spi_info* spi,
+                                     const uint32_t addr, const char* buf, const size_t len)
+{
+    struct progskeet_spi_enc* enc;
+    uint16_t (*raw)[8];
+    uint32_t page_addr[SPI_PAGES_PER_SYNC];
+    size_t page_off[SPI_PAGES_PER_SYNC];
+    size_t page_len[SPI_PAGES_PER_SYNC];
+    uint8_t status;
+    size_t chunk, done, counted = 0;
+    size_t page_tx;
+    int pages, busy, i;
+    int res = 0;
+
+    if (!handle || !spi || !buf || !spi->page_size)
+        return -1;
+
+    if (!spi->program_us)
+        spi->program_us = SPI_DEFAULT_PROGRAM_US;
+
+    /* A page and its readback have to fit an empty TX buffer, at the longest wait it can grow to */
+    page_tx = progskeet_spi_page_tx(spi->page_size, spi->program_us > SPI_MAX_PROGRAM_US ? spi->program_us : SPI_MAX_PROGRAM_US);
+    if (page_tx < spi->page_size * SPI_IN_LEN + SPI_CMD_OVERHEAD)
+        page_tx = spi->page_size * SPI_IN_LEN + SPI_CMD_OVERHEAD;
+
+    if (page_tx > progskeet_tx_free(handle) + handle->txlen) {
+        progskeet_log(handle, progskeet_log_level_error, "SPI page size %u does not fit the TX buffer\n", (unsigned int)spi->page_size);
+        return -1;
+    }
+
+    if ((res = progskeet_spi_setup(handle, spi)) < 0)
+        return res;
+
+    enc = progskeet_spi_enc_create(handle, spi);
+    raw = (uint16_t (*)[8])malloc(SPI_PAGES_PER_SYNC * sizeof(*raw));
+
+    if (!enc || !raw) {
+        free(enc);
+        free(raw);
+        return -3;
+    }
+
+    done = 0;
+    while (done < len && (res = progskeet_check_cancel(handle)) == 0) {
+        pages = 0;
+
+        while (done < len && pages < SPI_PAGES_PER_SYNC) {
+            chunk = spi->page_size - ((addr + done) % spi->page_size);
+            if (chunk > len - done)
+                chunk = len - done;
+
+            if (progskeet_spi_is_erased(buf + done, chunk)) {
+                done += chunk;
+                continue;
+            }
+
+            if (progskeet_tx_free(handle) < progskeet_spi_page_tx(chunk, spi->program_us))
+                break;
+
+            if ((res = progskeet_spi_page_queue(handle, spi, enc, addr + (uint32_t)done, buf + done, chunk)) < 0 ||
+                (res = progskeet_spi_status_start(handle, spi, enc, raw[pages])) < 0)
+                goto out;
+
+            page_addr[pages] = addr + (uint32_t)done;
+            page_off[pages] = done;
+            page_len[pages] = chunk;
+            pages++;
+
+            done += chunk;
+        }
+
+        if (done > counted) {
+            progskeet_progress_add(handle, done - counted);
+            counted = done;
+        }
+
+        if ((res = progskeet_sync(handle)) < 0)
+            goto out;
+
+        for (busy = -1, i = 0; i < pages && busy < 0; i++) {
+            progskeet_spi_unpack(spi, raw[i], &status, 1);
+            if (status & SPI_STATUS_WIP)
+                busy = i;
+        }
+
+        if (busy < 0 || busy == pages - 1) {
+            /* The last page may still be busy, nothing was lost */
+            if (busy >= 0 && (res = progskeet_spi_wait_idle(handle, spi, enc, 0)) < 0)
+                goto out;
+            continue;
+        }
+
+        progskeet_log(handle, progskeet_log_level_verbose, "SPI page at 0x%08X was still busy, retrying\n", page_addr[busy]);
+
+        if ((res = progskeet_spi_wait_idle(handle, spi, enc, 0)) < 0)
+            goto out;
+
+        if (spi->program_us < SPI_MAX_PROGRAM_US)
+            spi->program_us = spi->program_us + spi->program_us / 2 < SPI_MAX_PROGRAM_US ? spi->program_us + spi->program_us / 2 : SPI_MAX_PROGRAM_US;
+
+        if ((res = progskeet_spi_program_retry(handle, spi, enc, buf, page_addr, page_off, page_len, busy + 1, pages)) < 0)
+            goto out;
+    }
+
+    /* The last page of the last batch is left running */
+    res = progskeet_spi_wait_idle(handle, spi, enc, 0);
+
+out:
+    free(raw);
+    free(enc);
+
+    return res;
+}
+
+int progskeet_spi_program(struct progskeet_handle* handle, struct progskeet_spi_info* spi,
+                          const uint32_t addr, const char* buf, const size_t len)
+{
+    int res;
+
+    if (!handle)
+        return -1;
+
+    progskeet_progress_begin(handle, len);
+    res = progskeet_spi_program_run(handle, spi, addr, buf, len);
+    progskeet_progress_end(handle);
+
+    return res;
+}
+
+int progskeet_spi_erase(struct progskeet_handle* handle, const struct progskeet_spi_info* spi,
+                        const uint32_t addr, const uint32_t len)
+{
+    struct progskeet_spi_enc* enc;
+    uint8_t cmd[5];
+    size_t cmdlen;
+    uint32_t cur;
+    int res = 0;
+
+    if (!handle || !spi || !spi->sector_size)
+        return -1;
+
+    if ((res = progskeet_spi_setup(handle, spi)) < 0)
+        return res;
+
+    if ((enc = progskeet_spi_enc_create(handle, spi)) == NULL)
+        return -3;
+
+    for (cur = addr - (addr % spi->sector_size); cur < addr + len && (res = progskeet_check_cancel(handle)) == 0; cur += spi->sector_size) {
+        cmdlen = progskeet_spi_put_addr(spi, cmd, SPI_CMD_SECTOR_ERASE, SPI_CMD_SECTOR_ERASE4, cur);
+
+        progskeet_spi_cmd(handle, spi, enc, SPI_CMD_WRITE_ENABLE);
+        progskeet_spi_begin(handle, enc);
+        progskeet_spi_out(handle, enc, cmd, cmdlen);
+
+        if ((res = progskeet_spi_end(handle, spi, enc)) < 0)
+            break;
+
+        if ((res = progskeet_spi_wait_idle(handle, spi, enc, spi->erase_us ? spi->erase_us : SPI_DEFAULT_ERASE_US)) < 0)
+            break;
+    }
+
+    free(enc);
+
+    return res;
+}
@@ -20,6 +20,8 @@
  * ProgSkeet utility functions
  */
 
+#include <time.h>
+
 #include "progskeet.h"
 #include "progskeet_private.h"
 
@@ -44,63 +46,28 @@ int progskeet_wait(struct progskeet_handle* handle, const uint32_t seconds)
     return progskeet_nop(handle, seconds * 47940000);
 }
 
-int progskeet_testshorts(struct progskeet_handle* handle, uint32_t* result)
+uint64_t progskeet_time_us()
 {
-    uint16_t g_result[16];
-    uint16_t d_result[16];
-    int i;
-
-    if (!handle || !result)
-        return -1;
+    struct timespec ts;
 
-    progskeet_config_set(handle, 0, PROGSKEET_CFG_16BIT, PROGSKEET_CFG_NONE);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
 
-    for(i = 0; i < 16; i++) {
-        progskeet_write_addr(handle, 0, 1 << i);
-        progskeet_wait_us(handle, 20);
-        progskeet_read(handle, (char*)&d_result[i], 2);
-        progskeet_set_gpio_dir(handle, 0xFFFF);
-        progskeet_set_gpio(handle, 0);
-        progskeet_set_gpio(handle, 0);
-        progskeet_set_gpio(handle, 0);
-        progskeet_set_gpio(handle, 0);
-        progskeet_set_gpio(handle, 0);
-        progskeet_set_gpio(handle, 0);
-        progskeet_set_gpio(handle, 0);
-        progskeet_set_gpio(handle, 0);
-        progskeet_set_gpio(handle, 0);
-        progskeet_set_gpio(handle, 0);
-        progskeet_set_gpio(handle, 0);
-        progskeet_set_gpio(handle, 0);
-        progskeet_set_gpio(handle, 0);
-        progskeet_set_gpio(handle, 0);
-        progskeet_set_gpio(handle, 0);
-        progskeet_set_gpio(handle, 0);
-        progskeet_set_gpio(handle, 0);
-        progskeet_set_gpio(handle, 0);
-        progskeet_set_gpio(handle, 0);
-        progskeet_set_gpio(handle, 0);
-        progskeet_set_gpio(handle, 0);
-        progskeet_set_gpio(handle, 0);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-        progskeet_nop(handle, 255);
-        progskeet_nop(handle, 255);
+int progskeet_testshorts(struct progskeet_handle* handle, uint32_t* result)
+{
+    struct progskeet_diag diag;
+    int res;
 
-        progskeet_set_gpio(handle, 1 << i);
-        progskeet_set_gpio_dir(handle, 1 << i);
-        progskeet_wait_us(handle, 20);
-        progskeet_set_gpio_dir(handle, 0);
-        progskeet_get_gpio(handle, &g_result[i]);
-    }
+    if (!handle || !result)
+        return -1;
 
-    progskeet_sync(handle);
+    /* Data lines in the low half, GPIOs in the high half */
+    if ((res = progskeet_diagnose(handle, 0xFFFF, 0, &diag)) < 0)
+        return res;
 
-    for (i = 0; i < 16; i++) {
-        if (d_result[i] != (1 << i))
-            *result |= (1 << i);
-        if (g_result[i] != (1 << i))
-            *result |= (1 << (i+16));
-    }
+    *result |= diag.data_faults | (diag.gpio_faults << 16);
 
     return 0;
 }
@@ -0,0 +1,233 @@
+/*
+ * libprogskeet - ProgSkeet library
+ * Copyright (C) 2012 Axel Gembe <axel@gembe.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * ProgSkeet worker threads
+ *
+ * A small pool that runs jobs in submission order. With a single thread
+ * the jobs also complete in order, which is what the hashing relies on.
+ * Without thread support the jobs simply run inside submit.
+ */
+
+#ifndef WIN32
+#include <pthread.h>
+#include <unistd.h>
+#endif /* !WIN32 */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "progskeet.h"
+#include "progskeet_private.h"
+
+struct progskeet_work
+{
+    progskeet_work_fn fn;
+    void* arg;
+
+    struct progskeet_work* next;
+};
+
+struct progskeet_workers
+{
+    unsigned int count;
+
+#ifndef WIN32
+    pthread_t* threads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t idle_cond;
+#endif /* !WIN32 */
+
+    struct progskeet_work* head;
+    struct progskeet_work* tail;
+
+    /* Jobs queued or running */
+    unsigned int pending;
+
+    int stop;
+};
+
+#ifndef WIN32
+
+static void* progskeet_workers_thread(void* arg)
+{
+    struct progskeet_workers* workers = (struct progskeet_workers*)arg;
+    struct progskeet_work* work;
+
+    pthread_mutex_lock(&workers->lock);
+
+    for (;;) {
+        while (!workers->head && !workers->stop)
+            pthread_cond_wait(&workers->work_cond, &workers->lock);
+
+        if (!workers->head)
+            break;
+
+        work = workers->head;
+        workers->head = work->next;
+        if (!workers->head)
+            workers->tail = NULL;
+
+        pthread_mutex_unlock(&workers->lock);
+
+        work->fn(work->arg);
+        free(work);
+
+        pthread_mutex_lock(&workers->lock);
+
+        if (--workers->pending == 0)
+            pthread_cond_broadcast(&workers->idle_cond);
+    }
+
+    pthread_mutex_unlock(&workers->lock);
+
+    return NULL;
+}
+
+#endif /* !WIN32 */
+
+unsigned int progskeet_workers_cpu_count()
+{
+#if !defined(WIN32) && defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return n > 0 ? (unsigned int)n : 1;
+#else /* WIN32 || !_SC_NPROCESSORS_ONLN */
+    return 1;
+#endif /* !WIN32 && _SC_NPROCESSORS_ONLN */
+}
+
+struct progskeet_workers* progskeet_workers_create(unsigned int count)
+{
+    struct progskeet_workers* workers;
+    unsigned int i;
+
+    workers = (struct progskeet_workers*)malloc(sizeof(struct progskeet_workers));
+    if (!workers)
+        return NULL;
+
+    memset(workers, 0, sizeof(struct progskeet_workers));
+
+#ifndef WIN32
+    pthread_mutex_init(&workers->lock, NULL);
+    pthread_cond_init(&workers->work_cond, NULL);
+    pthread_cond_init(&workers->idle_cond, NULL);
+
+    if (count > 0) {
+        workers->threads = (pthread_t*)malloc(count * sizeof(pthread_t));
+
+        for (i = 0; workers->threads && i < count; i++) {
+            if (pthread_create(&workers->threads[i], NULL, progskeet_workers_thread, workers) != 0)
+                break;
+        }
+
+        workers->count = i;
+    }
+#else /* WIN32 */
+    (void)i;
+#endif /* !WIN32 */
+
+    return workers;
+}
+
+int progskeet_workers_submit(struct progskeet_workers* workers, progskeet_work_fn fn, void* arg)
+{
+    struct progskeet_work* work;
+
+    if (!workers || !fn)
+        return -1;
+
+    /* No threads, run it right away */
+    if (workers->count == 0) {
+        fn(arg);
+        return 0;
+    }
+
+    work = (struct progskeet_work*)malloc(sizeof(struct progskeet_work));
+    if (!work)
+        return -2;
+
+    work->fn = fn;
+    work->arg = arg;
+    work->next = NULL;
+
+#ifndef WIN32
+    pthread_mutex_lock(&workers->lock);
+
+    if (workers->tail)
+        workers->tail->next = work;
+    else
+        workers->head = work;
+    workers->tail = work;
+
+    workers->pending++;
+
+    pthread_cond_signal(&workers->work_cond);
+    pthread_mutex_unlock(&workers->lock);
+#endif /* !WIN32 */
+
+    return 0;
+}
+
+int progskeet_workers_wait(struct progskeet_workers* workers)
+{
+    if (!workers)
+        return -1;
+
+#ifndef WIN32
+    pthread_mutex_lock(&workers->lock);
+
+    while (workers->pending > 0)
+        pthread_cond_wait(&workers->idle_cond, &workers->lock);
+
+    pthread_mutex_unlock(&workers->lock);
+#endif /* !WIN32 */
+
+    return 0;
+}
+
+void progskeet_workers_destroy(struct progskeet_workers* workers)
+{
+    unsigned int i;
+
+    if (!workers)
+        return;
+
+#ifndef WIN32
+    /* Remaining jobs are still run before the threads exit */
+    pthread_mutex_lock(&workers->lock);
+    workers->stop = 1;
+    pthread_cond_broadcast(&workers->work_cond);
+    pthread_mutex_unlock(&workers->lock);
+
+    for (i = 0; i < workers->count; i++)
+        pthread_join(workers->threads[i], NULL);
+
+    free(workers->threads);
+
+    pthread_cond_destroy(&workers->idle_cond);
+    pthread_cond_destroy(&workers->work_cond);
+    pthread_mutex_destroy(&workers->lock);
+#else /* WIN32 */
+    (void)i;
+#endif /* !WIN32 */
+
+    free(workers);
+}